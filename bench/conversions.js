@@ -0,0 +1,95 @@
+// Measures the cost of converting values between JS and PHP: a tight
+// loop of calls from PHP to a JS function, and from JS to a PHP
+// method, for several kinds of argument.
+//
+//   node bench/conversions.js [iterations]
+//
+// Each call converts its arguments on the way in and its return
+// value on the way out, so compare against the `none` case to see
+// the conversion cost alone.
+'use strict';
+var Promise = require('prfun');
+var php = require('../');
+var StringStream = require('../test-stream.js');
+
+var iterations = +(process.argv[2] || 100000);
+
+// PHP expressions for the arguments of each case.
+var cases = {
+  none: '',
+  int: '42',
+  double: '4.2',
+  'short string': '"short"',
+  'long string': 'str_repeat("x", 1024)',
+  buffer: 'new Js\\Buffer(str_repeat("x", 1024))',
+  object: '$obj',
+  '8 ints': '1, 2, 3, 4, 5, 6, 7, 8',
+  '8 strings': '"a", "b", "c", "d", "e", "f", "g", "h"',
+};
+
+var report = function(what, name, ns) {
+  console.log(what + ' ' + name + ': ' +
+              (ns / iterations / 1000).toFixed(2) + ' us/op');
+};
+
+var phpToJs = function(name) {
+  return php.request({
+    source: [
+      'call_user_func(function() {',
+      '  $ctx = $_SERVER["CONTEXT"];',
+      '  $take = $ctx->take;',
+      '  $obj = new stdClass();',
+      '  $n = $ctx->iterations;',
+      '  $start = microtime(true);',
+      '  for ($i = 0; $i < $n; $i++) { $take(' + cases[name] + '); }',
+      '  return (microtime(true) - $start) * 1e9;',
+      '})',
+    ].join('\n'),
+    context: {
+      iterations: iterations,
+      take: function() { return arguments.length; },
+    },
+    stream: new StringStream(),
+  }).then(function(ns) {
+    report('PHP -> JS', name, +ns);
+  });
+};
+
+var jsToPhp = function(name) {
+  return php.request({
+    source: [
+      'call_user_func(function() {',
+      '  class Bench {',
+      '    public function take() { return func_num_args(); }',
+      '  }',
+      '  $obj = new stdClass();',
+      // The arguments are converted to JS values once, up front.
+      '  return $_SERVER["CONTEXT"]->run(new Bench' +
+        (cases[name] ? ', ' + cases[name] : '') + ');',
+      '})',
+    ].join('\n'),
+    context: {
+      run: function(bench) {
+        var args = Array.prototype.slice.call(arguments, 1);
+        var start = process.hrtime();
+        for (var i = 0; i < iterations; i++) {
+          bench.take.apply(bench, args);
+        }
+        var elapsed = process.hrtime(start);
+        return elapsed[0] * 1e9 + elapsed[1];
+      },
+    },
+    stream: new StringStream(),
+  }).then(function(ns) {
+    report('JS -> PHP', name, +ns);
+  });
+};
+
+var names = Object.keys(cases);
+names.reduce(function(p, name) {
+  return p.then(function() { return phpToJs(name); });
+}, Promise.resolve()).then(function() {
+  return names.reduce(function(p, name) {
+    return p.then(function() { return jsToPhp(name); });
+  }, Promise.resolve());
+}).done();
@@ -0,0 +1,160 @@
+// Microbenchmark comparing the message queue fast path against the
+// original mutex-and-list queue.  This is standalone (no node, no PHP):
+//
+//   npm run bench-queue
+//
+// Two threads ping-pong a token through a pair of queues, just as a
+// synchronous PHP->JS->PHP call does, and we report the mean round trip.
+// A second test streams a burst of messages one way, as happens when
+// PHP fires off many asynchronous writes.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include "src/spscring.h"
+
+namespace {
+
+struct Message { int seq; };
+
+// The original MessageQueue: every push and every pop takes the lock.
+class LockedQueue {
+ public:
+  void Push(Message *m) {
+    std::lock_guard<std::mutex> guard(lock_);
+    data_.push_back(m);
+    cond_.notify_all();
+  }
+  Message *PopWait() {
+    std::unique_lock<std::mutex> guard(lock_);
+    while (data_.empty()) { cond_.wait(guard); }
+    Message *m = data_.front();
+    data_.pop_front();
+    return m;
+  }
+
+ private:
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::list<Message *> data_;
+};
+
+// The new MessageQueue: lock-free ring with a locked overflow list;
+// the lock is only used to wake the consumer, and only if it is parked.
+class RingQueue {
+ public:
+  RingQueue() : overflow_size_(0), parked_(false) { }
+  void Push(Message *m) {
+    if (overflow_size_.load(std::memory_order_acquire) != 0 ||
+        !ring_.TryPush(m)) {
+      std::lock_guard<std::mutex> guard(lock_);
+      overflow_.push_back(m);
+      overflow_size_.fetch_add(1, std::memory_order_release);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!parked_.load()) { return; }
+    std::lock_guard<std::mutex> guard(lock_);
+    cond_.notify_all();
+  }
+  Message *PopWait() {
+    while (true) {
+      Message *m = Pop();
+      if (m) { return m; }
+      std::unique_lock<std::mutex> guard(lock_);
+      parked_.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (ring_.IsEmpty() &&
+          overflow_size_.load(std::memory_order_acquire) == 0) {
+        cond_.wait(guard);
+      }
+      parked_.store(false);
+    }
+  }
+
+ private:
+  Message *Pop() {
+    Message *m;
+    if (ring_.TryPop(&m)) { return m; }
+    if (overflow_size_.load(std::memory_order_acquire) == 0) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    // As in MessageQueue::Pop, the ring may have filled since we looked.
+    if (ring_.TryPop(&m)) { return m; }
+    m = overflow_.front();
+    overflow_.pop_front();
+    overflow_size_.fetch_sub(1, std::memory_order_release);
+    return m;
+  }
+  node_php_embed::SpscRing<Message *, 256> ring_;
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::list<Message *> overflow_;
+  std::atomic<std::size_t> overflow_size_;
+  std::atomic<bool> parked_;
+};
+
+double Now() {
+  return std::chrono::duration<double, std::micro>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<typename Q>
+double RoundTrip(int iterations) {
+  Q to_js, to_php;
+  Message msg{0};
+  std::thread js([&]() {
+    for (int i = 0; i < iterations; i++) {
+      Message *m = to_js.PopWait();
+      m->seq++;
+      to_php.Push(m);
+    }
+  });
+  double start = Now();
+  for (int i = 0; i < iterations; i++) {
+    to_js.Push(&msg);
+    to_php.PopWait();
+  }
+  double elapsed = Now() - start;
+  js.join();
+  if (msg.seq != iterations) { std::abort(); }
+  return elapsed / iterations;
+}
+
+template<typename Q>
+double Burst(int iterations) {
+  Q q;
+  Message *msgs = new Message[iterations];
+  std::thread consumer([&]() {
+    for (int i = 0; i < iterations; i++) {
+      if (q.PopWait()->seq != i) { std::abort(); }
+    }
+  });
+  double start = Now();
+  for (int i = 0; i < iterations; i++) {
+    msgs[i].seq = i;
+    q.Push(&msgs[i]);
+  }
+  consumer.join();
+  double elapsed = Now() - start;
+  delete[] msgs;
+  return elapsed / iterations;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int n = (argc > 1) ? std::atoi(argv[1]) : 200000;
+  std::printf("round trip (us/op):  locked %.3f  ring %.3f\n",
+              RoundTrip<LockedQueue>(n), RoundTrip<RingQueue>(n));
+  std::printf("one-way burst (us/msg):  locked %.3f  ring %.3f\n",
+              Burst<LockedQueue>(n), Burst<RingQueue>(n));
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Measures the cost of synchronous cross-thread property accesses:
+// a tight `$ctx->foo` loop from PHP, and a `phpObj.bar` loop from JS.
+//
+//   node bench/roundtrip.js [iterations] [spinLimit]
+//
+// Run once with a spinLimit of 0 (always park) and once with the
+// default to see the effect of spin-then-park waiting.
+'use strict';
+var php = require('../');
+var StringStream = require('../test-stream.js');
+
+var iterations = +(process.argv[2] || 100000);
+if (process.argv[3] !== undefined) {
+  php.configure({ spinLimit: +process.argv[3] });
+}
+
+var report = function(what, ns) {
+  console.log(what + ': ' + (ns / iterations / 1000).toFixed(2) + ' us/op');
+};
+
+var phpToJs = function() {
+  return php.request({
+    source: [
+      'call_user_func(function() {',
+      '  $ctx = $_SERVER["CONTEXT"];',
+      '  $n = $ctx->iterations;',
+      '  $start = microtime(true);',
+      '  for ($i = 0; $i < $n; $i++) { $x = $ctx->foo; }',
+      '  return (microtime(true) - $start) * 1e9;',
+      '})',
+    ].join('\n'),
+    context: { iterations: iterations, foo: 42 },
+    stream: new StringStream(),
+  }).then(function(ns) {
+    report('PHP $ctx->foo', +ns);
+  });
+};
+
+var jsToPhp = function() {
+  return php.request({
+    source: [
+      'call_user_func(function() {',
+      '  class Bench { public $bar = 42; }',
+      '  return $_SERVER["CONTEXT"]->run(new Bench);',
+      '})',
+    ].join('\n'),
+    context: {
+      run: function(phpObj) {
+        var start = process.hrtime();
+        for (var i = 0; i < iterations; i++) {
+          /* jshint unused:false */
+          var x = phpObj.bar;
+        }
+        var elapsed = process.hrtime(start);
+        return elapsed[0] * 1e9 + elapsed[1];
+      },
+    },
+    stream: new StringStream(),
+  }).then(function(ns) {
+    report('JS phpObj.bar', +ns);
+  });
+};
+
+phpToJs().then(jsToPhp).done();
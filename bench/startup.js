@@ -0,0 +1,80 @@
+// Measures the latency distribution of small requests: the time from
+// `php.request` to the first byte of output, and to completion.
+//
+//   node bench/startup.js [requests] [idleMs]
+//
+// Requests are issued one at a time, `idleMs` apart (so that idle
+// threads have time to prepare), first without and then with
+// `prewarm` enabled.
+'use strict';
+var stream = require('readable-stream');
+var util = require('util');
+var Promise = require('prfun');
+var php = require('../');
+
+var requests = +(process.argv[2] || 1000);
+var idleMs = +(process.argv[3] || 2);
+
+// A writable stream which remembers when it first saw output.
+var FirstByte = function() {
+  FirstByte.super_.call(this);
+  this.first = null;
+};
+util.inherits(FirstByte, stream.Writable);
+FirstByte.prototype._write = function(chunk, encoding, callback) {
+  if (this.first === null && chunk.length > 0) {
+    this.first = process.hrtime();
+  }
+  callback();
+};
+
+var us = function(start, end) {
+  return (end[0] - start[0]) * 1e6 + (end[1] - start[1]) / 1e3;
+};
+
+var one = function(ttfb, total) {
+  var out = new FirstByte();
+  var start = process.hrtime();
+  return php.request({
+    source: 'print("<p>Hello, world.</p>")',
+    stream: out,
+  }).then(function() {
+    ttfb.push(us(start, out.first));
+    total.push(us(start, process.hrtime()));
+  });
+};
+
+var report = function(what, samples) {
+  samples.sort(function(a, b) { return a - b; });
+  var pct = function(p) {
+    return samples[Math.min(samples.length - 1,
+                            Math.floor(samples.length * p / 100))];
+  };
+  console.log(what + ': ' + [50, 90, 99].map(function(p) {
+    return 'p' + p + ' ' + pct(p).toFixed(0) + 'us';
+  }).join(', ') + ', max ' + samples[samples.length - 1].toFixed(0) + 'us');
+};
+
+var run = function(prewarm) {
+  php.configure({ prewarm: prewarm });
+  var ttfb = [];
+  var total = [];
+  var before = php.stats().startup;
+  var loop = function(i) {
+    if (i >= requests) { return; }
+    return Promise.delay(idleMs).then(function() {
+      return one(ttfb, total);
+    }).then(function() { return loop(i + 1); });
+  };
+  // Warm up opcache and the source cache first.
+  return one([], []).then(function() { return loop(0); }).then(function() {
+    var after = php.stats().startup;
+    console.log('prewarm ' + prewarm + ' (' +
+                (after.warm - before.warm) + ' warm, ' +
+                (after.cold - before.cold) + ' cold)');
+    report('  first byte', ttfb);
+    report('  complete  ', total);
+  });
+};
+
+run(false).then(function() { return run(true); }).done();
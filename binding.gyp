@@ -37,11 +37,21 @@
       'sources': [
         'src/asyncmapperchannel.cc',
         'src/asyncmessageworker.cc',
+        'src/outputbuffer.cc',
+        'src/outputcompressor.cc',
         'src/phprequestworker.cc',
+        'src/phpthreadpool.cc',
+        'src/postbody.cc',
+        'src/responseheaders.cc',
+        'src/servicecontext.cc',
+        'src/spooleduploads.cc',
+        'src/sourcecache.cc',
         'src/node_php_embed.cc',
+        'src/node_php_jsasync_class.cc',
         'src/node_php_jsbuffer_class.cc',
+        'src/node_php_jsbyref_class.cc',
+        'src/node_php_jsfuture_class.cc',
         'src/node_php_jsobject_class.cc',
-        'src/node_php_jsserver_class.cc',
         'src/node_php_jswait_class.cc',
         'src/node_php_phpobject_class.cc',
       ],
@@ -0,0 +1,117 @@
+'use strict';
+// Long-lived PHP "service" contexts.
+// A context keeps a PHP request open (on its own PHP thread) so that
+// many small calls can share the cost of starting it up.  The
+// underlying request is transparently replaced ("recycled") after a
+// number of calls, or once its memory use has grown too much.
+var Promise = require('prfun');
+
+var makeError = function(message, code) {
+  var e = new Error(message);
+  e.code = code;
+  return e;
+};
+
+// `open` is a function which starts a new PHP request and returns an
+// object with two promises: `handle`, for the native ServiceContext
+// once the request is open, and `closed`, for the request's result
+// once it has shut down.
+var Context = module.exports = function Context(open, options) {
+  options = options || {};
+  this._open = open;
+  this.recycleCalls = options.recycleCalls || Infinity;
+  this.recycleMemory = options.recycleMemory || Infinity;
+  this._session = null;
+  this._live = [];
+  this._closed = false;
+  this.calls = 0;
+  this.recycled = 0;
+};
+
+// Returns the current session, starting a new one if necessary.
+Context.prototype._current = function() {
+  var self = this;
+  if (this._session) { return this._session; }
+  var s = this._open();
+  s.calls = 0;
+  s.native = null;
+  s.baseline = 0;
+  s.retired = false;
+  s.ended = false;
+  s.handle = s.handle.tap(function(h) {
+    s.native = h;
+    s.baseline = h.memoryUsage();
+  });
+  s.closed = s.closed.finally(function() {
+    // The request may have ended on its own (for example, after a
+    // fatal error), in which case we need a new one.
+    s.retired = true;
+    s.ended = true;
+    if (self._session === s) { self._session = null; }
+    self._live.splice(self._live.indexOf(s), 1);
+  });
+  // Failures are reported to callers (and to `close`), not here.
+  s.closed.catch(function() { });
+  this._session = s;
+  this._live.push(s);
+  return s;
+};
+
+// Stop using session `s`.  Calls which have already been sent to it
+// will still complete, since PHP processes them in order.
+Context.prototype._retire = function(s) {
+  if (s.retired) { return; }
+  s.retired = true;
+  if (this._session === s) { this._session = null; }
+  this.recycled++;
+  s.handle.then(function(h) {
+    // The request may already have ended (or be shutting down) on its
+    // own, in which case there's nothing left to close.
+    if (s.ended) { return; }
+    try {
+      h.close();
+    } catch (e) { /* Already closed. */ }
+  }, function() { /* The request never opened; nothing to close. */ });
+};
+
+Context.prototype._send = function(method, args) {
+  var self = this;
+  if (this._closed) {
+    return Promise.reject(makeError('PHP context is closed', 'EPHPCLOSED'));
+  }
+  var s = this._current();
+  this.calls++;
+  if (++s.calls >= this.recycleCalls) { this._retire(s); }
+  return s.handle.then(function(h) {
+    return new Promise(function(resolve, reject) {
+      h[method].apply(h, args.concat(function(err, v) {
+        if (err) { reject(err); } else { resolve(v); }
+      }));
+    });
+  }).finally(function() {
+    if (!s.retired && s.native &&
+        s.native.memoryUsage() - s.baseline > self.recycleMemory) {
+      self._retire(s);
+    }
+  });
+};
+
+// Evaluate `source` (as with `php.request`) inside the open request.
+Context.prototype.eval = function(source, cb) {
+  return this._send('eval', [String(source)]).nodify(cb);
+};
+
+// Invoke the PHP function named `fn` with the given arguments.
+Context.prototype.call = function(fn, args, cb) {
+  if (typeof (args) === 'function') { cb = args; args = []; }
+  return this._send('call', [String(fn), args || []]).nodify(cb);
+};
+
+// Shut down the underlying request(s), after any calls in progress.
+Context.prototype.close = function(cb) {
+  this._closed = true;
+  if (this._session) { this._retire(this._session); }
+  return Promise.all(this._live.map(function(s) {
+    return s.closed.catch(function() { /* Already reported. */ });
+  })).then(function() { }).nodify(cb);
+};
@@ -1,15 +1,20 @@
 'use strict';
 var binary = require('node-pre-gyp');
+var os = require('os');
 var path = require('path');
 var bindingPath =
   binary.find(path.resolve(path.join(__dirname, '..', 'package.json')));
 var bindings = require(bindingPath);
 bindings.setIniPath(path.join(__dirname, 'php.ini'));
-bindings.setStartupFile(path.join(__dirname, 'startup.php'));
 bindings.setExtensionDir(path.dirname(bindingPath));
+bindings.setSourceCacheDir(os.tmpdir());
 
 var packageJson = require('../package.json');
 var Promise = require('prfun');
+var Context = require('./context.js');
+var multipart = require('./multipart.js');
+var OutputStream = require('./outputstream.js');
+var Scheduler = require('./scheduler.js');
 var url = require('url');
 
 var request = Promise.promisify(bindings.request);
@@ -26,6 +31,88 @@ var addslashes = function(s) {
 
 exports.PhpObject = bindings.PhpObject;
 
+// Invoke a method of a PHP object without blocking the event loop
+// while PHP runs it.  Returns a promise for the result.
+exports.invokeAsync = function(obj, method, args, cb) {
+  if (typeof args === 'function') {
+    cb = args;
+    args = [];
+  }
+  return new Promise(function(resolve, reject) {
+    bindings.invokeAsync(obj, method, args || [], function(e, result) {
+      if (e) { reject(e); } else { resolve(result); }
+    });
+  }).nodify(cb);
+};
+
+// Process-wide tuning knobs.
+var config = {
+  threads: os.cpus().length || 1,
+  queueLimit: Infinity,
+  // By default, only hand PHP as many requests as it has threads;
+  // the rest wait in the scheduler, where priorities apply.
+  maxInFlight: null,
+  // Output is sent to JS in chunks of this size, and PHP blocks once
+  // this much is waiting to be written.
+  outputChunkSize: 64 * 1024,
+  outputHighWaterMark: 1024 * 1024,
+};
+var scheduler = new Scheduler({ maxInFlight: config.threads });
+exports.configure = function(options) {
+  options = options || {};
+  if (options.spinLimit !== undefined) {
+    bindings.setSpinLimit(+options.spinLimit);
+  }
+  if (options.outputChunkSize !== undefined ||
+      options.outputHighWaterMark !== undefined) {
+    if (options.outputChunkSize !== undefined) {
+      config.outputChunkSize = Math.max(0, options.outputChunkSize | 0);
+    }
+    if (options.outputHighWaterMark !== undefined) {
+      config.outputHighWaterMark = Math.max(0, options.outputHighWaterMark | 0);
+    }
+    bindings.setOutputBuffer(
+      config.outputChunkSize, config.outputHighWaterMark
+    );
+  }
+  if (options.threads !== undefined || options.queueLimit !== undefined) {
+    if (options.threads !== undefined) {
+      config.threads = Math.max(1, options.threads | 0);
+    }
+    if (options.queueLimit !== undefined) {
+      config.queueLimit = Math.max(0, +options.queueLimit);
+    }
+    bindings.setThreadPool(
+      config.threads,
+      // The native side uses -1 to mean "unlimited".
+      isFinite(config.queueLimit) ? (config.queueLimit | 0) : -1
+    );
+  }
+  if (options.prewarm !== undefined) {
+    bindings.setPrewarm(!!options.prewarm);
+  }
+  if (options.sourceCacheSize !== undefined) {
+    bindings.setSourceCacheSize(
+      Math.max(0, options.sourceCacheSize | 0)
+    );
+  }
+  if (options.maxInFlight !== undefined) {
+    config.maxInFlight = options.maxInFlight;
+  }
+  scheduler.configure({
+    maxInFlight: config.maxInFlight || config.threads,
+    maxQueued: options.maxQueued,
+  });
+};
+
+// Request queue statistics.
+exports.stats = function() {
+  var stats = scheduler.stats();
+  stats.sourceCache = bindings.sourceCacheStats();
+  stats.startup = bindings.startupStats();
+  return stats;
+};
+
 // We write 0-length buffers to the stream and attach a callback
 // to implement "flush".  However, not all streams actually
 // support this -- in particular, HTTP streams will never fire
@@ -91,140 +178,88 @@ StreamWrapper.prototype._onFinish = function() {
 StreamWrapper.prototype._initHeader = function(outStream) {
   this.supportsHeaders = (
     typeof (this.stream.getHeader) === 'function' &&
-    typeof (this.stream.setHeader) === 'function'
+    typeof (this.stream.writeHead) === 'function'
   );
 };
-StreamWrapper.prototype.sendHeader = function(headerBuf) {
-  if (!this.supportsHeaders) { return; }
-  if (headerBuf === null) { return; }  // This indicates the "last header".
-  var header;
-  try {
-    // Headers are sent as Buffer from PHP to JS to avoid re-encoding
-    // in transit.  But node.js wants strings, so we need to do
-    // some decoding.  Technically headers are ISO-8859-1 encoded,
-    // with a strong recommendation to only use ASCII.
-    // See RFC 2616, https://tools.ietf.org/html/rfc7230#section-3.2.4
-    header = headerBuf.toString('ascii');
-  } catch (e) {
-    console.error('BAD HEADER ENCODING, SKIPPING:', headerBuf);
-    return;
-  }
-  var m = /^HTTP\/(\d+\.\d+) (\d+)( (.*))?$/.exec(header);
-  if (m) {
-    this.stream.statusCode = parseInt(m[2], 10);
-    if (m[4]) {
-      this.stream.statusMessage = m[4];
-    }
-    return;
-  }
-  m = /^([^: ]+): (.*)$/.exec(header);
-  if (m) {
-    // Some headers we are allowed to emit more than once;
-    // node.js wants an array of values in that case.
-    var name = m[1];
-    var newValue = m[2];
-    var old = this.stream.getHeader(name);
-    if (old) {
-      if (!Array.isArray(old)) { old = [old]; }
-      newValue = old.concat(newValue);
-    }
-    this.stream.setHeader(name, newValue);
-    return;
+// Headers are parsed on the PHP side and arrive all at once, in the
+// form `writeHead` expects.
+StreamWrapper.prototype.sendHeaders = function(statusCode, statusMessage,
+                                               headers) {
+  if (!this.supportsHeaders || this.stream.headersSent) { return; }
+  var stream = this.stream;
+  Object.keys(headers).forEach(function(name) {
+    // Keep any values for this header which were set before the
+    // request started.
+    var old = stream.getHeader(name);
+    if (old) { headers[name] = [].concat(old, headers[name]); }
+  });
+  if (statusMessage !== undefined) {
+    stream.writeHead(statusCode, statusMessage, headers);
+  } else {
+    stream.writeHead(statusCode, headers);
   }
-  console.error('UNEXPECTED HEADER, SKIPPING:', header);
 };
 
 // READ interface
+// The request body is pushed to the PHP side as it arrives, into a
+// bounded native queue (the "post sink").  If the queue fills up, we
+// pause the input stream until PHP asks us to `resumePost`.
 StreamWrapper.prototype._initRead = function(inStream) {
   this.inputStream = inStream;
-  this.inputSize = 0;
-  this.inputResult = null;
-  this.inputComplete = null;
-  this.inputLeftover = null;
-  this.inputCallbacks = []; // Future read requests.
+  this.inputEnd = !inStream;
   this.inputError = null;
-  this.inputEnd = false;
+  this.postSink = null;
 
-  if (!this.inputStream) {
-    this.inputEnd = true;
-  } else {
-    this.inputStream.on('data', this._onInputData.bind(this, false));
+  if (this.inputStream) {
+    this.inputStream.on('data', this._onInputData.bind(this));
     this.inputStream.on('end', this._onInputEnd.bind(this));
     this.inputStream.on('error', this._onInputError.bind(this));
     this.inputStream.pause();
   }
 };
-StreamWrapper.prototype.read = function(size, cb) {
-  var self = this;
-  var error = this.inputError;
-  if (this.inputResult !== null) {
-    // Read already in progress, queue for later.
-    this.inputCallbacks.push(function() { self.read(size, cb); });
-    return;
-  }
-  if (this.inputEnd || error) {
-    if (cb) { setImmediate(function() { cb(error, new Buffer(0)); }); }
-    return;
-  }
-  this.inputResult = new Buffer(size);
-  this.inputSize = 0;
-  this.inputComplete = cb;
-  if (this.inputLeftover || size === 0) {
-    this._onInputData(false, this.inputLeftover || new Buffer(0));
+// Called by the native side when the PHP request is created.
+StreamWrapper.prototype.setPostSink = function(sink) {
+  this.postSink = sink;
+  if (this.inputError) {
+    sink.error(this.inputError.message);
+  } else if (this.inputEnd) {
+    sink.end();
   } else {
-    // Enable data events.
     this.inputStream.resume();
   }
 };
-StreamWrapper.prototype._onInputData = function(isEnd, buffer) {
-  this.inputStream.pause();
-  var remaining = (this.inputResult.length - this.inputSize);
-  var amt = Math.min(buffer.length, remaining);
-  buffer.copy(this.inputResult, this.inputSize, 0, amt);
-  this.inputSize += amt;
-  // Are we done with this input request?
-  if (this.inputSize === this.inputResult.length || isEnd) {
-    var cb = this.inputComplete;  // Capture this for callback
-    var err = this.inputError;    // Capture this for callback
-    var result = this.inputResult.slice(0, this.inputSize);
-    setImmediate(function() { cb(err, result); });  // Queue callback
-    this.inputResult = this.inputComplete = null;
-    this.inputEnd = isEnd;
-    // Are we done with this buffer?
-    this.inputLeftover = (amt < buffer.length) ? buffer.slice(amt) : null;
-    // Were there any more reads waiting?
-    if (this.inputCallbacks.length > 0) {
-      setImmediate(this.inputCallbacks.shift());
-    }
-  } else {
-    // Need more chunks!
-    this.inputLeftover = null;
-    this.inputStream.resume();
+StreamWrapper.prototype.resumePost = function() {
+  if (!this.inputEnd) { this.inputStream.resume(); }
+};
+StreamWrapper.prototype._onInputData = function(buffer) {
+  if (!Buffer.isBuffer(buffer)) { buffer = new Buffer(buffer); }
+  if (!this.postSink.push(buffer)) {
+    this.inputStream.pause();
   }
 };
 StreamWrapper.prototype._onInputEnd = function() {
-  if (this.inputResult) {
-    this._onInputData(true, new Buffer(0));
-  } else {
-    this.inputEnd = true;
-  }
-  while (this.inputCallbacks.length > 0) {
-    setImmediate(this.inputCallbacks.shift());
-  }
+  this.inputEnd = true;
+  if (this.postSink) { this.postSink.end(); }
 };
 StreamWrapper.prototype._onInputError = function(e) {
+  // PHP is warned that the body was truncated, and the request fails
+  // once PHP is done.
+  this.inputEnd = true;
   this.inputError = e;
-  this._onInputEnd();
+  if (this.postSink) { this.postSink.error(e.message); }
 };
 
 
-exports.request = function(options, cb) {
-  options = options || {};
+// Translate the options accepted by `php.request` into the arguments
+// of the native `request` method.
+var prepare = function(options, skipBody) {
   var source = options.source;
   if (options.file) {
     source = 'require ' + addslashes(options.file) + ';';
   }
-  var stream = new StreamWrapper(options.request,
+  // If the body is being spooled (or has already been read by an
+  // earlier request), PHP doesn't need to read it.
+  var stream = new StreamWrapper(skipBody ? null : options.request,
                                  options.stream || process.stdout);
   var buildServerVars = function() {
     var server = Object.create(null);
@@ -281,25 +316,172 @@ exports.request = function(options, cb) {
   };
   var args = options.args || [];
   var serverVars = buildServerVars();
-  // This function initializes $_SERVER inside the PHP request.
-  var initServer = function(server, cb) {
-    // This loop deliberately doesn't use "hasOwnProperty" in order to
-    // allow serverVars to be inherited from an object with defaults.
-    for (var f in serverVars) {
-      server[f] = serverVars[f];
-    }
-    // This hook is for test purposes only.
-    if (options._testInitServer) {
-      options._testInitServer(server);
+  return {
+    source: source,
+    stream: stream,
+    args: args,
+    serverVars: serverVars,
+  };
+};
+
+// Ensure everything written to the stream has been flushed.
+var flush = function(stream) {
+  return new Promise(function(resolve, reject) {
+    stream.write(new Buffer(0), function(e) {
+      if (e) { reject(e); } else { resolve(); }
+    });
+  });
+};
+
+// Returns the multipart boundary if this request's body should be
+// spooled on the node side, or null.
+var spoolBoundary = function(options) {
+  if (!(options.spoolUploads && options.request &&
+        options.request.method === 'POST')) {
+    return null;
+  }
+  var headers = options.request.headers || {};
+  return multipart.boundary(headers['content-type']);
+};
+
+// Pick a content coding we support from an Accept-Encoding header,
+// preferring gzip.  Returns null if there isn't one.
+var negotiateEncoding = function(acceptEncoding) {
+  var q = Object.create(null);
+  String(acceptEncoding || '').split(',').forEach(function(item) {
+    var m = /^\s*([^\s;]+)\s*(?:;\s*q\s*=\s*([0-9.]+))?/.exec(item);
+    if (m) { q[m[1].toLowerCase()] = m[2] === undefined ? 1 : +m[2]; }
+  });
+  var best = null;
+  var bestQuality = 0;
+  ['gzip', 'deflate'].forEach(function(encoding) {
+    var quality = encoding in q ? q[encoding] : ('*' in q ? q['*'] : 0);
+    if (quality > bestQuality) {
+      best = encoding;
+      bestQuality = quality;
     }
-    cb();
+  });
+  return best;
+};
+
+// Translate the `compress` option into its native form, or null if
+// this response shouldn't be compressed.
+var compression = function(options) {
+  var c = options.compress;
+  if (!c) { return null; }
+  if (typeof c !== 'object') { c = {}; }
+  var encoding = c.encoding;
+  if (!encoding) {
+    var req = options.request;
+    if (!req || req.method === 'HEAD') { return null; }
+    encoding = negotiateEncoding((req.headers || {})['accept-encoding']);
+  }
+  if (encoding !== 'gzip' && encoding !== 'deflate') { return null; }
+  return {
+    encoding: encoding,
+    level: c.level === undefined ? -1 : (c.level | 0),
+    minSize: c.minSize === undefined ? 1024 : Math.max(0, c.minSize | 0),
   };
-  return request(source, stream, args, serverVars, initServer).tap(function() {
+};
+
+exports.request = function(options, cb) {
+  options = options || {};
+  var boundary = spoolBoundary(options);
+  var r = prepare(options, !!boundary);
+  var uploads = null;
+  // Read the whole body before taking up a PHP thread.
+  var spooled = !boundary ? Promise.resolve() :
+      multipart.spool(options.request, boundary, {
+        dir: options.spoolUploads.dir,
+        maxFileSize: options.spoolUploads.maxFileSize,
+        maxBodySize: options.spoolUploads.maxBodySize,
+        maxFieldSize: options.spoolUploads.maxFieldSize,
+        maxFields: options.spoolUploads.maxFields,
+        maxFiles: options.spoolUploads.maxFiles,
+      }).then(function(u) { uploads = u; });
+  return spooled.then(function() {
+    return scheduler.schedule({
+      priority: options.priority,
+      deadline: options.deadline,
+    }, function() {
+      return request(r.source, r.stream, r.args, r.serverVars, {
+        sourceCache: options.sourceCache,
+        uploads: uploads,
+        compress: compression(options),
+        outputHighWaterMark: options.outputHighWaterMark,
+      });
+    });
+  }).tap(function() {
     // Ensure the stream is flushed before promise is resolved.
-    return new Promise(function(resolve, reject) {
-      stream.write(new Buffer(0), function(e) {
-        if (e) { reject(e); } else { resolve(); }
+    return flush(r.stream);
+  }).tap(function() {
+    if (r.stream.inputError) { throw r.stream.inputError; }
+  }).finally(function() {
+    // This always runs: PHP removes the files it was given, so this
+    // only finds leftovers if the request failed before PHP saw them.
+    return uploads && multipart.cleanup(uploads.files);
+  }).nodify(cb);
+};
+
+// Like `request`, but returns a readable stream of the output.
+exports.requestStream = function(options) {
+  options = options || {};
+  var highWaterMark = options.highWaterMark !== undefined ?
+      Math.max(0, options.highWaterMark | 0) : config.outputChunkSize;
+  var out = new OutputStream({ highWaterMark: highWaterMark });
+  options = Object.create(options);
+  options.stream = out;
+  // Bound the output waiting on the PHP side as well.
+  options.outputHighWaterMark = highWaterMark;
+  out.result = exports.request(options).then(function(result) {
+    out._finish(null);
+    return result;
+  }, function(e) {
+    out._finish(e);
+    throw e;
+  });
+  // Errors are reported as 'error' events; don't also complain about
+  // an unhandled rejection if nobody looks at `result`.
+  out.result.catch(function() { });
+  return out;
+};
+
+exports.openContext = function(options, cb) {
+  options = options || {};
+  if (options.source === undefined && !options.file) {
+    options = Object.create(options);
+    options.source = 'null';
+  }
+  var sessions = 0;
+  // Start a new PHP request which stays open until closed.
+  var open = function() {
+    // Each request gets its own stream wrapper, since a retiring
+    // request may still be running alongside its replacement.  Only
+    // the first one can read the request body, if there is one.
+    var r = prepare(options, sessions++ > 0);
+    var onOpen;
+    var handle = new Promise(function(resolve) { onOpen = resolve; });
+    var closed = scheduler.schedule({
+      priority: options.priority,
+      deadline: options.deadline,
+    }, function() {
+      return request(r.source, r.stream, r.args, r.serverVars, {
+        sourceCache: options.sourceCache,
+        onOpen: onOpen,
       });
+    }).tap(function() {
+      return flush(r.stream);
     });
+    return {
+      // If the request ends before it opens, its startup source failed.
+      handle: Promise.race([handle, closed.then(function() {
+        throw new Error('PHP context could not be opened');
+      })]),
+      closed: closed,
+    };
+  };
+  var context = new Context(open, options);
+  return context._current().handle.then(function() {
+    return context;
   }).nodify(cb);
 };
@@ -0,0 +1,282 @@
+'use strict';
+// Parse multipart/form-data request bodies on the node side.
+// Uploaded files are spooled straight to temporary files, so that the
+// PHP request doesn't have to start until the whole body has arrived,
+// and file contents never need to cross over to the PHP thread.  The
+// result is handed to the native side, which fills in `$_POST` and
+// `$_FILES` the way PHP's own rfc1867 parser would.
+var crypto = require('crypto');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var Promise = require('prfun');
+
+// PHP's UPLOAD_ERR_* constants.
+var UPLOAD_ERR_OK = 0;
+var UPLOAD_ERR_INI_SIZE = 1;
+var UPLOAD_ERR_NO_FILE = 4;
+
+// Don't let a malicious client make us buffer unbounded part headers.
+var MAX_HEADER_SIZE = 16 * 1024;
+
+// Default limits, after PHP's `post_max_size`, `max_input_vars` and
+// `max_file_uploads` settings.
+var DEFAULT_MAX_BODY_SIZE = 8 * 1024 * 1024;
+var DEFAULT_MAX_FIELDS = 1000;
+var DEFAULT_MAX_FILES = 20;
+
+var EMPTY = new Buffer(0);
+
+// Returns the boundary from a multipart/form-data content type, or null.
+exports.boundary = function(contentType) {
+  if (!/^\s*multipart\/form-data\s*;/i.test(contentType || '')) {
+    return null;
+  }
+  var m = /;\s*boundary=(?:"([^"]+)"|([^;\s]+))/i.exec(contentType);
+  return m ? (m[1] || m[2]) : null;
+};
+
+var Spooler = function(boundary, options) {
+  this.delimiter = new Buffer('\r\n--' + boundary);
+  // Pretend the body started with a line break, so that the first
+  // boundary matches the same delimiter as the others.
+  this.buf = new Buffer('\r\n');
+  this.state = 'preamble';
+  this.dir = options.dir || os.tmpdir();
+  this.maxFileSize = options.maxFileSize || Infinity;
+  this.maxBodySize = options.maxBodySize || DEFAULT_MAX_BODY_SIZE;
+  // Non-file fields are held in memory, so they are limited too.
+  this.maxFieldSize = options.maxFieldSize || this.maxBodySize;
+  // Zero is a sensible limit here: no fields, or no files, at all.
+  this.maxFields = options.maxFields !== undefined ?
+    options.maxFields : DEFAULT_MAX_FIELDS;
+  this.maxFiles = options.maxFiles !== undefined ?
+    options.maxFiles : DEFAULT_MAX_FILES;
+  this.size = 0;
+  this.fieldCount = 0;
+  this.fileCount = 0;
+  this.part = null;
+  this.fields = [];
+  this.files = [];
+  this.discarded = [];  // Temporary files which PHP won't see.
+  this.writes = [];
+};
+
+Spooler.prototype.write = function(chunk, input) {
+  this.size += chunk.length;
+  if (this.size > this.maxBodySize) {
+    throw new Error('multipart body too large');
+  }
+  this.buf = this.buf.length ? Buffer.concat([this.buf, chunk]) : chunk;
+  this.input = input;
+  for (;;) {
+    var i;
+    switch (this.state) {
+    case 'preamble':
+    case 'body':
+      i = this.buf.indexOf(this.delimiter);
+      if (i < 0) {
+        // Hang on to anything which could be the start of a delimiter.
+        i = Math.max(0, this.buf.length - (this.delimiter.length - 1));
+        this._data(this.buf.slice(0, i));
+        this.buf = this.buf.slice(i);
+        return;
+      }
+      this._data(this.buf.slice(0, i));
+      this._endPart();
+      this.buf = this.buf.slice(i + this.delimiter.length);
+      this.state = 'delimiter';
+      break;
+    case 'delimiter':
+      if (this.buf.length < 2) { return; }
+      var next = this.buf.toString('binary', 0, 2);
+      if (next === '--') {
+        this.state = 'done';
+      } else if (next === '\r\n') {
+        this.buf = this.buf.slice(2);
+        this.state = 'headers';
+      } else {
+        throw new Error('malformed multipart body');
+      }
+      break;
+    case 'headers':
+      if (this.buf.toString('binary', 0, 2) === '\r\n') {
+        i = 0;  // A part with no headers at all.
+      } else {
+        i = this.buf.indexOf('\r\n\r\n');
+        if (i < 0) {
+          if (this.buf.length > MAX_HEADER_SIZE) {
+            throw new Error('multipart headers too long');
+          }
+          return;
+        }
+        i += 2;
+      }
+      this._startPart(this.buf.toString('utf8', 0, i));
+      this.buf = this.buf.slice(i + 2);
+      this.state = 'body';
+      break;
+    case 'done':
+      // Ignore the epilogue.
+      this.buf = EMPTY;
+      return;
+    }
+  }
+};
+
+Spooler.prototype._startPart = function(headers) {
+  var disposition = /^content-disposition:\s*form-data(.*)$/im.exec(headers);
+  var type = /^content-type:\s*(.*?)\s*$/im.exec(headers);
+  var param = function(name) {
+    var m = new RegExp(';\\s*' + name + '="([^"]*)"', 'i')
+      .exec(disposition[1]);
+    return m ? m[1] : undefined;
+  };
+  var name = disposition && param('name');
+  if (!name) {
+    // PHP ignores parts without a name.
+    this.part = null;
+    return;
+  }
+  var filename = param('filename');
+  if (filename === undefined) {
+    if (++this.fieldCount > this.maxFields) {
+      throw new Error('too many multipart fields');
+    }
+    this.part = { name: name, chunks: [], size: 0 };
+    return;
+  }
+  // Like PHP, empty file inputs don't count towards the limit.
+  if (filename !== '' && ++this.fileCount > this.maxFiles) {
+    throw new Error('too many multipart files');
+  }
+  var file = {
+    field: name,
+    // Like PHP, only keep the last component of the file name.
+    name: filename.replace(/^.*[\/\\]/, ''),
+    type: type ? type[1] : '',
+    tmpName: '',
+    size: 0,
+    error: UPLOAD_ERR_OK,
+  };
+  this.files.push(file);
+  this.part = { file: file, out: null };
+  if (filename === '') {
+    file.error = UPLOAD_ERR_NO_FILE;
+    return;
+  }
+  file.tmpName = path.join(this.dir, 'php' +
+                           crypto.randomBytes(8).toString('hex'));
+  var out = this.part.out = fs.createWriteStream(file.tmpName, {
+    flags: 'wx', mode: parseInt('600', 8),
+  });
+  this.writes.push(new Promise(function(resolve, reject) {
+    out.on('close', resolve);
+    out.on('error', reject);
+  }));
+};
+
+Spooler.prototype._data = function(data) {
+  var part = this.part;
+  if (!part || data.length === 0) { return; }
+  if (part.chunks) {
+    part.size += data.length;
+    if (part.size > this.maxFieldSize) {
+      throw new Error('multipart field too large');
+    }
+    part.chunks.push(data);
+    return;
+  }
+  if (!part.out) { return; }
+  part.file.size += data.length;
+  if (part.file.size > this.maxFileSize) {
+    // As PHP does for files over upload_max_filesize.
+    part.file.error = UPLOAD_ERR_INI_SIZE;
+    part.file.size = 0;
+    this.discarded.push({ tmpName: part.file.tmpName });
+    part.file.tmpName = '';
+    part.out.end();
+    part.out = null;
+    return;
+  }
+  if (!part.out.write(data)) {
+    var input = this.input;
+    input.pause();
+    part.out.once('drain', function() { input.resume(); });
+  }
+};
+
+Spooler.prototype._endPart = function() {
+  var part = this.part;
+  this.part = null;
+  if (!part) { return; }
+  if (part.chunks) {
+    this.fields.push([part.name, Buffer.concat(part.chunks)]);
+  } else if (part.out) {
+    part.out.end();
+  }
+};
+
+// Stop writing the current part, if any.
+Spooler.prototype.abort = function() {
+  if (this.part && this.part.out) { this.part.out.end(); }
+  this.part = null;
+};
+
+// Read a multipart/form-data body from `input`, returning a promise
+// for `{ fields: [[name, Buffer], ...], files: [...] }`.  Options:
+// `dir` for the temporary files, `maxFileSize`, and the `maxBodySize`,
+// `maxFieldSize`, `maxFields` and `maxFiles` limits; exceeding one of
+// the latter rejects the promise, after removing any spooled files.
+exports.spool = function(input, boundary, options) {
+  var spooler = new Spooler(boundary, options || {});
+  return new Promise(function(resolve, reject) {
+    var fail = function(e) {
+      spooler.abort();
+      input.removeAllListeners('data');
+      input.resume();  // Discard the rest of the body.
+      reject(e);
+    };
+    input.on('data', function(chunk) {
+      try {
+        spooler.write(Buffer.isBuffer(chunk) ? chunk : new Buffer(chunk),
+                      input);
+      } catch (e) {
+        fail(e);
+      }
+    });
+    input.on('error', fail);
+    input.on('end', function() {
+      if (spooler.state !== 'done') {
+        return fail(new Error('truncated multipart body'));
+      }
+      resolve();
+    });
+    input.resume();
+  }).finally(function() {
+    // Even on failure, wait for the files to be closed so that they
+    // can be removed.
+    return Promise.all(spooler.writes.map(function(p) {
+      return p.catch(function() { });
+    }));
+  }).then(function() {
+    return Promise.all(spooler.writes);
+  }).finally(function() {
+    return exports.cleanup(spooler.discarded);
+  }).then(function() {
+    return { fields: spooler.fields, files: spooler.files };
+  }, function(e) {
+    return exports.cleanup(spooler.files).then(function() { throw e; });
+  });
+};
+
+// Remove any temporary files which PHP didn't (because the request
+// failed, for instance).
+exports.cleanup = function(files) {
+  return Promise.all((files || []).map(function(file) {
+    if (!file.tmpName) { return; }
+    return new Promise(function(resolve) {
+      fs.unlink(file.tmpName, function() { resolve(); });
+    });
+  }));
+};
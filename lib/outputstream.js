@@ -0,0 +1,74 @@
+'use strict';
+// A readable stream of a PHP request's output.
+// The native side writes to this the way it writes to any other
+// output stream (through a `StreamWrapper`), but a write is only
+// acknowledged once the data fits within the readable's buffer.  PHP
+// keeps running while the consumer keeps up; once it falls behind,
+// unacknowledged output piles up on the PHP side until the request's
+// high-water mark is reached, and then PHP blocks until the consumer
+// reads some more.
+var stream = require('stream');
+var util = require('util');
+
+var OutputStream = module.exports = function OutputStream(options) {
+  OutputStream.super_.call(this, {
+    highWaterMark: options && options.highWaterMark,
+  });
+  this._needDrain = false;
+  this._finished = false;
+  // Set when PHP sends its response headers.
+  this.statusCode = 200;
+  this.statusMessage = undefined;
+  this.headers = {};
+  this.headersSent = false;
+};
+util.inherits(OutputStream, stream.Readable);
+
+OutputStream.prototype._read = function(size) {
+  if (this._needDrain) {
+    this._needDrain = false;
+    this.emit('drain');
+  }
+};
+
+// The subset of the `stream.Writable` interface which `StreamWrapper`
+// uses.  Returns false if the consumer has fallen behind, in which
+// case a 'drain' event will be emitted once it has caught up.
+OutputStream.prototype.write = function(buffer) {
+  if (this._finished) { return true; }
+  if (buffer.length === 0) { return !this._needDrain; }
+  var more = this.push(buffer);
+  if (!more) { this._needDrain = true; }
+  return more;
+};
+
+// Enough of the `http.ServerResponse` header interface for PHP's
+// `header()` calls to be recorded.  A 'headers' event is emitted when
+// they arrive, before any of the body.
+OutputStream.prototype.getHeader = function(name) {
+  return undefined;
+};
+OutputStream.prototype.writeHead = function(statusCode, statusMessage,
+                                            headers) {
+  if (typeof statusMessage === 'object') {
+    headers = statusMessage;
+    statusMessage = undefined;
+  }
+  this.statusCode = statusCode;
+  this.statusMessage = statusMessage;
+  this.headers = headers || {};
+  this.headersSent = true;
+  this.emit('headers', statusCode, statusMessage, this.headers);
+};
+
+// Called when the PHP request has finished, successfully or not.
+OutputStream.prototype._finish = function(err) {
+  if (this._finished) { return; }
+  this._finished = true;
+  if (err) {
+    this.emit('error', err);
+  }
+  this.push(null);
+  // Don't leave PHP waiting on an acknowledgement.
+  if (this._needDrain) { this._read(); }
+};
@@ -0,0 +1,180 @@
+'use strict';
+// Admission control for PHP requests.
+// Requests wait here (rather than in the native thread pool) until there
+// is room for them to run, so that we can order them by priority, bound
+// the number waiting, and drop ones which have waited too long before
+// PHP ever starts on them.
+var Promise = require('prfun');
+
+// Priority classes, highest first.
+var PRIORITIES = ['high', 'normal', 'low'];
+
+var makeError = function(message, code) {
+  var e = new Error(message);
+  e.code = code;
+  return e;
+};
+
+var Scheduler = module.exports = function Scheduler(options) {
+  options = options || {};
+  this.maxInFlight = Infinity;
+  this.maxQueued = Infinity;
+  this.configure(options);
+  this.inFlight = 0;
+  this.queues = PRIORITIES.map(function() { return []; });
+  this.counts = {
+    started: 0,
+    completed: 0,
+    rejected: 0,
+    expired: 0,
+  };
+  this.waitTime = { total: 0, max: 0 };
+};
+
+Scheduler.PRIORITIES = PRIORITIES;
+
+Scheduler.prototype.configure = function(options) {
+  if (options.maxInFlight !== undefined) {
+    this.maxInFlight = Math.max(1, +options.maxInFlight);
+  }
+  if (options.maxQueued !== undefined) {
+    this.maxQueued = Math.max(0, +options.maxQueued);
+  }
+  if (this.queues) { this._pump(); }
+};
+
+// Returns the number of requests currently waiting.
+Scheduler.prototype.queued = function() {
+  return this.queues.reduce(function(n, q) { return n + q.length; }, 0);
+};
+
+// Run `fn` (which returns a Promise) once there is room.
+// `options.priority` is one of `Scheduler.PRIORITIES` (default 'normal');
+// `options.deadline` is an optional `Date` or millisecond timestamp after
+// which the request is dropped if it hasn't started yet.
+// The returned Promise is rejected with code `EPHPQUEUEFULL` or
+// `EPHPDEADLINE` if the request is shed.
+Scheduler.prototype.schedule = function(options, fn) {
+  var self = this;
+  options = options || {};
+  var level = PRIORITIES.indexOf(options.priority || 'normal');
+  if (level < 0) {
+    return Promise.reject(new TypeError(
+      'Bad priority: ' + options.priority
+    ));
+  }
+  var deadline = (options.deadline === undefined) ? Infinity :
+      +options.deadline;
+  if (deadline <= Date.now()) {
+    this.counts.expired++;
+    return Promise.reject(makeError(
+      'PHP request deadline passed', 'EPHPDEADLINE'
+    ));
+  }
+  // Fast path: nothing waiting and room to run.
+  if (this.inFlight < this.maxInFlight && this.queued() === 0) {
+    return this._start(fn, 0);
+  }
+  if (this.queued() >= this.maxQueued && !this._shed(level)) {
+    this.counts.rejected++;
+    return Promise.reject(makeError(
+      'PHP request queue is full', 'EPHPQUEUEFULL'
+    ));
+  }
+  return new Promise(function(resolve, reject) {
+    var entry = {
+      fn: fn,
+      resolve: resolve,
+      reject: reject,
+      enqueued: Date.now(),
+      timer: null,
+    };
+    if (isFinite(deadline)) {
+      entry.timer = setTimeout(function() {
+        self._remove(level, entry);
+        self.counts.expired++;
+        reject(makeError('PHP request deadline passed', 'EPHPDEADLINE'));
+      }, deadline - entry.enqueued);
+      // Don't keep node alive just to expire a request.
+      if (entry.timer.unref) { entry.timer.unref(); }
+    }
+    self.queues[level].push(entry);
+  });
+};
+
+// Make room for a request at `level` by evicting the newest request
+// of the lowest priority class, if that is strictly lower.
+Scheduler.prototype._shed = function(level) {
+  for (var i = PRIORITIES.length - 1; i > level; i--) {
+    if (this.queues[i].length > 0) {
+      var victim = this.queues[i].pop();
+      if (victim.timer) { clearTimeout(victim.timer); }
+      this.counts.rejected++;
+      victim.reject(makeError('PHP request queue is full', 'EPHPQUEUEFULL'));
+      return true;
+    }
+  }
+  return false;
+};
+
+Scheduler.prototype._remove = function(level, entry) {
+  var q = this.queues[level];
+  var i = q.indexOf(entry);
+  if (i >= 0) { q.splice(i, 1); }
+};
+
+Scheduler.prototype._start = function(fn, waited) {
+  var self = this;
+  this.inFlight++;
+  this.counts.started++;
+  this.waitTime.total += waited;
+  this.waitTime.max = Math.max(this.waitTime.max, waited);
+  var done = function() {
+    self.inFlight--;
+    self.counts.completed++;
+    self._pump();
+  };
+  return Promise.try(fn).finally(done);
+};
+
+// Start as many waiting requests as there is room for.
+Scheduler.prototype._pump = function() {
+  while (this.inFlight < this.maxInFlight) {
+    var q = null;
+    for (var i = 0; i < this.queues.length && !q; i++) {
+      if (this.queues[i].length > 0) { q = this.queues[i]; }
+    }
+    if (!q) { return; }
+    var entry = q.shift();
+    if (entry.timer) { clearTimeout(entry.timer); }
+    entry.resolve(this._start(entry.fn, Date.now() - entry.enqueued));
+  }
+};
+
+Scheduler.prototype.stats = function() {
+  var self = this;
+  var now = Date.now();
+  var byPriority = {};
+  var oldest = 0;
+  PRIORITIES.forEach(function(p, i) {
+    var q = self.queues[i];
+    byPriority[p] = q.length;
+    if (q.length > 0) { oldest = Math.max(oldest, now - q[0].enqueued); }
+  });
+  return {
+    inFlight: this.inFlight,
+    queued: this.queued(),
+    queuedByPriority: byPriority,
+    started: this.counts.started,
+    completed: this.counts.completed,
+    rejected: this.counts.rejected,
+    expired: this.counts.expired,
+    // Time spent waiting to start, in milliseconds.
+    waitTime: {
+      mean: this.counts.started ?
+        (this.waitTime.total / this.counts.started) : 0,
+      max: this.waitTime.max,
+      oldestQueued: oldest,
+    },
+  };
+};
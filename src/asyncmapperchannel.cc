@@ -4,8 +4,12 @@
 // Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
 #include "src/asyncmapperchannel.h"
 
+#include <atomic>
 #include <cassert>
+#include <cstdio>
+#include <functional>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "nan.h"
@@ -15,14 +19,63 @@ extern "C" {
 }
 
 #include "src/asyncmessageworker.h"
+#include "src/macros.h"
+#include "src/messages.h"
+#include "src/node_php_jsobject_class.h"
+#include "src/node_php_phpobject_class.h"
 #include "src/values.h"  // for objid_t
 
 namespace node_php_embed {
 
 namespace amw {
 
+// Tells JS that PHP has dropped its proxies for some JS objects.
+class JsReleaseMsg : public MessageToJs {
+ public:
+  JsReleaseMsg(AsyncMapperChannel *channel,
+               AsyncMapperChannel::ReleaseList released)
+      : MessageToJs(channel, nullptr, false), channel_(channel),
+        released_(std::move(released)) { }
+
+ protected:
+  void InJs(JsObjectMapper *m) override {
+    channel_->ReleaseJsIds(released_);
+  }
+  bool IsEmptyRetvalOk() override { return true; }
+
+ private:
+  AsyncMapperChannel *channel_;
+  AsyncMapperChannel::ReleaseList released_;
+};
+
+// Tells PHP that JS has garbage collected its proxies for some PHP
+// objects.
+class PhpReleaseMsg : public MessageToPhp {
+ public:
+  PhpReleaseMsg(AsyncMapperChannel *channel,
+                AsyncMapperChannel::ReleaseList released)
+      : MessageToPhp(channel, nullptr, false), channel_(channel),
+        released_(std::move(released)) { }
+
+ protected:
+  void InPhp(PhpObjectMapper *m TSRMLS_DC) override {
+    channel_->ReleasePhpIds(released_ TSRMLS_CC);
+  }
+  bool IsEmptyRetvalOk() override { return true; }
+
+ private:
+  AsyncMapperChannel *channel_;
+  AsyncMapperChannel::ReleaseList released_;
+};
+
 // AsyncMapperChannel implementation.
 
+// Private keys are interned by V8 (and live forever), so rather than
+// minting a new one for every channel we recycle a small pool of them.
+// Only touched from the JS thread.
+static std::vector<uint32_t> free_js_key_indexes;
+static uint32_t next_js_key_index = 0;
+
 // JsObjectMapper interface -----------------------
 // Callable only from the JavaScript side.
 
@@ -30,65 +83,163 @@ namespace amw {
 objid_t AsyncMapperChannel::IdForJsObj(const v8::Local<v8::Object> o) {
   // Have we already mapped this?
   Nan::HandleScope scope;
-  v8::Local<v8::NativeWeakMap> jsObjToId = Nan::New(js_obj_to_id_);
-  if (jsObjToId->Has(o)) {
-    return Nan::To<objid_t>(jsObjToId->Get(o)).FromJust();
+  uint32_t slot = JsSlotForObj(o);
+  if (slot != kNoSlot) {
+    js_slots_[slot].count++;
+    return js_slots_[slot].id;
   }
+  // Is it one of our proxies?  (Those aren't counted.)
+  objid_t id = PhpObject::IdFor(this, o);
+  if (id) { return id; }
 
   // XXX If o is a Promise, then call PrFunPromise.resolve(o),
-  // and set both of them in the jsObjToId map. This would ensure
+  // and map both of them to the same id. This would ensure
   // that Promise#nodify is available from PHP.
 
-  objid_t id = NewId();
-  jsObjToId->Set(o, Nan::New(id));
-  worker_->SaveToPersistent(id, o);
-  return id;
+  if (!IsValid()) { return 0; }  // We're shutting down.
+  slot = NewJsSlot();
+  if (slot == kNoSlot) { return 0; }  // Too many live objects.
+  JsSlot &s = js_slots_[slot];
+  s.obj.Reset(o);
+  s.id = (slot << 1) | (s.gen << (kSlotBits + 1));
+  s.count = 1;
+  Nan::SetPrivate(o, Nan::New(js_key_), Nan::New(s.id));
+  return s.id;
 }
 
 // Map index to JS object (or create it if necessary).
 v8::Local<v8::Object> AsyncMapperChannel::JsObjForId(objid_t id) {
   Nan::EscapableHandleScope scope;
-  v8::Local<v8::Value> v = worker_->GetFromPersistent(id);
-  if (v->IsObject()) {
-    return scope.Escape(Nan::To<v8::Object>(v).ToLocalChecked());
+  uint32_t slot = JsSlotForId(id);
+  if (slot != kNoSlot) {
+    return scope.Escape(Nan::New(js_slots_[slot].obj));
   }
-  if (!IsValid()) {
-    // This happens when we return an object at the tail of the request.
+  if (!(id & 1) || !IsValid()) {
+    // A JS-owned object which is already gone, or an object sent at
+    // the tail of the request; give back a neutered proxy.
     return scope.Escape(PhpObject::Create(nullptr, 0));
   }
-  // Make a wrapper!
-  v8::Local<v8::NativeWeakMap> jsObjToId = Nan::New(js_obj_to_id_);
+  JsProxy &proxy = js_proxies_[id];
+  proxy.received++;
+  if (proxy.wrap) {
+    return scope.Escape(proxy.wrap->handle());
+  }
+  // Make a wrapper!  We only hold it weakly; when it is collected,
+  // ReleasePhpObj will be called.
   v8::Local<v8::Object> o = PhpObject::Create(this, id);
-  jsObjToId->Set(o, Nan::New(id));
-  worker_->SaveToPersistent(id, o);
+  proxy.wrap = Nan::ObjectWrap::Unwrap<Nan::ObjectWrap>(o);
   return scope.Escape(o);
 }
 
-  // Free JS references associated with an id.
-void AsyncMapperChannel::ClearJsId(objid_t id) {
+// Called from the proxy's destructor, perhaps during GC.
+void AsyncMapperChannel::ReleasePhpObj(objid_t id) {
+  auto it = js_proxies_.find(id);
+  if (it == js_proxies_.end()) { return; }
+  php_releases_.emplace_back(id, it->second.received);
+  js_proxies_.erase(it);
+}
+
+void AsyncMapperChannel::FlushPhpReleases(bool force) {
+  if (php_releases_.empty() || !IsValid() ||
+      (!force && php_releases_.size() < kReleaseBatch)) {
+    return;
+  }
+  SendToPhp(new PhpReleaseMsg(this, std::move(php_releases_)),
+            MessageFlags::ASYNC);
+  php_releases_.clear();
+}
+
+void AsyncMapperChannel::ReleaseJsIds(const ReleaseList &released) {
+  Nan::HandleScope scope;
+  for (auto r : released) {
+    uint32_t slot = JsSlotForId(r.first);
+    if (slot == kNoSlot) { continue; }
+    JsSlot &s = js_slots_[slot];
+    if (s.count > r.second) {
+      // Sent again since; the new proxy will release it later.
+      s.count -= r.second;
+      continue;
+    }
+    FreeJsSlot(slot);
+  }
+}
+
+void AsyncMapperChannel::ClearAllJsIds() {
+  // Don't allocate any more ids.
+  shutdown_.store(true, std::memory_order_release);
   Nan::HandleScope scope;
-  v8::Local<v8::Value> v = worker_->GetFromPersistent(id);
-  if (!v->IsObject()) { return; }
-  v8::Local<v8::Object> o = Nan::To<v8::Object>(v).ToLocalChecked();
-  // There might be other live references to this object; set its
-  // id to 0 to neuter it.
-  PhpObject::MaybeNeuter(this, o);
-  // Remove it from our maps (and release our persistent reference).
-  v8::Local<v8::NativeWeakMap> jsObjToId = Nan::New(js_obj_to_id_);
-  jsObjToId->Delete(o);
-  worker_->DeleteFromPersistent(id);
+  for (const auto &it : js_proxies_) {
+    if (!it.second.wrap) { continue; }
+    // There might be other live references to this proxy; set its
+    // id to 0 to neuter it.
+    PhpObject::MaybeNeuter(this, it.second.wrap->handle());
+  }
+  js_proxies_.clear();
+  for (uint32_t slot = 1; slot < js_slots_.size(); slot++) {
+    if (js_slots_[slot].id) { FreeJsSlot(slot); }
+  }
+  php_releases_.clear();
+}
+
+uint32_t AsyncMapperChannel::NewJsSlot() {
+  uint32_t slot = js_free_slot_;
+  if (slot != kNoSlot) {
+    js_free_slot_ = js_slots_[slot].next_free;
+    return slot;
+  }
+  if (js_slots_.size() > kSlotMask) { return kNoSlot; }
+  slot = js_slots_.size();
+  js_slots_.emplace_back();
+  return slot;
+}
+
+void AsyncMapperChannel::FreeJsSlot(uint32_t slot) {
+  JsSlot &s = js_slots_[slot];
+  Nan::DeletePrivate(Nan::New(s.obj), Nan::New(js_key_));
+  s.obj.Reset();
+  s.id = 0;
+  s.gen++;
+  s.next_free = js_free_slot_;
+  js_free_slot_ = slot;
 }
 
-objid_t AsyncMapperChannel::ClearAllJsIds() {
-  uv_mutex_lock(&id_lock_);
-  objid_t last = next_id_;
-  next_id_ = 0;  // Don't allocate any more ids.
-  uv_mutex_unlock(&id_lock_);
+uint32_t AsyncMapperChannel::JsSlotForId(objid_t id) const {
+  if (id & 1) { return kNoSlot; }  // PHP-owned.
+  uint32_t slot = (id >> 1) & kSlotMask;
+  return (slot != 0 && slot < js_slots_.size() &&
+          js_slots_[slot].id == id) ? slot : kNoSlot;
+}
 
-  for (objid_t id = 1; id < last; id++) {
-    ClearJsId(id);
+uint32_t AsyncMapperChannel::JsSlotForObj(v8::Local<v8::Object> o) const {
+  v8::Local<v8::Value> v;
+  if (!Nan::GetPrivate(o, Nan::New(js_key_)).ToLocal(&v) ||
+      !v->IsUint32()) {
+    return kNoSlot;
   }
-  return last;
+  uint32_t slot = JsSlotForId(Nan::To<uint32_t>(v).FromJust());
+  // The key may have been left behind by an earlier channel which
+  // used the same key name.
+  if (slot == kNoSlot || js_slots_[slot].obj != o) { return kNoSlot; }
+  return slot;
+}
+
+void AsyncMapperChannel::InitJsKey() {
+  if (free_js_key_indexes.empty()) {
+    js_key_index_ = next_js_key_index++;
+  } else {
+    js_key_index_ = free_js_key_indexes.back();
+    free_js_key_indexes.pop_back();
+  }
+  char buf[40];
+  snprintf(buf, sizeof(buf), "node-php-embed:id:%u", js_key_index_);
+  Nan::HandleScope scope;
+  js_key_.Reset(NEW_STR(buf));
+}
+
+void AsyncMapperChannel::ResetJsSlots() {
+  for (auto &s : js_slots_) { s.obj.Reset(); }
+  js_key_.Reset();
+  free_js_key_indexes.push_back(js_key_index_);
 }
 
 // PhpObjectMapper interface -----------------------
@@ -97,80 +248,208 @@ objid_t AsyncMapperChannel::ClearAllJsIds() {
 // Map PHP object to an index.
 objid_t AsyncMapperChannel::IdForPhpObj(zval *z) {
   assert(Z_TYPE_P(z) == IS_OBJECT || Z_TYPE_P(z) == IS_ARRAY);
-  zend_object_handle handle;
+  uint32_t slot = kNoSlot;
   if (Z_TYPE_P(z) == IS_OBJECT) {
     // Object identify is based on an object handle.
-    handle = Z_OBJ_HANDLE_P(z);
-    if (php_obj_to_id_.count(handle)) {
-      return php_obj_to_id_.at(handle);
-    }
+    slot = PhpSlotForHandle(Z_OBJ_HANDLE_P(z));
   } else {
     // Array values are identified with their zval.
-    if (php_arr_to_id_.count(z)) {
-      return php_arr_to_id_.at(z);
-    }
+    auto it = php_arr_slots_.find(z);
+    if (it != php_arr_slots_.end()) { slot = it->second; }
+  }
+  if (slot != kNoSlot) {
+    PhpSlot &s = php_slots_[slot];
+    // (Proxies for JS objects aren't counted.)
+    if (s.z) { s.count++; }
+    return s.id;
   }
 
-  objid_t id = NewId();
-  if (id >= php_obj_list_.size()) { php_obj_list_.resize(id + 1); }
+  if (!IsValid()) { return 0; }  // We're shutting down.
+  slot = NewPhpSlot();
+  if (slot == kNoSlot) { return 0; }  // Too many live objects.
   // Pass by value.  Note that we seem to be very rarely (never?)
   // given refs.
   Z_ADDREF_P(z);
   if (Z_TYPE_P(z) == IS_OBJECT) {
-    php_obj_to_id_[handle] = id;
+    SetPhpSlotForHandle(Z_OBJ_HANDLE_P(z), slot);
   } else {
     // We're going to modify this from JS side, so make sure we have
     // a unique copy (otherwise other copy-on-write references on the
     // PHP side could be unexpectedly altered).
     z = ZVal::Separate(z);
-    php_arr_to_id_[z] = id;
+    php_arr_slots_[z] = slot;
   }
-  php_obj_list_[id] = z;
-  return id;
+  PhpSlot &s = php_slots_[slot];
+  s.z = z;
+  s.id = 1 | (slot << 1) | (s.gen << (kSlotBits + 1));
+  s.count = 1;
+  return s.id;
 }
 
-// Returned value is owned by the object mapper, caller should not release it.
+// Returns a new reference, owned by the caller.
 zval *AsyncMapperChannel::PhpObjForId(objid_t id TSRMLS_DC) {
-  if (id >= php_obj_list_.size()) { php_obj_list_.resize(id + 1); }
-  ZVal z(php_obj_list_[id] ZEND_FILE_LINE_CC);
-  if (z.IsNull()) {
-    node_php_jsobject_create(z.Ptr(), this, id TSRMLS_CC);
-    php_obj_list_[id] = z.Ptr();
-    php_obj_to_id_[Z_OBJ_HANDLE_P(z.Ptr())] = id;
-    // One excess reference, owned by objectmapper.
-    return z.Escape();
-  }
-  // Don't increment reference.
-  return z.Ptr();
-}
-
-// Free PHP references associated with an id.
-void AsyncMapperChannel::ClearPhpId(objid_t id TSRMLS_DC) {
-  zval *z = (id < php_obj_list_.size()) ? php_obj_list_[id] : nullptr;
-  if (z) {
-    node_php_jsobject_maybe_neuter(z TSRMLS_CC);
-    php_obj_list_[id] = nullptr;
-    php_obj_to_id_.erase(Z_OBJ_HANDLE_P(z));
+  uint32_t slot = PhpSlotForId(id);
+  zval *z;
+  if (slot != kNoSlot && php_slots_[slot].z) {
+    z = php_slots_[slot].z;
+    Z_ADDREF_P(z);
+    return z;
+  }
+  MAKE_STD_ZVAL(z);
+  if (slot != kNoSlot) {
+    PhpSlot &s = php_slots_[slot];
+    s.count++;
+    Z_TYPE_P(z) = IS_OBJECT;
+    Z_OBJVAL_P(z) = s.obj;
+    zend_objects_store_add_ref(z TSRMLS_CC);
+    return z;
+  }
+  if (id == 0 || (id & 1) || !IsValid()) {
+    // A PHP-owned object which is already gone, or an object sent
+    // after JS shut down; give back a neutered proxy.
+    node_php_jsobject_create(z, this, 0 TSRMLS_CC);
+    return z;
+  }
+  // Make a proxy.  We only hold it weakly; when it is freed,
+  // ReleaseJsObj will be called.
+  slot = NewPhpSlot();
+  if (slot == kNoSlot) {
+    node_php_jsobject_create(z, this, 0 TSRMLS_CC);
+    return z;
+  }
+  node_php_jsobject_create(z, this, id TSRMLS_CC);
+  PhpSlot &s = php_slots_[slot];
+  s.obj = Z_OBJVAL_P(z);
+  s.id = id;
+  s.count = 1;
+  SetPhpSlotForHandle(Z_OBJ_HANDLE_P(z), slot);
+  php_proxy_slots_[id] = slot;
+  return z;
+}
+
+// Called from the proxy's free_storage handler.
+void AsyncMapperChannel::ReleaseJsObj(objid_t id TSRMLS_DC) {
+  uint32_t slot = PhpSlotForId(id);
+  if (slot == kNoSlot || php_slots_[slot].z) { return; }
+  if (send_js_releases_) {
+    js_releases_.emplace_back(id, php_slots_[slot].count);
+  }
+  FreePhpSlot(slot);
+}
+
+void AsyncMapperChannel::FlushJsReleases(bool force TSRMLS_DC) {
+  if (js_releases_.empty() || !send_js_releases_ || !IsValid() ||
+      (!force && js_releases_.size() < kReleaseBatch)) {
+    return;
+  }
+  SendToJs(new JsReleaseMsg(this, std::move(js_releases_)),
+           MessageFlags::ASYNC TSRMLS_CC);
+  js_releases_.clear();
+}
+
+void AsyncMapperChannel::ReleasePhpIds(const ReleaseList &released
+                                       TSRMLS_DC) {
+  for (auto r : released) {
+    uint32_t slot = PhpSlotForId(r.first);
+    if (slot == kNoSlot || !php_slots_[slot].z) { continue; }
+    PhpSlot &s = php_slots_[slot];
+    if (s.count > r.second) {
+      // Sent again since; the new proxy will release it later.
+      s.count -= r.second;
+      continue;
+    }
+    zval *z = s.z;
+    // Forget the object before releasing it, since its destructor
+    // might send it right back to JS.
+    FreePhpSlot(slot);
     zval_ptr_dtor(&z);
   }
 }
 
-// ObjectMapper interface -----------------------
-// Callable from both threads.
+// Free all PHP references held by the channel.
+void AsyncMapperChannel::ClearAllPhpIds(TSRMLS_D) {
+  // Note that destructors run here may free proxies (and so slots),
+  // so don't hold on to references into php_slots_.
+  for (uint32_t slot = 0; slot < php_slots_.size(); slot++) {
+    if (!php_slots_[slot].id) { continue; }
+    zval *z = php_slots_[slot].z;
+    if (!z) {
+      // The proxy may outlive the request; neuter it.
+      zval proxy; INIT_ZVAL(proxy);
+      Z_TYPE(proxy) = IS_OBJECT;
+      Z_OBJVAL(proxy) = php_slots_[slot].obj;
+      node_php_jsobject_maybe_neuter(&proxy TSRMLS_CC);
+    }
+    FreePhpSlot(slot);
+    if (z) { zval_ptr_dtor(&z); }
+  }
+}
+
+uint32_t AsyncMapperChannel::NewPhpSlot() {
+  uint32_t slot = php_free_slot_;
+  if (slot != kNoSlot) {
+    php_free_slot_ = php_slots_[slot].next_free;
+    return slot;
+  }
+  if (php_slots_.size() > kSlotMask) { return kNoSlot; }
+  slot = php_slots_.size();
+  php_slots_.emplace_back();
+  return slot;
+}
+
+void AsyncMapperChannel::FreePhpSlot(uint32_t slot) {
+  PhpSlot &s = php_slots_[slot];
+  if (!s.z) {
+    php_proxy_slots_.erase(s.id);
+    ClearPhpSlotForHandle(s.obj.handle, slot);
+  } else if (Z_TYPE_P(s.z) == IS_OBJECT) {
+    ClearPhpSlotForHandle(Z_OBJ_HANDLE_P(s.z), slot);
+  } else {
+    php_arr_slots_.erase(s.z);
+  }
+  s.z = nullptr;
+  s.id = 0;
+  s.gen++;
+  s.next_free = php_free_slot_;
+  php_free_slot_ = slot;
+}
+
+uint32_t AsyncMapperChannel::PhpSlotForId(objid_t id) const {
+  if (id & 1) {
+    // PHP-owned: the slot is encoded in the id.
+    uint32_t slot = (id >> 1) & kSlotMask;
+    return (slot < php_slots_.size() && php_slots_[slot].id == id) ?
+      slot : kNoSlot;
+  }
+  auto it = php_proxy_slots_.find(id);
+  return (it == php_proxy_slots_.end()) ? kNoSlot : it->second;
+}
+
+uint32_t AsyncMapperChannel::PhpSlotForHandle(zend_object_handle handle)
+    const {
+  if (handle >= php_handle_slots_.size()) { return kNoSlot; }
+  const PhpSlotRef &ref = php_handle_slots_[handle];
+  if (ref.slot == kNoSlot || php_slots_[ref.slot].gen != ref.gen) {
+    return kNoSlot;
+  }
+  return ref.slot;
+}
 
-objid_t AsyncMapperChannel::NewId() {
-  uv_mutex_lock(&id_lock_);
-  // next_id_ is 0 if we're shutting down.
-  objid_t id = (next_id_ == 0) ? 0 : (next_id_++);
-  uv_mutex_unlock(&id_lock_);
-  return id;
+void AsyncMapperChannel::SetPhpSlotForHandle(zend_object_handle handle,
+                                             uint32_t slot) {
+  if (handle >= php_handle_slots_.size()) {
+    php_handle_slots_.resize(handle + 1, PhpSlotRef{kNoSlot, 0});
+  }
+  php_handle_slots_[handle] = PhpSlotRef{slot, php_slots_[slot].gen};
 }
 
-bool AsyncMapperChannel::IsValid() {
-  uv_mutex_lock(&id_lock_);
-  bool valid = (next_id_ != 0);
-  uv_mutex_unlock(&id_lock_);
-  return valid;
+void AsyncMapperChannel::ClearPhpSlotForHandle(zend_object_handle handle,
+                                               uint32_t slot) {
+  // Leave the entry alone if the handle has already been reused.
+  if (handle < php_handle_slots_.size() &&
+      php_handle_slots_[handle].slot == slot) {
+    php_handle_slots_[handle].slot = kNoSlot;
+  }
 }
 
 // JsMessageChannel interface -----------------------
@@ -179,6 +458,16 @@ void AsyncMapperChannel::SendToJs(Message *m, MessageFlags flags
                                        TSRMLS_DC) const {
   worker_->SendToJs(m, flags TSRMLS_CC);
 }
+void AsyncMapperChannel::WaitForJs(const std::function<bool()> &done
+                                   TSRMLS_DC) const {
+  worker_->WaitForJs(done TSRMLS_CC);
+}
+void AsyncMapperChannel::RefLoop() const {
+  worker_->RefLoop(true);
+}
+void AsyncMapperChannel::UnrefLoop() const {
+  worker_->RefLoop(false);
+}
 // PhpMessageChannel interface -----------------------
 // Callable only from the JS side.
 void AsyncMapperChannel::SendToPhp(Message *m, MessageFlags flags) const {
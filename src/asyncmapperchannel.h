@@ -5,7 +5,13 @@
 #ifndef NODE_PHP_EMBED_ASYNCMAPPERCHANNEL_H_
 #define NODE_PHP_EMBED_ASYNCMAPPERCHANNEL_H_
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "nan.h"
@@ -24,62 +30,182 @@ class JsCleanupSyncMsg;
 
 namespace amw {
 
-/* This is the interface exposed to the object proxy classes. */
+class JsReleaseMsg;
+class PhpReleaseMsg;
+
+/* This is the interface exposed to the object proxy classes.
+ *
+ * Each id is owned by the thread which first mapped the object; the
+ * other thread only has a proxy for it.  Proxies are held weakly, and
+ * when one is garbage collected the owner is told to drop its own
+ * reference.  A proxy may die while the object is on its way across
+ * again (and then get recreated on arrival), so both sides count: the
+ * owner counts the times it sends the id, the proxy side counts the
+ * times it receives it, and the release carries the proxy side's
+ * count.  The owner only drops the object once every send has been
+ * accounted for.  Releases are batched, and only sent between
+ * messages, so that they can't overtake a reply (still being built)
+ * which mentions the same object.
+ *
+ * Each side keeps the objects it owns in a slab of slots, and the id
+ * encodes the slot (and the low bits of the slot's generation), so
+ * that looking up an owned object is just indexing.  JS-owned ids are
+ * even and PHP-owned ids are odd.
+ */
 class AsyncMapperChannel : public MapperChannel {
   friend class node_php_embed::AsyncMessageWorker;
   friend class node_php_embed::JsCleanupSyncMsg;
+  friend class JsReleaseMsg;
+  friend class PhpReleaseMsg;
+  // Release notifications are sent in batches of (at least) this size,
+  // unless the queue is idle.
+  static const std::size_t kReleaseBatch = 64;
+  // An id is (generation << (kSlotBits + 1)) | (slot << 1) | side.
+  static const int kSlotBits = 22;
+  static const uint32_t kSlotMask = (1u << kSlotBits) - 1;
+  static const uint32_t kNoSlot = std::numeric_limits<uint32_t>::max();
+
  public:
   virtual ~AsyncMapperChannel() {
-    // zvals should have been freed beforehand from php_obj_list_ because
+    // zvals should have been freed beforehand from php_slots_ because
     // PHP context is shut down so we can't do that now.
-    js_obj_to_id_.Reset();
-    uv_mutex_destroy(&id_lock_);
+    ResetJsSlots();
   }
   // JsObjectMapper interface
   objid_t IdForJsObj(const v8::Local<v8::Object> o) override;
   v8::Local<v8::Object> JsObjForId(objid_t id) override;
+  void ReleasePhpObj(objid_t id) override;
   // PhpObjectMapper interface
   objid_t IdForPhpObj(zval *o) override;
   zval *PhpObjForId(objid_t id TSRMLS_DC) override;
+  void ReleaseJsObj(objid_t id TSRMLS_DC) override;
   // ObjectMapper interfaces
-  bool IsValid() override;
+  bool IsValid() override {
+    return !shutdown_.load(std::memory_order_acquire);
+  }
   // JsMessageChannel interface
   void SendToJs(Message *m, MessageFlags flags TSRMLS_DC) const override;
+  void WaitForJs(const std::function<bool()> &done
+                 TSRMLS_DC) const override;
+  void RefLoop() const override;
+  void UnrefLoop() const override;
   // PhpMessageChannel interface
   void SendToPhp(Message *m, MessageFlags flags) const override;
 
  private:
-  // Callable from both threads:
-  objid_t NewId();
+  typedef std::vector<std::pair<objid_t, uint32_t>> ReleaseList;
   // Callable from JS thread:
-  void ClearJsId(objid_t id);
-  objid_t ClearAllJsIds();
+  uint32_t NewJsSlot();
+  void FreeJsSlot(uint32_t slot);
+  uint32_t JsSlotForId(objid_t id) const;
+  uint32_t JsSlotForObj(v8::Local<v8::Object> o) const;
+  void ClearAllJsIds();
+  void InitJsKey();
+  void ResetJsSlots();
+  void FlushPhpReleases(bool force);
+  void ReleaseJsIds(const ReleaseList &released);
   // Callable from PHP thread:
-  void ClearPhpId(objid_t id TSRMLS_DC);
+  uint32_t NewPhpSlot();
+  void FreePhpSlot(uint32_t slot);
+  uint32_t PhpSlotForId(objid_t id) const;
+  uint32_t PhpSlotForHandle(zend_object_handle handle) const;
+  void SetPhpSlotForHandle(zend_object_handle handle, uint32_t slot);
+  void ClearPhpSlotForHandle(zend_object_handle handle, uint32_t slot);
+  void ClearAllPhpIds(TSRMLS_D);
+  void FlushJsReleases(bool force TSRMLS_DC);
+  void ReleasePhpIds(const ReleaseList &released TSRMLS_DC);
+  void StopJsReleases() { js_releases_.clear(); send_js_releases_ = false; }
   // Constructor, invoked from JS thread:
   explicit AsyncMapperChannel(AsyncMessageWorker *worker)
-      : worker_(worker), js_obj_to_id_(), php_obj_to_id_(), php_obj_list_(),
-        // Id #0 is reserved for "invalid object".
-        next_id_(1) {
-    uv_mutex_init(&id_lock_);
-    js_obj_to_id_.Reset(v8::NativeWeakMap::New(v8::Isolate::GetCurrent()));
+      : worker_(worker), js_slots_(1), js_free_slot_(kNoSlot),
+        js_key_(), js_key_index_(0), js_proxies_(), php_releases_(),
+        php_slots_(), php_free_slot_(kNoSlot),
+        php_handle_slots_(), php_arr_slots_(), php_proxy_slots_(),
+        js_releases_(), send_js_releases_(true), shutdown_(false) {
+    // (JS slot #0 is never used, so that id #0 can mean "invalid object".)
+    InitJsKey();
   }
   NAN_DISALLOW_ASSIGN_COPY_MOVE(AsyncMapperChannel);
   AsyncMessageWorker* worker_;
 
-  // Js Object mapping (along with worker's GetFromPersistent/etc)
+  // Js Object mapping
   // Read/writable only from Js thread.
-  Nan::Persistent<v8::NativeWeakMap> js_obj_to_id_;
+  // Every JS object we've sent to PHP occupies a slot, which holds a
+  // strong reference to it; free slots are chained together and
+  // reused.  (A deque, since persistent handles can't be moved.)
+  struct JsSlot {
+    JsSlot() : obj(), id(0), count(0), gen(0), next_free(kNoSlot) { }
+    Nan::Persistent<v8::Object> obj;
+    // 0 if the slot is free.
+    objid_t id;
+    // The number of sends not yet released by PHP.
+    uint32_t count;
+    // Bumped every time the slot is freed.
+    uint32_t gen;
+    uint32_t next_free;
+  };
+  std::deque<JsSlot> js_slots_;
+  uint32_t js_free_slot_;
+  // Objects we've sent are tagged with their id under this private
+  // key, which is unique to the channel.  (Proxies for PHP objects
+  // carry their id in their internal field instead.)
+  Nan::Persistent<v8::String> js_key_;
+  uint32_t js_key_index_;
+  // For PHP-owned ids: the (weakly held) proxy, if live, and the
+  // number of times the id has been received since the last release.
+  struct JsProxy {
+    JsProxy() : wrap(nullptr), received(0) { }
+    Nan::ObjectWrap *wrap;
+    uint32_t received;
+  };
+  std::unordered_map<objid_t, JsProxy> js_proxies_;
+  // Released PHP-owned ids, waiting to be sent to PHP.
+  ReleaseList php_releases_;
 
   // PHP Object mapping
   // Read/writable only from PHP thread.
-  std::unordered_map<zend_object_handle, objid_t> php_obj_to_id_;
-  std::unordered_map<zval*, objid_t> php_arr_to_id_;
-  std::vector<zval*> php_obj_list_;
-
-  // Ids are allocated from both threads, so mutex is required.
-  uv_mutex_t id_lock_;
-  objid_t next_id_;
+  // Every PHP object we've sent to JS, and every proxy we've made for
+  // a JS object, occupies a slot; free slots are chained together
+  // and reused, so the table grows with the number of live objects.
+  // (Unlike on the JS side, proxies get slots too, since this is also
+  // how we find a proxy from its object handle.)
+  struct PhpSlot {
+    PhpSlot() : z(nullptr), obj(), id(0), count(0), gen(0),
+                next_free(kNoSlot) { }
+    // Our reference to a PHP-owned object or array, or null for a proxy.
+    zval *z;
+    // The (weakly held) proxy for a JS-owned object.
+    zend_object_value obj;
+    // 0 if the slot is free.
+    objid_t id;
+    // For PHP-owned ids: the number of sends not yet released by JS.
+    // For proxies: the number of times the id has been received since
+    // the proxy was created.
+    uint32_t count;
+    // Bumped every time the slot is freed.
+    uint32_t gen;
+    uint32_t next_free;
+  };
+  std::vector<PhpSlot> php_slots_;
+  uint32_t php_free_slot_;
+  // Zend object handles are small dense integers, so objects (and
+  // proxies) are found by indexing this table with their handle.  The
+  // generation tag guards against stale entries.
+  struct PhpSlotRef {
+    uint32_t slot;
+    uint32_t gen;
+  };
+  std::vector<PhpSlotRef> php_handle_slots_;
+  // Array values are identified by their (separated) zval.
+  std::unordered_map<zval*, uint32_t> php_arr_slots_;
+  // JS-owned ids don't encode a slot, so their proxies are found here.
+  std::unordered_map<objid_t, uint32_t> php_proxy_slots_;
+  // Released JS-owned ids, waiting to be sent to JS.
+  ReleaseList js_releases_;
+  bool send_js_releases_;
+
+  // Set by the JS thread at shutdown, but read from both threads.
+  std::atomic<bool> shutdown_;
 };
 
 }  // namespace amw
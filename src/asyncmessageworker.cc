@@ -4,6 +4,7 @@
 #include "src/asyncmessageworker.h"
 
 #include <cassert>
+#include <functional>
 
 #include "nan.h"
 
@@ -31,7 +32,7 @@ AsyncMessageWorker::AsyncMessageWorker(Nan::Callback *callback)
       // Queues for messages between PHP and JS.
       js_queue_(new uv_async_t),
       php_queue_(new uv_async_t),
-      js_is_sync_(0) {
+      js_is_sync_(0), loop_refs_(0), keep_alive_(false) {
   // Set up JS async loop (PHP side will be done in Execute).
   uv_async_init(uv_default_loop(), js_queue_.async(), JsAsyncMessage_);
   js_queue_.async()->data = this;
@@ -46,6 +47,7 @@ AsyncMessageWorker::~AsyncMessageWorker() {
   // PHP-side shutdown is complete by the time the destructor is called.
   // Tear down JS-side queue.  (Completion is async, but that's okay.)
   uv_async_t *async = js_queue_.async();
+  js_queue_.DetachAsync();
   async->data = nullptr;  // can't touch asyncmessageworker after we return.
   uv_close(reinterpret_cast<uv_handle_t*>(async), AsyncClose_);
   TRACE("<");
@@ -57,20 +59,15 @@ class JsCleanupSyncMsg : MessageToJs {
       : MessageToJs(&(that->channel_), nullptr, true), that_(that) { }
   void InJs(JsObjectMapper *m) override {
     TRACE("> JsCleanupSyncMsg");
+    that_->BeforeJsShutdown();
     // All previous PHP requests should have been serviced by now.
-    objid_t last = that_->channel_.ClearAllJsIds();
+    that_->channel_.ClearAllJsIds();
     // Empty the JS side queue.
     that_->ProcessJs(nullptr, false /* we're inside a ProcessJs already */);
     // Ok, return to tell PHP the queues are empty.
-    retval_.SetInt(last);
+    retval_.SetBool(true);
     TRACE("< JsCleanupSyncMsg");
   }
-  objid_t GetLastId(ObjectMapper *m TSRMLS_DC) {
-    ZVal last{ZEND_FILE_LINE_C};
-    retval_.ToPhp(m, last TSRMLS_CC);
-    assert(last.Type() == IS_LONG);
-    return (objid_t) Z_LVAL_P(last.Ptr());
-  }
 
  protected:
   // Shutdown the JS queue after the response to this message.
@@ -99,26 +96,28 @@ void AsyncMessageWorker::Execute() {
   /* Flush the buffers, send the headers. */
   AfterAsyncLoop(TSRMLS_C);
   /* Start cleaning up. */
-  objid_t last;
+  // Every id is about to be cleared anyway; don't let late releases
+  // race with the shutdown of the JS queue.
+  channel_.StopJsReleases();
   {
     JsCleanupSyncMsg msg(this);
     SendToJs(&msg, MessageFlags::SYNC TSRMLS_CC);
-    last = msg.GetLastId(&channel_ TSRMLS_CC);
     // Exit this scope to dealloc msg before proceeding.
   }
   ProcessPhp(nullptr TSRMLS_CC);  // A precaution; shouldn't be necessary.
   a->data = nullptr;
   js_queue_.Shutdown();
   /* OK, queues are empty now, we can start tearing things down. */
-  for (objid_t id = 1; id < last; id++) {
-    // zvals need to be cleared on the PHP side.
-    // We're about to deallocate the entire pool used by the request,
-    // but this helps catch leaks.
-    channel_.ClearPhpId(id TSRMLS_CC);
-  }
+  // zvals need to be cleared on the PHP side.
+  // We're about to deallocate the entire pool used by the request,
+  // but this helps catch leaks.
+  channel_.ClearAllPhpIds(TSRMLS_C);
   /* Hook for additional PHP-side shutdown. */
   AfterExecute(TSRMLS_C);
   /* Tear down loop and queue */
+  // The JS thread may still be returning from the Push which delivered
+  // our shutdown response; make sure it won't touch the handle again.
+  php_queue_.DetachAsync();
   // This close operation completes in the php_loop_
   uv_close(reinterpret_cast<uv_handle_t*>(a), AsyncClose_);
   uv_run(php_loop_, UV_RUN_DEFAULT);  // Let the close complete.
@@ -157,20 +156,28 @@ void AsyncMessageWorker::SendToPhp(Message *m, MessageFlags flags) {
 }
 
 void AsyncMessageWorker::ProcessJs(Message *match, bool kickNextTick) {
-  MapperChannel *channel = &channel_;
+  amw::AsyncMapperChannel *channel = &channel_;
   bool js_is_sync = js_is_sync_;
   // Start a handle scope.
   Nan::HandleScope handle_scope;
   // Enter appropriate context
   v8::Context::Scope scope(kick_next_tick_.GetFunction()->CreationContext());
-  js_queue_.DoProcess(match, [channel, js_is_sync](Message *mm) {
-    // Each message will get its own handle scope.
-    Nan::HandleScope scope;
-    mm->ExecuteJs(channel, js_is_sync);
+  bool sawOne = js_queue_.DoProcess(match, [channel, js_is_sync](Message *mm) {
+    {
+      // Each message will get its own handle scope.
+      Nan::HandleScope scope;
+      mm->ExecuteJs(channel, js_is_sync);
+    }
+    // Between messages is a safe time to send releases.  (If JS is
+    // blocked waiting for PHP, an async send would block too; wait.)
+    if (!js_is_sync) { channel->FlushPhpReleases(false); }
   });
+  if (!match && !js_is_sync) { channel->FlushPhpReleases(true); }
   // Kick the tick.  See:
   // https://github.com/nodejs/nan/issues/284#issuecomment-150887627
-  if (kickNextTick) {
+  // (Wakeups are coalesced, so we may find the queue already drained;
+  // in that case no JS ran and there's nothing to kick.)
+  if (kickNextTick && sawOne) {
     kick_next_tick_.Call(0, nullptr);
   }
 }
@@ -202,9 +209,21 @@ void AsyncMessageWorker::SendToJs(Message *m, MessageFlags flags TSRMLS_DC) {
 }
 
 void AsyncMessageWorker::ProcessPhp(Message *match TSRMLS_DC) {
-  MapperChannel *channel = &channel_;
+  amw::AsyncMapperChannel *channel = &channel_;
   php_queue_.DoProcess(match, [channel TSRMLS_CC](Message *mm) {
     mm->ExecutePhp(channel TSRMLS_CC);
+    // Between messages is a safe time to send releases.
+    channel->FlushJsReleases(false TSRMLS_CC);
+  });
+  if (!match) { channel->FlushJsReleases(true TSRMLS_CC); }
+}
+
+void AsyncMessageWorker::WaitForJs(const std::function<bool()> &done
+                                   TSRMLS_DC) {
+  amw::AsyncMapperChannel *channel = &channel_;
+  php_queue_.DoProcessUntil(done, [channel TSRMLS_CC](Message *mm) {
+    mm->ExecutePhp(channel TSRMLS_CC);
+    channel->FlushJsReleases(false TSRMLS_CC);
   });
 }
 
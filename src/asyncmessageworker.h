@@ -5,6 +5,7 @@
 #define NODE_PHP_EMBED_ASYNCMESSAGEWORKER_H_
 
 #include <cassert>
+#include <functional>
 
 #include "nan.h"
 
@@ -49,12 +50,6 @@ namespace node_php_embed {
   // and the queues have been emptied.
   virtual void AfterExecute(TSRMLS_D) { }
 
-  // We have SaveTo and GetFrom; we need DeleteFrom as well.
-  NAN_INLINE void DeleteFromPersistent(uint32_t index) {
-    Nan::HandleScope scope;
-    Nan::New(persistentHandle)->Delete(index);
-  }
-
  protected:
   // Limited ObjectMapper for use during subclass initialization.
   class JsStartupMapper : public JsObjectMapper {
@@ -67,6 +62,7 @@ namespace node_php_embed {
     v8::Local<v8::Object> JsObjForId(objid_t id) override {
       assert(false); return Nan::New<v8::Object>();
     }
+    void ReleasePhpObj(objid_t id) override { assert(false); }
    private:
     NAN_DISALLOW_ASSIGN_COPY_MOVE(JsStartupMapper);
     amw::AsyncMapperChannel *channel_;
@@ -76,6 +72,18 @@ namespace node_php_embed {
     callback->Call(0, nullptr);
   }
 
+  // Called in the JS thread once the PHP side has finished running its
+  // async loop; no more messages may be sent to PHP after this.
+  virtual void BeforeJsShutdown() { }
+
+  // Keep the PHP async loop running even if there is no other pending
+  // work, so that messages from JS continue to be processed.  Callable
+  // only from the PHP side.
+  void KeepAlive(bool keep_alive) {
+    keep_alive_ = keep_alive;
+    UpdateLoopRef();
+  }
+
  private:
   // Allow subclass to have access to a JsObjectMapper in the OKCallback.
   void HandleOKCallback() final {
@@ -95,6 +103,17 @@ namespace node_php_embed {
 
   void SendToJs(Message *m, MessageFlags flags TSRMLS_DC);
   void ProcessPhp(Message *match TSRMLS_DC);
+  void WaitForJs(const std::function<bool()> &done TSRMLS_DC);
+  // Outstanding async messages hold a reference to the PHP event loop.
+  void RefLoop(bool ref) {
+    loop_refs_ += ref ? 1 : -1;
+    assert(loop_refs_ >= 0);
+    UpdateLoopRef();
+  }
+  void UpdateLoopRef() {
+    uv_handle_t *h = reinterpret_cast<uv_handle_t*>(php_queue_.async());
+    if (keep_alive_ || loop_refs_ > 0) { uv_ref(h); } else { uv_unref(h); }
+  }
   static NAUV_WORK_CB(PhpAsyncMessage_);
 
   static void NoOpFunction_(const Nan::FunctionCallbackInfo<v8::Value>& info) {
@@ -115,6 +134,9 @@ namespace node_php_embed {
   uv_loop_t *php_loop_;
   // Deadlock prevention.
   int js_is_sync_;
+  // Reasons to keep the PHP event loop running (PHP side only).
+  int loop_refs_;
+  bool keep_alive_;
 };
 
 }  // namespace node_php_embed
@@ -32,6 +32,15 @@
 # define TRACEX(...)
 #endif
 
+// Hint to the CPU that we're in a spin-wait loop.
+#if defined(__i386__) || defined(__x86_64__)
+# define NPE_CPU_RELAX() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__) || defined(__arm__)
+# define NPE_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+# define NPE_CPU_RELAX() do { } while (0)
+#endif
+
 /** v8/nan helpers **/
 
 #define NEW_STR(str)                            \
@@ -4,22 +4,57 @@
 #ifndef NODE_PHP_EMBED_MESSAGEQUEUE_H_
 #define NODE_PHP_EMBED_MESSAGEQUEUE_H_
 
+#include <sched.h>  // for sched_yield()
+#include <unistd.h>  // for sysconf()
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <list>
 
 #include "nan.h"
 
 #include "src/macros.h"
+#include "src/spscring.h"
 
 namespace node_php_embed {
 
 class Message;
 
 // A queue of messages passed between threads.
+// Each queue has exactly one producer thread (the thread which calls
+// `Push`, `Notify`, and `Shutdown`) and exactly one consumer thread
+// (the thread which calls `DoProcess`), so the fast path is a lock-free
+// single-producer/single-consumer ring.  If the ring fills up, further
+// messages spill into a locked overflow list; the producer keeps using
+// the overflow list until the consumer has drained it, which preserves
+// message order.
+//
+// Wakeups are coalesced.  The consumer is either idle (no wakeup
+// pending), awake (a wakeup has been sent and the next `DoProcess` will
+// drain everything queued so far), or parked (blocked in `DoProcess`
+// waiting for a particular response).  Only the idle->awake transition
+// sends a `uv_async_send`, and the condition variable is only signalled
+// if the consumer is actually parked on it.
+//
+// Before parking, a consumer waiting for a synchronous response first
+// spins and then yields for a while, since the other thread often
+// answers faster than a futex sleep/wake round trip.  The spin budget
+// adapts to the response times observed on this queue, up to a
+// process-wide limit (see `SetSpinLimit`).
 class MessageQueue {
+  // Number of messages which fit in the lock-free ring.
+  static const std::size_t kRingSize = 256;
+  // How many times we yield the CPU after spinning, before parking.
+  static const int kYields = 4;
+  // Default for `SetSpinLimit`, in nanoseconds.
+  static const uint64_t kDefaultSpinLimit = 50000;
+
  public:
   explicit MessageQueue(uv_async_t *async)
-      : async_(async), data_(), shutdown_(false) {
+      : async_(async), ring_(), overflow_(), overflow_size_(0),
+        awake_(false), parked_(false), shutdown_(false), avg_wait_(0) {
     uv_mutex_init(&lock_);
     uv_cond_init(&cond_);
   }
@@ -28,6 +63,14 @@ class MessageQueue {
     uv_mutex_destroy(&lock_);
   }
   inline uv_async_t *async() { return async_; }
+  // Stop sending wakeups to our async handle.  Must be called by the
+  // consumer before it closes the handle, since the producer may still
+  // be finishing a `Push` which the consumer has already dequeued.
+  void DetachAsync() {
+    uv_mutex_lock(&lock_);
+    async_ = nullptr;
+    uv_mutex_unlock(&lock_);
+  }
   void Push(Message *m) {
     assert(m);
     _Push(m);
@@ -48,64 +91,178 @@ class MessageQueue {
       // Grab one message at a time, so that we don't end up processing
       // messages out of order in case `func(m)` below ends up creating
       // a recursive processing loop.
-      uv_mutex_lock(&lock_);
-      if (data_.empty()) {
-        m = nullptr;
-        if (match) {
-          // We're blocking for a particular message, and there's nothing here.
-          // Block to wait for some data.
-          uv_cond_wait(&cond_, &lock_);
-        } else {
-          loop = false;
-        }
-      } else {
+      m = Pop();
+      if (m) {
         sawOne = true;
-        m = data_.front();
-        data_.pop_front();
+        func(m);
+      } else if (match) {
+        // We're blocking for a particular message, and there's nothing here.
+        // Block to wait for some data.
+        Wait();
+      } else if (Idle()) {
+        // Queue is drained and the producer will signal for the next one.
+        loop = false;
       }
-      uv_mutex_unlock(&lock_);
-
-      if (m) { func(m); }
       // Check whether either we processed the matching message,
       // or else a recursive processing loop handled it for us.
       if (match && match->IsProcessed()) { loop = false; }
     }
+    // If we stop early (because `match` was found) the consumer stays
+    // awake, and the async wakeup which made it so is still pending;
+    // that wakeup will drain whatever is left.
     return sawOne;
   }
+  // Processes messages, blocking when the queue is empty, until
+  // `done()` returns true.  Unlike `DoProcess`, the thing we're
+  // waiting for needn't be a message which outlives its processing.
+  template<typename Pred, typename Func>
+  void DoProcessUntil(const Pred &done, Func func) {
+    while (!done()) {
+      Message *m = Pop();
+      if (m) {
+        func(m);
+      } else {
+        Wait();
+      }
+    }
+  }
   // Shutdown the queue: no more messages will be pushed
   // after this method is called.
   void Shutdown() {
-    uv_mutex_lock(&lock_);
-    shutdown_ = true;
-    uv_mutex_unlock(&lock_);
+    shutdown_.store(true, std::memory_order_release);
   }
+  // Set the maximum time (in nanoseconds) that a consumer will busy-wait
+  // for a synchronous response before parking.  Zero disables spinning.
+  // This applies to all queues in the process.
+  static void SetSpinLimit(uint64_t ns) { SpinLimit().store(ns); }
+  static uint64_t GetSpinLimit() { return SpinLimit().load(); }
 
  private:
   void _Push(Message *m) {
-    bool was_shutdown = false;
+    // Only the producer thread sets shutdown_, so this check can't race.
+    if (shutdown_.load(std::memory_order_relaxed)) {
+      NPE_ERROR("Push after shutdown :(");
+      assert(false);
+      return;
+    }
+    if (m) {
+      if (overflow_size_.load(std::memory_order_acquire) != 0 ||
+          !ring_.TryPush(m)) {
+        uv_mutex_lock(&lock_);
+        overflow_.push_back(m);
+        overflow_size_.fetch_add(1, std::memory_order_release);
+        uv_mutex_unlock(&lock_);
+      }
+    }
+    // Pairs with the fence in `Wait` and `Idle`: either the consumer
+    // sees our message, or we see that it needs a wakeup.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool wake = !awake_.exchange(true) || !m;
+    bool unpark = parked_.load() || !m;
+    if (!(wake || unpark)) { return; }
     uv_mutex_lock(&lock_);
-    if (!shutdown_) {
-      if (m) { data_.push_back(m); }
-      uv_cond_broadcast(&cond_);
-      // on a shutdown message, async_ could be torn down as soon
-      // as the other thread wakes up, so do the send inside the lock.
-      if (async_) { uv_async_send(async_); }
-    } else {
-      was_shutdown = true;
+    if (unpark) { uv_cond_broadcast(&cond_); }
+    // The consumer may tear down async_ as soon as it sees a shutdown
+    // message, so do the send inside the lock (see `DetachAsync`).
+    if (wake && async_) { uv_async_send(async_); }
+    uv_mutex_unlock(&lock_);
+  }
+  // Consumer side: dequeue the next message, or return nullptr if the
+  // queue is empty.  Ring entries always precede overflow entries.
+  Message *Pop() {
+    Message *m;
+    if (ring_.TryPop(&m)) { return m; }
+    if (overflow_size_.load(std::memory_order_acquire) == 0) {
+      return nullptr;
+    }
+    uv_mutex_lock(&lock_);
+    // The producer may have filled the ring and spilled into overflow
+    // since we looked; those ring entries are older.  It won't touch
+    // the ring again until overflow is empty, so this check is final.
+    if (!ring_.TryPop(&m)) {
+      m = overflow_.front();
+      overflow_.pop_front();
+      overflow_size_.fetch_sub(1, std::memory_order_release);
     }
     uv_mutex_unlock(&lock_);
-    if (was_shutdown) {
-      // Shouldn't happen (but assert after releasing the lock)
-      NPE_ERROR("Push after shutdown :(");
-      assert(false);
+    return m;
+  }
+  // Consumer side: block until the producer pushes or notifies.
+  void Wait() {
+    uint64_t start = uv_hrtime();
+    if (!(Spin(start) || Park())) { return; }
+    // Only track the wait if we actually saw a response; a bare
+    // `Notify` tells us nothing about response time.
+    uint64_t elapsed = uv_hrtime() - start;
+    // Exponentially-weighted moving average, with weight 1/8.
+    avg_wait_ = avg_wait_ - (avg_wait_ >> 3) + (elapsed >> 3);
+  }
+  // Spin and then yield, for up to twice the typical response time.
+  // If responses usually take longer than the spin limit, don't bother
+  // spinning at all: we'd just burn CPU before parking anyway.  Also
+  // don't spin on a single-core machine, where the thread we're
+  // waiting for can't run while we spin.
+  // Returns true if a message arrived.
+  bool Spin(uint64_t start) {
+    static const bool multicore = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    uint64_t limit = GetSpinLimit();
+    if (!multicore || limit == 0 || avg_wait_ > limit) { return false; }
+    uint64_t budget = (avg_wait_ == 0) ? limit : std::min(2 * avg_wait_, limit);
+    for (unsigned i = 1; ; i++) {
+      if (!IsEmpty()) { return true; }
+      NPE_CPU_RELAX();
+      // Reading the clock is expensive compared to a pause, so
+      // only do so every so often.
+      if ((i & 63) == 0 && (uv_hrtime() - start) >= budget) { break; }
     }
-    assert(!was_shutdown);
+    for (int i = 0; i < kYields; i++) {
+      sched_yield();
+      if (!IsEmpty()) { return true; }
+    }
+    return false;
+  }
+  // We announce that we're parked before the final emptiness check,
+  // and the producer checks `parked_` after enqueuing, so at least
+  // one of us sees the other and wakeups can't be lost.
+  // Returns true if a message arrived.
+  bool Park() {
+    uv_mutex_lock(&lock_);
+    parked_.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (IsEmpty()) {
+      uv_cond_wait(&cond_, &lock_);
+    }
+    parked_.store(false);
+    uv_mutex_unlock(&lock_);
+    return !IsEmpty();
+  }
+  // Consumer side: called when the queue appears empty at the end of
+  // a drain.  Marks the consumer idle, so that the next push will send
+  // a fresh wakeup, and then rechecks for a message which raced with
+  // the transition.  Returns true if the queue is still empty.
+  bool Idle() {
+    awake_.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return IsEmpty();
+  }
+  bool IsEmpty() {
+    return ring_.IsEmpty() &&
+      overflow_size_.load(std::memory_order_acquire) == 0;
+  }
+  static std::atomic<uint64_t> &SpinLimit() {
+    static std::atomic<uint64_t> limit(kDefaultSpinLimit);
+    return limit;
   }
   uv_async_t *async_;
   uv_mutex_t lock_;
   uv_cond_t cond_;
-  std::list<Message *> data_;
-  bool shutdown_;
+  SpscRing<Message *, kRingSize> ring_;
+  std::list<Message *> overflow_;
+  std::atomic<std::size_t> overflow_size_;
+  std::atomic<bool> awake_;   // A wakeup is pending or a drain is underway.
+  std::atomic<bool> parked_;  // The consumer is blocked on `cond_`.
+  std::atomic<bool> shutdown_;
+  uint64_t avg_wait_;  // Typical response time in ns; consumer-only.
 };
 
 }  // namespace node_php_embed
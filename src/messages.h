@@ -4,15 +4,17 @@
 #ifndef NODE_PHP_EMBED_MESSAGES_H_
 #define NODE_PHP_EMBED_MESSAGES_H_
 
+#include <functional>
 #include <iostream>
 
 #include "nan.h"
 
 extern "C" {
-#include "Zend/zend_exceptions.h"  // for zend_clear_exception
+#include "Zend/zend_exceptions.h"  // for zend_clear_exception, etc
 }
 
 #include "src/macros.h"
+#include "src/node_php_jsfuture_class.h"
 #include "src/values.h"
 
 namespace node_php_embed {
@@ -36,6 +38,13 @@ class JsMessageChannel {
   virtual ~JsMessageChannel() { }
   // If is_sync is true, will not return until response has been received.
   virtual void SendToJs(Message *m, MessageFlags flags TSRMLS_DC) const = 0;
+  // Process responses from JS until `done` returns true.
+  virtual void WaitForJs(const std::function<bool()> &done
+                         TSRMLS_DC) const = 0;
+  // Keep the PHP event loop running until a matching `UnrefLoop`, for
+  // async messages whose responses we're still waiting for.
+  virtual void RefLoop() const = 0;
+  virtual void UnrefLoop() const = 0;
 };
 class PhpMessageChannel {
  public:
@@ -166,10 +175,9 @@ class MessageToPhp : public Message {
         NPE_ERROR("! exception thrown while invoking callback");
         tryCatch.Reset();  // Swallow it up.
       }
-    } else {
-      // This was a fire-and-forget request.  Clean up!
-      delete this;
     }
+    // Async messages, with or without a callback, are done.  Clean up!
+    delete this;
   }
 
  protected:
@@ -186,10 +194,13 @@ class MessageToPhp : public Message {
 class MessageToJs : public Message {
  public:
   // Constructed in PHP thread. The php_callback may be nullptr for
-  // fire-and-forget methods.  If provided, it will be invoked
-  // as a closure, with the exception as the first arg and the
+  // fire-and-forget methods.  If provided, it is either a Js\Future,
+  // which will be resolved with the result, or a closure, which will
+  // be invoked with the exception as the first arg and the
   // return value as the second.  The MessageToJs will ref the
-  // zval and unref it after use.  For sync calls, the php_callback
+  // zval and unref it after use.  The sender should `RefLoop` the
+  // channel for such messages; the reference is released once the
+  // callback has been invoked.  For sync calls, the php_callback
   // should be null and is_sync should be true.
   MessageToJs(ObjectMapper *m, zval *php_callback, bool is_sync)
       : Message(m), php_callback_(php_callback ZEND_FILE_LINE_CC),
@@ -290,20 +301,35 @@ class MessageToJs : public Message {
     } else {
       retval_.ToPhp(mapper_, r TSRMLS_CC);
     }
-    if (!php_callback_.IsNull()) {
-      // This case would be taken if we were invoking a sync JS method
-      // asynchronously from the PHP side.
+    if (node_php_jsfuture_is(php_callback_.Ptr())) {
+      node_php_jsfuture_resolve(php_callback_.Ptr(),
+                                HasException() ? e.Ptr() : nullptr,
+                                r.Ptr() TSRMLS_CC);
+      channel->UnrefLoop();
+      delete this;
+    } else if (!php_callback_.IsNull()) {
+      // This case is taken if we were invoking a JS method
+      // asynchronously from the PHP side, with a Js\Async callback.
       ZVal closureRetval{ZEND_FILE_LINE_C};
-      // Use plain zval to avoid allocating copy of method name.
-      zval method; INIT_ZVAL(method); ZVAL_STRINGL(&method, "call", 4, 0);
       zval *args[] = { e.Ptr(), r.Ptr() };
-      if (FAILURE == call_user_function(EG(function_table),
-                                        php_callback_.PtrPtr(), &method,
+      if (FAILURE == call_user_function(EG(function_table), nullptr,
+                                        php_callback_.Ptr(),
                                         closureRetval.Ptr(), 2, args
                                         TSRMLS_CC)) {
         // Oh, well.  Ignore this.
         NPE_ERROR("! failure invoking closure");
       }
+      if (EG(exception)) {
+        // Nobody is waiting for the callback, so there's nowhere to
+        // rethrow this; report it instead of letting it escape into
+        // whatever PHP code we happen to be nested in.
+        zval *ex = EG(exception);
+        EG(exception) = nullptr;
+        zend_exception_error(ex, E_WARNING TSRMLS_CC);
+        zval_ptr_dtor(&ex);
+      }
+      channel->UnrefLoop();
+      delete this;
     } else {
       // This was a fire-and-forget request.  Clean up!
       delete this;
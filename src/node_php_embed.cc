@@ -15,26 +15,35 @@
 extern "C" {
 #include "sapi/embed/php_embed.h"
 #include "Zend/zend_exceptions.h"
-#include "Zend/zend_interfaces.h"
 #include "ext/standard/head.h"
 #include "ext/standard/info.h"
 }
 
 #include "src/macros.h"
+#include "src/messagequeue.h"
+#include "src/node_php_jsasync_class.h"
 #include "src/node_php_jsbuffer_class.h"
+#include "src/node_php_jsbyref_class.h"
+#include "src/node_php_jsfuture_class.h"
 #include "src/node_php_jsobject_class.h"
-#include "src/node_php_jsserver_class.h"
 #include "src/node_php_jswait_class.h"
+#include "src/outputbuffer.h"
 #include "src/phprequestworker.h"
+#include "src/phpthreadpool.h"
+#include "src/postbody.h"
+#include "src/responseheaders.h"
+#include "src/servicecontext.h"
+#include "src/sourcecache.h"
 #include "src/values.h"
 
 using node_php_embed::MapperChannel;
-using node_php_embed::OwnershipType;
+using node_php_embed::OutputBuffer;
 using node_php_embed::PhpRequestWorker;
+using node_php_embed::PhpThreadPool;
+using node_php_embed::ResponseHeaders;
+using node_php_embed::SourceCache;
 using node_php_embed::Value;
 using node_php_embed::ZVal;
-using node_php_embed::node_php_jsbuffer;
-using node_php_embed::node_php_jsobject_call_method;
 
 static void node_php_embed_ensure_init(void);
 
@@ -82,127 +91,53 @@ static int node_php_embed_ub_write(const char *str,
   PhpRequestWorker *worker = NODE_PHP_EMBED_G(worker);
   MapperChannel *channel = NODE_PHP_EMBED_G(channel);
   if (!worker) { return str_length; /* in module shutdown */ }
-  ZVal stream{ZEND_FILE_LINE_C}, retval{ZEND_FILE_LINE_C};
-  worker->GetStream().ToPhp(channel, stream TSRMLS_CC);
-  // Use plain zval to avoid allocating copy of method name.
-  zval method; INIT_ZVAL(method); ZVAL_STRINGL(&method, "write", 5, 0);
-  // Special buffer type to pass `str` as a node buffer and avoid copying.
-  zval buffer, *args[] = { &buffer }; INIT_ZVAL(buffer);
-  node_php_embed::node_php_jsbuffer_create(&buffer, str, str_length,
-                                           OwnershipType::NOT_OWNED TSRMLS_CC);
-  call_user_function(EG(function_table), stream.PtrPtr(), &method,
-                     retval.Ptr(), 1, args TSRMLS_CC);
-  if (EG(exception)) {
-    NPE_ERROR("- exception caught (ignoring)");
-    zend_clear_exception(TSRMLS_C);
-  }
-  zval_dtor(&buffer);
+  // Output is buffered and sent to JS asynchronously, in large chunks.
+  worker->GetOutputBuffer()->Write(channel, str, str_length TSRMLS_CC);
   TRACE("<");
   return str_length;
 }
 
 static void node_php_embed_flush(void *server_context) {
-  // Invoke stream.write with a PHP "JsWait" callback, which causes PHP
-  // to block until the callback is handled.
+  // Send any buffered output, and block until the stream has
+  // accepted it.
   TRACE(">");
   TSRMLS_FETCH();
   // Fetch the MapperChannel for this thread.
   PhpRequestWorker *worker = NODE_PHP_EMBED_G(worker);
   MapperChannel *channel = NODE_PHP_EMBED_G(channel);
   if (!worker) { return; /* we're in module shutdown, no request any more */ }
-  ZVal stream{ZEND_FILE_LINE_C}, retval{ZEND_FILE_LINE_C};
-  worker->GetStream().ToPhp(channel, stream TSRMLS_CC);
-  // Use plain zval to avoid allocating copy of method name.
-  zval method; INIT_ZVAL(method); ZVAL_STRINGL(&method, "write", 5, 0);
-  // Special buffer type to pass `str` as a node buffer and avoid copying.
-  zval buffer; INIT_ZVAL(buffer);
-  node_php_embed::node_php_jsbuffer_create(&buffer, "", 0,
-                                           OwnershipType::NOT_OWNED TSRMLS_CC);
-  // Create the special JsWait object.
-  zval wait; INIT_ZVAL(wait);
-  node_php_embed::node_php_jswait_create(&wait TSRMLS_CC);
-  zval *args[] = { &buffer, &wait };
-  call_user_function(EG(function_table), stream.PtrPtr(), &method,
-                     retval.Ptr(), 2, args TSRMLS_CC);
-  if (EG(exception)) {
-    // This exception is often the "ASYNC inside SYNC" TypeError, which
-    // is harmless in this context, so don't be noisy about it.
-    TRACE("- exception caught (ignoring)");
-    zend_clear_exception(TSRMLS_C);
-  }
-  zval_dtor(&buffer);
-  zval_dtor(&wait);
+  worker->GetOutputBuffer()->Flush(channel, true TSRMLS_CC);
   TRACE("<");
 }
 
-static void node_php_embed_send_header(sapi_header_struct *sapi_header,
-                                       void *server_context TSRMLS_DC) {
+static int node_php_embed_send_headers(sapi_headers_struct *sapi_headers
+                                      TSRMLS_DC) {
   TRACE(">");
   // Fetch the MapperChannel for this thread.
   PhpRequestWorker *worker = NODE_PHP_EMBED_G(worker);
   MapperChannel *channel = NODE_PHP_EMBED_G(channel);
-  if (!worker) { return; /* we're in module shutdown, no headers any more */ }
-  ZVal stream{ZEND_FILE_LINE_C}, retval{ZEND_FILE_LINE_C};
-  worker->GetStream().ToPhp(channel, stream TSRMLS_CC);
-  // Use plain zval to avoid allocating copy of method name.
-  // The "sendHeader" method is a special JS-side method to translate
-  // headers into node.js format.
-  zval method; INIT_ZVAL(method); ZVAL_STRINGL(&method, "sendHeader", 10, 0);
-  // Special buffer type to pass `str` as a node buffer and avoid copying.
-  zval buffer, *args[] = { &buffer }; INIT_ZVAL(buffer);
-  if (sapi_header) {  // NULL is passed to indicate "last call"
-    node_php_embed::node_php_jsbuffer_create(
-        &buffer, sapi_header->header, sapi_header->header_len,
-        OwnershipType::NOT_OWNED TSRMLS_CC);
-  }
-  call_user_function(EG(function_table), stream.PtrPtr(), &method,
-                     retval.Ptr(), 1, args TSRMLS_CC);
-  if (EG(exception)) {
-    NPE_ERROR("- exception caught (ignoring)");
-    zend_clear_exception(TSRMLS_C);
+  if (worker) {  // Otherwise we're in module shutdown, no headers any more.
+    // Add Content-Encoding if we're going to compress the output.
+    worker->GetOutputBuffer()->StartCompression(sapi_headers TSRMLS_CC);
+    // Send all the headers to JS at once.
+    ResponseHeaders::Send(worker, channel, sapi_headers TSRMLS_CC);
   }
-  zval_dtor(&buffer);
   TRACE("<");
+  return SAPI_HEADER_SENT_SUCCESSFULLY;
 }
 
 static int node_php_embed_read_post(char *buffer, uint count_bytes TSRMLS_DC) {
-  // Invoke stream.read with a PHP "JsWait" callback, which causes PHP
-  // to block until the callback is handled.
+  // JS pushes the request body to us as it arrives; we only have to
+  // wait for it if we've caught up.
   TRACE(">");
   // Fetch the MapperChannel for this thread.
   PhpRequestWorker *worker = NODE_PHP_EMBED_G(worker);
   MapperChannel *channel = NODE_PHP_EMBED_G(channel);
   if (!worker) { return 0; /* we're in module shutdown, no request any more */ }
-  ZVal stream{ZEND_FILE_LINE_C}, retval{ZEND_FILE_LINE_C};
-  worker->GetStream().ToPhp(channel, stream TSRMLS_CC);
-  // Use plain zval to avoid allocating copy of method name.
-  zval method; INIT_ZVAL(method); ZVAL_STRINGL(&method, "read", 4, 0);
-  zval size; INIT_ZVAL(size); ZVAL_LONG(&size, count_bytes);
-  // Create the special JsWait object.
-  zval wait; INIT_ZVAL(wait);
-  node_php_embed::node_php_jswait_create(&wait TSRMLS_CC);
-  zval *args[] = { &size, &wait };
-  // We can't use call_user_function yet because the PHP function caches
-  // are not properly set up.  Use the backdoor.
-  node_php_jsobject_call_method(stream.Ptr(), &method, 2, args,
-                                retval.Ptr(), retval.PtrPtr() TSRMLS_CC);
-  if (EG(exception)) {
-    NPE_ERROR("- exception caught (ignoring)");
-    zend_clear_exception(TSRMLS_C);
-    return 0;
-  }
-  zval_dtor(&wait);
-  // Transfer the data from the retval to the buffer
-  if (!(retval.IsObject() && Z_OBJCE_P(retval.Ptr()) == php_ce_jsbuffer)) {
-    NPE_ERROR("Return value was not buffer :(");
-    return 0;
-  }
-  node_php_jsbuffer *b = reinterpret_cast<node_php_jsbuffer *>
-    (zend_object_store_get_object(retval.Ptr() TSRMLS_CC));
-  assert(b->length <= count_bytes);
-  memcpy(buffer, b->data, b->length);
-  TRACEX("< (read %lu)", b->length);
-  return static_cast<int>(b->length);
+  size_t read = worker->GetPostBody()->Read(channel, buffer, count_bytes
+                                            TSRMLS_CC);
+  TRACEX("< (read %lu)", read);
+  return static_cast<int>(read);
 }
 
 static char * node_php_embed_read_cookies(TSRMLS_D) {
@@ -215,29 +150,13 @@ static void node_php_embed_register_server_variables(
     zval *track_vars_array TSRMLS_DC) {
   TRACE(">");
   PhpRequestWorker *worker = NODE_PHP_EMBED_G(worker);
-  MapperChannel *channel = NODE_PHP_EMBED_G(channel);
+  // When prewarming there's no request yet; $_SERVER will be rebuilt
+  // once there is.
+  if (!worker) { return; }
 
-  // Invoke the init_func in order to set up the $_SERVER variables.
-  ZVal init_func{ZEND_FILE_LINE_C};
-  ZVal server{ZEND_FILE_LINE_C};
-  ZVal wait{ZEND_FILE_LINE_C};
-  worker->GetInitFunc().ToPhp(channel, init_func TSRMLS_CC);
-  assert(init_func.Type() == IS_OBJECT);
-  // Create a wrapper that will allow the JS function to set $_SERVER.
-  node_php_embed::node_php_jsserver_create(server.Ptr(), track_vars_array
-                                           TSRMLS_CC);
-  // Allow the JS function to be asynchronous.
-  node_php_embed::node_php_jswait_create(wait.Ptr() TSRMLS_CC);
-  // Now invoke the JS function, passing in the wrapper
-  zval *r = nullptr;
-  zend_call_method_with_2_params(init_func.PtrPtr(),
-                                 Z_OBJCE_P(init_func.Ptr()), nullptr,
-                                 "__invoke", &r, server.Ptr(), wait.Ptr());
-  if (EG(exception)) {
-    NPE_ERROR("Exception in server init function");
-    zend_clear_exception(TSRMLS_C);
-  }
-  if (r) { zval_ptr_dtor(&r); }
+  // The server variables were all passed in up front, so we can
+  // register them without a round trip to JS.
+  worker->RegisterServerVariables(track_vars_array TSRMLS_CC);
   TRACE("<");
 }
 
@@ -274,9 +193,97 @@ NAN_METHOD(setExtensionDir) {
   TRACE("<");
 }
 
+NAN_METHOD(setSpinLimit) {
+  TRACE(">");
+  REQUIRE_ARGUMENT_NUMBER(0);
+  double us = Nan::To<double>(info[0]).FromMaybe(0);
+  node_php_embed::MessageQueue::SetSpinLimit(
+      (us > 0) ? static_cast<uint64_t>(us * 1000) : 0);
+  TRACE("<");
+}
+
+NAN_METHOD(setOutputBuffer) {
+  TRACE(">");
+  REQUIRE_ARGUMENT_NUMBER(0);
+  REQUIRE_ARGUMENT_NUMBER(1);
+  double chunk_size = Nan::To<double>(info[0]).FromMaybe(0);
+  double high_water_mark = Nan::To<double>(info[1]).FromMaybe(0);
+  if (chunk_size < 0 || high_water_mark < 0) {
+    return Nan::ThrowRangeError("bad output buffer size");
+  }
+  OutputBuffer::SetChunkSize(static_cast<size_t>(chunk_size));
+  OutputBuffer::SetHighWaterMark(static_cast<size_t>(high_water_mark));
+  TRACE("<");
+}
+
+NAN_METHOD(setThreadPool) {
+  TRACE(">");
+  REQUIRE_ARGUMENT_INTEGER(0, threads);
+  REQUIRE_ARGUMENT_INTEGER(1, queue_limit);
+  if (threads < 1) {
+    return Nan::ThrowRangeError("bad thread pool size");
+  }
+  // A negative queue limit means "unlimited".
+  PhpThreadPool::Configure(static_cast<unsigned>(threads),
+                           static_cast<int>(queue_limit));
+  TRACE("<");
+}
+
+NAN_METHOD(setPrewarm) {
+  TRACE(">");
+  REQUIRE_ARGUMENTS(1);
+  PhpThreadPool::SetPrewarm(Nan::To<bool>(info[0]).FromMaybe(false));
+  TRACE("<");
+}
+
+NAN_METHOD(startupStats) {
+  uint64_t warm, cold;
+  PhpRequestWorker::GetStartupStats(&warm, &cold);
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  Nan::Set(result, NEW_STR("warm"),
+           Nan::New<v8::Number>(static_cast<double>(warm)));
+  Nan::Set(result, NEW_STR("cold"),
+           Nan::New<v8::Number>(static_cast<double>(cold)));
+  info.GetReturnValue().Set(result);
+}
+
+NAN_METHOD(setSourceCacheDir) {
+  TRACE(">");
+  REQUIRE_ARGUMENT_STRING(0, dir);
+  SourceCache::SetDirectory(*dir);
+  TRACE("<");
+}
+
+NAN_METHOD(setSourceCacheSize) {
+  TRACE(">");
+  REQUIRE_ARGUMENT_INTEGER(0, size);
+  if (size < 0) {
+    return Nan::ThrowRangeError("bad source cache size");
+  }
+  SourceCache::SetCapacity(static_cast<size_t>(size));
+  TRACE("<");
+}
+
+NAN_METHOD(sourceCacheStats) {
+  SourceCache::Stats stats;
+  SourceCache::GetStats(&stats);
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  Nan::Set(result, NEW_STR("hits"),
+           Nan::New<v8::Number>(static_cast<double>(stats.hits)));
+  Nan::Set(result, NEW_STR("misses"),
+           Nan::New<v8::Number>(static_cast<double>(stats.misses)));
+  Nan::Set(result, NEW_STR("evictions"),
+           Nan::New<v8::Number>(static_cast<double>(stats.evictions)));
+  Nan::Set(result, NEW_STR("entries"),
+           Nan::New<v8::Number>(static_cast<double>(stats.entries)));
+  Nan::Set(result, NEW_STR("capacity"),
+           Nan::New<v8::Number>(static_cast<double>(stats.capacity)));
+  info.GetReturnValue().Set(result);
+}
+
 NAN_METHOD(request) {
   TRACE(">");
-  REQUIRE_ARGUMENTS(4);
+  REQUIRE_ARGUMENTS(6);
   REQUIRE_ARGUMENT_STRING_NOCONV(0);
   if (!info[1]->IsObject()) {
     return Nan::ThrowTypeError("stream expected");
@@ -287,8 +294,8 @@ NAN_METHOD(request) {
   if (!info[3]->IsObject()) {
     return Nan::ThrowTypeError("server vars object expected");
   }
-  if (!info[4]->IsFunction()) {
-    return Nan::ThrowTypeError("init function expected");
+  if (!info[4]->IsObject()) {
+    return Nan::ThrowTypeError("options object expected");
   }
   if (!info[5]->IsFunction()) {
     return Nan::ThrowTypeError("callback expected");
@@ -297,13 +304,21 @@ NAN_METHOD(request) {
   v8::Local<v8::Object> stream = info[1].As<v8::Object>();
   v8::Local<v8::Array> args = info[2].As<v8::Array>();
   v8::Local<v8::Object> server_vars = info[3].As<v8::Object>();
-  v8::Local<v8::Value> init_func = info[4];
+  v8::Local<v8::Object> options = info[4].As<v8::Object>();
+  if (!PhpThreadPool::CanQueue()) {
+    v8::Local<v8::Value> e = Nan::Error("PHP request queue is full");
+    Nan::Set(e.As<v8::Object>(), NEW_STR("code"), NEW_STR("EPHPQUEUEFULL"));
+    return Nan::ThrowError(e);
+  }
   Nan::Callback *callback = new Nan::Callback(info[5].As<v8::Function>());
 
   node_php_embed_ensure_init();
-  Nan::AsyncQueueWorker(new PhpRequestWorker(callback, source, stream,
-                                             args, server_vars, init_func,
-                                             node_php_embed_startup_file));
+  PhpRequestWorker *worker =
+    new PhpRequestWorker(callback, source, stream, args, server_vars,
+                         options, node_php_embed_startup_file);
+  // Service contexts return a handle to the (eventually) open request.
+  info.GetReturnValue().Set(worker->GetServiceHandle());
+  PhpThreadPool::Queue(worker);
   TRACE("<");
 }
 
@@ -320,6 +335,7 @@ static void node_php_embed_globals_ctor(
     zend_node_php_embed_globals *node_php_embed_globals TSRMLS_DC) {
   node_php_embed_globals->worker = nullptr;
   node_php_embed_globals->channel = nullptr;
+  node_php_embed_globals->prewarmed = false;
 }
 static void node_php_embed_globals_dtor(
     zend_node_php_embed_globals *node_php_embed_globals TSRMLS_DC) {
@@ -328,9 +344,11 @@ static void node_php_embed_globals_dtor(
 
 PHP_MINIT_FUNCTION(node_php_embed) {
   TRACE("> PHP_MINIT_FUNCTION");
+  PHP_MINIT(node_php_jsasync_class)(INIT_FUNC_ARGS_PASSTHRU);
   PHP_MINIT(node_php_jsbuffer_class)(INIT_FUNC_ARGS_PASSTHRU);
+  PHP_MINIT(node_php_jsbyref_class)(INIT_FUNC_ARGS_PASSTHRU);
+  PHP_MINIT(node_php_jsfuture_class)(INIT_FUNC_ARGS_PASSTHRU);
   PHP_MINIT(node_php_jsobject_class)(INIT_FUNC_ARGS_PASSTHRU);
-  PHP_MINIT(node_php_jsserver_class)(INIT_FUNC_ARGS_PASSTHRU);
   PHP_MINIT(node_php_jswait_class)(INIT_FUNC_ARGS_PASSTHRU);
   TRACE("< PHP_MINIT_FUNCTION");
   return SUCCESS;
@@ -405,7 +423,7 @@ NAN_MODULE_INIT(ModuleInit) {
   php_embed_module.startup = node_php_embed_startup;
   php_embed_module.ub_write = node_php_embed_ub_write;
   php_embed_module.flush = node_php_embed_flush;
-  php_embed_module.send_header = node_php_embed_send_header;
+  php_embed_module.send_headers = node_php_embed_send_headers;
   php_embed_module.read_post = node_php_embed_read_post;
   php_embed_module.read_cookies = node_php_embed_read_cookies;
   php_embed_module.register_server_variables =
@@ -414,22 +432,37 @@ NAN_MODULE_INIT(ModuleInit) {
 
   // Initialize object type allowing access to PHP objects from JS
   node_php_embed::PhpObject::Init(target);
+  // ...and the handle for long-lived service contexts.
+  node_php_embed::ServiceContext::Init(target);
+  // ...and the sink for request bodies.
+  node_php_embed::PostSink::Init(target);
 
   // Export functions
   NAN_EXPORT(target, setIniPath);
   NAN_EXPORT(target, setStartupFile);
   NAN_EXPORT(target, setExtensionDir);
+  NAN_EXPORT(target, setSpinLimit);
+  NAN_EXPORT(target, setOutputBuffer);
+  NAN_EXPORT(target, setThreadPool);
+  NAN_EXPORT(target, setPrewarm);
+  NAN_EXPORT(target, startupStats);
+  NAN_EXPORT(target, setSourceCacheDir);
+  NAN_EXPORT(target, setSourceCacheSize);
+  NAN_EXPORT(target, sourceCacheStats);
   NAN_EXPORT(target, request);
   TRACE("<");
 }
 
 void ModuleShutdown(void *arg) {
   TRACE(">");
+  // Release the PHP threads' resources before PHP itself goes away.
+  PhpThreadPool::Shutdown();
   TSRMLS_FETCH();
   // The php_embed_shutdown expects there to be an open request, so
   // create one just for it to shutdown for us.
   php_request_startup(TSRMLS_C);
   php_embed_shutdown(TSRMLS_C);
+  SourceCache::Shutdown();
   if (php_embed_module.php_ini_path_override) {
     free(php_embed_module.php_ini_path_override);
     php_embed_module.php_ini_path_override = NULL;
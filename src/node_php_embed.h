@@ -23,6 +23,8 @@ class MapperChannel;
 ZEND_BEGIN_MODULE_GLOBALS(node_php_embed)
   node_php_embed::PhpRequestWorker *worker;
   node_php_embed::MapperChannel *channel;
+  // True if this thread has a request context started ahead of time.
+  bool prewarmed;
 ZEND_END_MODULE_GLOBALS(node_php_embed)
 
 ZEND_EXTERN_MODULE_GLOBALS(node_php_embed);
@@ -0,0 +1,167 @@
+// This is an opaque object, which can be created in PHP code, which
+// can be passed to JavaScript functions in the slot normally occupied
+// by the callback.  Unlike Js\Wait, it doesn't block the PHP thread:
+// the function call returns at once.  If the Js\Async wraps a PHP
+// closure, the closure is run on the PHP event loop when the callback
+// is invoked; otherwise the call returns a Js\Future.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/node_php_jsasync_class.h"
+
+extern "C" {
+#include "main/php.h"
+#include "Zend/zend.h"
+#include "Zend/zend_exceptions.h"
+}
+
+#include "src/macros.h"
+
+using node_php_embed::node_php_jsasync;
+
+/* Class entries */
+zend_class_entry *php_ce_jsasync;
+
+/*Object handlers */
+static zend_object_handlers node_php_jsasync_handlers;
+
+/* Constructors and destructors */
+static void node_php_jsasync_free_storage(
+    void *object,
+    zend_object_handle handle TSRMLS_DC) {
+  TRACE(">");
+  node_php_jsasync *c = reinterpret_cast<node_php_jsasync *>(object);
+
+  zend_object_std_dtor(&c->std TSRMLS_CC);
+  if (c->callback) { zval_ptr_dtor(&c->callback); }
+  efree(object);
+  TRACE("<");
+}
+
+static zend_object_value node_php_jsasync_new(zend_class_entry *ce TSRMLS_DC) {
+  TRACE(">");
+  zend_object_value retval;
+  node_php_jsasync *c;
+
+  c = reinterpret_cast<node_php_jsasync *>(ecalloc(1, sizeof(*c)));
+
+  zend_object_std_init(&c->std, ce TSRMLS_CC);
+
+  retval.handle = zend_objects_store_put(
+      c, nullptr,
+      (zend_objects_free_object_storage_t) node_php_jsasync_free_storage,
+      nullptr TSRMLS_CC);
+  retval.handlers = &node_php_jsasync_handlers;
+
+  TRACE("<");
+  return retval;
+}
+
+void node_php_embed::node_php_jsasync_create(zval *res TSRMLS_DC) {
+  TRACE(">");
+
+  object_init_ex(res, php_ce_jsasync);
+
+#if 0
+  node_php_jsasync *c = reinterpret_cast<node_php_jsasync *>
+    (zend_object_store_get_object(res TSRMLS_CC));
+
+  // Normally we'd initialize the fields of `c` here, but there's
+  // really nothing to do in this case.
+#endif
+
+  TRACE("<");
+}
+
+zval *node_php_embed::node_php_jsasync_find(ulong argc, zval **argv) {
+  for (ulong i = 0; i < argc; i++) {
+    if (Z_TYPE_P(argv[i]) == IS_OBJECT &&
+        Z_OBJCE_P(argv[i]) == php_ce_jsasync) {
+      return argv[i];
+    }
+  }
+  return nullptr;
+}
+
+zval *node_php_embed::node_php_jsasync_callback(zval *async TSRMLS_DC) {
+  node_php_jsasync *c = reinterpret_cast<node_php_jsasync *>
+    (zend_object_store_get_object(async TSRMLS_CC));
+  return c->callback;
+}
+
+/* Methods */
+#define PARSE_PARAMS(method, ...)                                       \
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, __VA_ARGS__) ==  \
+      FAILURE) {                                                        \
+    zend_throw_exception(zend_exception_get_default(TSRMLS_C),          \
+                         "bad args to " #method, 0 TSRMLS_CC);          \
+    return;                                                             \
+  }                                                                     \
+
+ZEND_BEGIN_ARG_INFO_EX(node_php_jsasync_construct_args, 0, 0, 0)
+  ZEND_ARG_INFO(0, callback)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(JsAsync, __construct) {
+  zval *callback = nullptr;
+  TRACE(">");
+  PARSE_PARAMS(__construct, "|z!", &callback);
+  if (callback && !zend_is_callable(callback, 0, nullptr TSRMLS_CC)) {
+    zend_throw_exception(zend_exception_get_default(TSRMLS_C),
+                         "Js\\Async callback is not callable", 0 TSRMLS_CC);
+    return;
+  }
+  node_php_jsasync *obj = reinterpret_cast<node_php_jsasync *>
+    (zend_object_store_get_object(this_ptr TSRMLS_CC));
+  if (obj->callback) { zval_ptr_dtor(&obj->callback); }
+  if (callback) { Z_ADDREF_P(callback); }
+  obj->callback = callback;
+  TRACE("<");
+}
+
+#define STUB_METHOD(name)                                               \
+  PHP_METHOD(JsAsync, name) {                                           \
+    TRACE(">");                                                         \
+    zend_throw_exception(                                               \
+        zend_exception_get_default(TSRMLS_C),                           \
+        "Can't directly serialize or unserialize JsAsync.",             \
+        0 TSRMLS_CC);                                                   \
+    TRACE("<");                                                         \
+    RETURN_FALSE;                                                       \
+  }
+
+/* NOTE: We could also override node_php_jsasync_handlers.get_constructor
+ * to throw an exception when invoked, but doing so causes the
+ * half-constructed object to leak -- this seems to be a PHP bug.  So
+ * we'll define magic __construct methods instead. */
+STUB_METHOD(__sleep)
+STUB_METHOD(__wakeup)
+
+static const zend_function_entry node_php_jsasync_methods[] = {
+  PHP_ME(JsAsync, __construct, node_php_jsasync_construct_args,
+         ZEND_ACC_PUBLIC|ZEND_ACC_CTOR)
+  PHP_ME(JsAsync, __sleep,     nullptr,
+         ZEND_ACC_PUBLIC|ZEND_ACC_FINAL)
+  PHP_ME(JsAsync, __wakeup,    nullptr,
+         ZEND_ACC_PUBLIC|ZEND_ACC_FINAL)
+  ZEND_FE_END
+};
+
+PHP_MINIT_FUNCTION(node_php_jsasync_class) {
+  TRACE("> PHP_MINIT_FUNCTION");
+  zend_class_entry ce;
+  /* JsAsync class */
+  INIT_CLASS_ENTRY(ce, "Js\\Async", node_php_jsasync_methods);
+  php_ce_jsasync = zend_register_internal_class(&ce TSRMLS_CC);
+  php_ce_jsasync->ce_flags |= ZEND_ACC_FINAL;
+  php_ce_jsasync->create_object = node_php_jsasync_new;
+
+  /* JsAsync handlers */
+  memcpy(&node_php_jsasync_handlers, zend_get_std_object_handlers(),
+         sizeof(zend_object_handlers));
+  node_php_jsasync_handlers.clone_obj = nullptr;
+  node_php_jsasync_handlers.cast_object = nullptr;
+  node_php_jsasync_handlers.get_property_ptr_ptr = nullptr;
+
+  TRACE("< PHP_MINIT_FUNCTION");
+  return SUCCESS;
+}
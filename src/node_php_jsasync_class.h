@@ -1,6 +1,9 @@
-// This is a wrapper for PHP closures which signals that a given PHP closure
-// should be considered a reference to the PHP event loop, so that PHP
-// execution is not considered complete until the closure is executed once.
+// This is an opaque object, which can be created in PHP code, which
+// can be passed to JavaScript functions in the slot normally occupied
+// by the callback.  Unlike Js\Wait, it doesn't block the PHP thread:
+// the function call returns at once.  If the Js\Async wraps a PHP
+// closure, the closure is run on the PHP event loop when the callback
+// is invoked; otherwise the call returns a Js\Future.
 
 // Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
 #ifndef NODE_PHP_EMBED_NODE_PHP_JSASYNC_CLASS_H_
@@ -13,16 +16,21 @@ extern "C" {
 
 namespace node_php_embed {
 
-class MessageToJs;
-
 struct node_php_jsasync {
   zend_object std;
-  // No special properties.
+  zval *callback;  // May be null.
 };
 
-/* Create a PHP version of a JS Buffer. */
+/* Create a new Js\Async marker. */
 void node_php_jsasync_create(zval *res TSRMLS_DC);
 
+/* Returns the first of the given arguments which is a Js\Async marker,
+ * or null if there isn't one. */
+zval *node_php_jsasync_find(ulong argc, zval **argv);
+
+/* Returns the PHP callback wrapped by the given Js\Async, or null. */
+zval *node_php_jsasync_callback(zval *async TSRMLS_DC);
+
 }  // namespace node_php_embed
 
 extern zend_class_entry *php_ce_jsasync;
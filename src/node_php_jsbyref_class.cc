@@ -0,0 +1,98 @@
+// This is a simple marker class, created in PHP code, which indicates
+// that a given value should be passed to JavaScript by reference.
+// It holds a PHP reference to the wrapped value in its `value` property.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/node_php_jsbyref_class.h"
+
+extern "C" {
+#include "main/php.h"
+#include "Zend/zend.h"
+#include "Zend/zend_exceptions.h"
+}
+
+#include "src/macros.h"
+
+/* Class entries */
+zend_class_entry *php_ce_jsbyref;
+
+/* Helpers */
+// Returns a pointer to the slot holding the `value` property.
+static zval **node_php_jsbyref_slot(zval *byref TSRMLS_DC) {
+  zval member; INIT_ZVAL(member);
+  ZVAL_STRINGL(&member, "value", 5, 0);
+  return Z_OBJ_HT_P(byref)->get_property_ptr_ptr(byref, &member, BP_VAR_W
+                                                 ZEND_HASH_KEY_NULL
+                                                 TSRMLS_CC);
+}
+
+zval *node_php_embed::node_php_jsbyref_get(zval *byref TSRMLS_DC) {
+  zval **slot = node_php_jsbyref_slot(byref TSRMLS_CC);
+  if (!slot) { return nullptr; }
+  SEPARATE_ZVAL_TO_MAKE_IS_REF(slot);
+  Z_ADDREF_PP(slot);
+  return *slot;
+}
+
+/* Methods */
+ZEND_BEGIN_ARG_INFO_EX(node_php_jsbyref_construct_args, 0, 0, 1)
+  ZEND_ARG_INFO(1, value)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(JsByRef, __construct) {
+  TRACE(">");
+  zval *value;
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &value) ==
+      FAILURE) {
+    zend_throw_exception(zend_exception_get_default(TSRMLS_C),
+                         "bad args to __construct", 0 TSRMLS_CC);
+    return;
+  }
+  // Equivalent to `$this->value =& $value;`.  Since the argument is
+  // passed by reference, `value` is already the shared reference.
+  zval **slot = node_php_jsbyref_slot(this_ptr TSRMLS_CC);
+  if (slot && *slot != value) {
+    Z_ADDREF_P(value);
+    zval_ptr_dtor(slot);
+    *slot = value;
+  }
+  TRACE("<");
+}
+
+ZEND_BEGIN_ARG_INFO_EX(node_php_jsbyref_getvalue_args, 0, 1, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(JsByRef, getValue) {
+  TRACE(">");
+  zval *value = node_php_embed::node_php_jsbyref_get(this_ptr TSRMLS_CC);
+  if (!value) { RETURN_NULL(); }
+  if (return_value_ptr) {
+    // Return by reference.
+    zval_ptr_dtor(return_value_ptr);
+    *return_value_ptr = value;
+  } else {
+    RETVAL_ZVAL(value, 1, 0);
+    zval_ptr_dtor(&value);
+  }
+  TRACE("<");
+}
+
+static const zend_function_entry node_php_jsbyref_methods[] = {
+  PHP_ME(JsByRef, __construct, node_php_jsbyref_construct_args,
+         ZEND_ACC_PUBLIC|ZEND_ACC_CTOR)
+  PHP_ME(JsByRef, getValue, node_php_jsbyref_getvalue_args,
+         ZEND_ACC_PUBLIC)
+  ZEND_FE_END
+};
+
+PHP_MINIT_FUNCTION(node_php_jsbyref_class) {
+  TRACE("> PHP_MINIT_FUNCTION");
+  zend_class_entry ce;
+  /* JsByRef class */
+  INIT_CLASS_ENTRY(ce, "Js\\ByRef", node_php_jsbyref_methods);
+  php_ce_jsbyref = zend_register_internal_class(&ce TSRMLS_CC);
+  zend_declare_property_null(php_ce_jsbyref, "value", 5,
+                             ZEND_ACC_PUBLIC TSRMLS_CC);
+  TRACE("< PHP_MINIT_FUNCTION");
+  return SUCCESS;
+}
@@ -0,0 +1,26 @@
+// This is a simple marker class, created in PHP code, which indicates
+// that a given value should be passed to JavaScript by reference.
+// It holds a PHP reference to the wrapped value in its `value` property.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_NODE_PHP_JSBYREF_CLASS_H_
+#define NODE_PHP_EMBED_NODE_PHP_JSBYREF_CLASS_H_
+
+extern "C" {
+#include "main/php.h"
+#include "Zend/zend.h"
+}
+
+namespace node_php_embed {
+
+/* Return the (reference) zval wrapped by a Js\ByRef object, with its
+ * refcount incremented. */
+zval *node_php_jsbyref_get(zval *byref TSRMLS_DC);
+
+}  // namespace node_php_embed
+
+extern zend_class_entry *php_ce_jsbyref;
+
+PHP_MINIT_FUNCTION(node_php_jsbyref_class);
+
+#endif  // NODE_PHP_EMBED_NODE_PHP_JSBYREF_CLASS_H_
@@ -0,0 +1,255 @@
+// This is the result of a JavaScript function call made with a
+// Js\Async marker in place of its callback.  PHP code can keep
+// running while the call is outstanding, and `wait()` for the value
+// (or exception) passed to the callback later.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/node_php_jsfuture_class.h"
+
+#include <cassert>
+#include <vector>
+
+extern "C" {
+#include "main/php.h"
+#include "Zend/zend.h"
+#include "Zend/zend_exceptions.h"
+}
+
+#include "src/macros.h"
+#include "src/messages.h"
+#include "src/node_php_jsobject_class.h"  // for exception wrapping
+
+using node_php_embed::MapperChannel;
+using node_php_embed::node_php_jsfuture;
+
+/* Class entries */
+zend_class_entry *php_ce_jsfuture;
+
+/*Object handlers */
+static zend_object_handlers node_php_jsfuture_handlers;
+
+/* Constructors and destructors */
+static void node_php_jsfuture_free_storage(
+    void *object,
+    zend_object_handle handle TSRMLS_DC) {
+  TRACE(">");
+  node_php_jsfuture *c = reinterpret_cast<node_php_jsfuture *>(object);
+
+  zend_object_std_dtor(&c->std TSRMLS_CC);
+  if (c->value) { zval_ptr_dtor(&c->value); }
+  if (c->exception) { zval_ptr_dtor(&c->exception); }
+  efree(object);
+  TRACE("<");
+}
+
+static zend_object_value node_php_jsfuture_new(zend_class_entry *ce
+                                               TSRMLS_DC) {
+  TRACE(">");
+  zend_object_value retval;
+  node_php_jsfuture *c;
+
+  c = reinterpret_cast<node_php_jsfuture *>(ecalloc(1, sizeof(*c)));
+
+  zend_object_std_init(&c->std, ce TSRMLS_CC);
+
+  retval.handle = zend_objects_store_put(
+      c, nullptr,
+      (zend_objects_free_object_storage_t) node_php_jsfuture_free_storage,
+      nullptr TSRMLS_CC);
+  retval.handlers = &node_php_jsfuture_handlers;
+
+  TRACE("<");
+  return retval;
+}
+
+void node_php_embed::node_php_jsfuture_create(zval *res,
+                                              MapperChannel *channel
+                                              TSRMLS_DC) {
+  TRACE(">");
+  object_init_ex(res, php_ce_jsfuture);
+  node_php_jsfuture *c = reinterpret_cast<node_php_jsfuture *>
+    (zend_object_store_get_object(res TSRMLS_CC));
+  c->channel = channel;
+  TRACE("<");
+}
+
+bool node_php_embed::node_php_jsfuture_is(zval *z) {
+  return Z_TYPE_P(z) == IS_OBJECT && Z_OBJCE_P(z) == php_ce_jsfuture;
+}
+
+void node_php_embed::node_php_jsfuture_resolve(zval *future, zval *exception,
+                                               zval *value TSRMLS_DC) {
+  TRACE(">");
+  node_php_jsfuture *c = reinterpret_cast<node_php_jsfuture *>
+    (zend_object_store_get_object(future TSRMLS_CC));
+  assert(!c->done);
+  c->done = true;
+  zval **slot = exception ? &c->exception : &c->value;
+  *slot = exception ? exception : value;
+  Z_ADDREF_P(*slot);
+  TRACE("<");
+}
+
+// Block until all of the given futures are resolved.
+static void node_php_jsfuture_wait_all(
+    const std::vector<node_php_jsfuture*> &futures TSRMLS_DC) {
+  MapperChannel *channel = nullptr;
+  for (auto f : futures) {
+    if (!f->done) { channel = f->channel; break; }
+  }
+  if (!channel) { return; }
+  channel->WaitForJs([&futures]() {
+    for (auto f : futures) {
+      if (!f->done) { return false; }
+    }
+    return true;
+  } TSRMLS_CC);
+}
+
+/* Methods */
+#define FETCH_OBJ(method, this_ptr)                                     \
+  node_php_jsfuture *obj = reinterpret_cast<node_php_jsfuture *>        \
+    (zend_object_store_get_object(this_ptr TSRMLS_CC))
+
+#define PARSE_PARAMS(method, ...)                                       \
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, __VA_ARGS__) ==  \
+      FAILURE) {                                                        \
+    zend_throw_exception(zend_exception_get_default(TSRMLS_C),          \
+                         "bad args to " #method, 0 TSRMLS_CC);          \
+    return;                                                             \
+  }                                                                     \
+
+ZEND_BEGIN_ARG_INFO_EX(node_php_jsfuture_wait_args, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(JsFuture, wait) {
+  TRACE(">");
+  FETCH_OBJ(wait, this_ptr);
+  node_php_jsfuture_wait_all({ obj } TSRMLS_CC);
+  if (obj->exception) {
+    node_php_embed::node_php_jsobject_throw_exception(obj->exception
+                                                      TSRMLS_CC);
+    return;
+  }
+  RETVAL_ZVAL(obj->value, 1, 0);
+  TRACE("<");
+}
+
+ZEND_BEGIN_ARG_INFO_EX(node_php_jsfuture_isdone_args, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+PHP_METHOD(JsFuture, isDone) {
+  TRACE(">");
+  FETCH_OBJ(isDone, this_ptr);
+  RETVAL_BOOL(obj->done);
+  TRACE("<");
+}
+
+ZEND_BEGIN_ARG_INFO_EX(node_php_jsfuture_all_args, 0, 0, 1)
+  ZEND_ARG_ARRAY_INFO(0, futures, 0)
+ZEND_END_ARG_INFO()
+
+/* Wait for every future in the array, then return an array (with the
+ * same keys) of their values.  Other values are passed through.  If
+ * any future was rejected, throws the first such exception instead. */
+PHP_METHOD(JsFuture, all) {
+  zval *arr;
+  TRACE(">");
+  PARSE_PARAMS(all, "a", &arr);
+  HashTable *ht = Z_ARRVAL_P(arr);
+  HashPosition pos;
+  zval **entry;
+  std::vector<node_php_jsfuture*> futures;
+  for (zend_hash_internal_pointer_reset_ex(ht, &pos);
+       zend_hash_get_current_data_ex(ht, reinterpret_cast<void**>(&entry),
+                                     &pos) == SUCCESS;
+       zend_hash_move_forward_ex(ht, &pos)) {
+    if (node_php_embed::node_php_jsfuture_is(*entry)) {
+      futures.push_back(reinterpret_cast<node_php_jsfuture *>
+                        (zend_object_store_get_object(*entry TSRMLS_CC)));
+    }
+  }
+  node_php_jsfuture_wait_all(futures TSRMLS_CC);
+  for (auto f : futures) {
+    if (f->exception) {
+      node_php_embed::node_php_jsobject_throw_exception(f->exception
+                                                        TSRMLS_CC);
+      return;
+    }
+  }
+  array_init_size(return_value, zend_hash_num_elements(ht));
+  for (zend_hash_internal_pointer_reset_ex(ht, &pos);
+       zend_hash_get_current_data_ex(ht, reinterpret_cast<void**>(&entry),
+                                     &pos) == SUCCESS;
+       zend_hash_move_forward_ex(ht, &pos)) {
+    zval *v = *entry;
+    if (node_php_embed::node_php_jsfuture_is(v)) {
+      v = reinterpret_cast<node_php_jsfuture *>
+        (zend_object_store_get_object(v TSRMLS_CC))->value;
+    }
+    Z_ADDREF_P(v);
+    char *key; uint key_len; ulong idx;
+    if (zend_hash_get_current_key_ex(ht, &key, &key_len, &idx, 0, &pos) ==
+        HASH_KEY_IS_STRING) {
+      add_assoc_zval_ex(return_value, key, key_len, v);
+    } else {
+      add_index_zval(return_value, idx, v);
+    }
+  }
+  TRACE("<");
+}
+
+#define STUB_METHOD(name)                                               \
+  PHP_METHOD(JsFuture, name) {                                          \
+    TRACE(">");                                                         \
+    zend_throw_exception(                                               \
+        zend_exception_get_default(TSRMLS_C),                           \
+        "Can't directly construct, serialize, or unserialize JsFuture.", \
+        0 TSRMLS_CC);                                                   \
+    TRACE("<");                                                         \
+    RETURN_FALSE;                                                       \
+  }
+
+/* NOTE: We could also override node_php_jsfuture_handlers.get_constructor
+ * to throw an exception when invoked, but doing so causes the
+ * half-constructed object to leak -- this seems to be a PHP bug.  So
+ * we'll define magic __construct methods instead. */
+STUB_METHOD(__construct)
+STUB_METHOD(__sleep)
+STUB_METHOD(__wakeup)
+
+static const zend_function_entry node_php_jsfuture_methods[] = {
+  PHP_ME(JsFuture, __construct, nullptr,
+         ZEND_ACC_PUBLIC|ZEND_ACC_CTOR)
+  PHP_ME(JsFuture, wait,        node_php_jsfuture_wait_args,
+         ZEND_ACC_PUBLIC)
+  PHP_ME(JsFuture, isDone,      node_php_jsfuture_isdone_args,
+         ZEND_ACC_PUBLIC)
+  PHP_ME(JsFuture, all,         node_php_jsfuture_all_args,
+         ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+  PHP_ME(JsFuture, __sleep,     nullptr,
+         ZEND_ACC_PUBLIC|ZEND_ACC_FINAL)
+  PHP_ME(JsFuture, __wakeup,    nullptr,
+         ZEND_ACC_PUBLIC|ZEND_ACC_FINAL)
+  ZEND_FE_END
+};
+
+PHP_MINIT_FUNCTION(node_php_jsfuture_class) {
+  TRACE("> PHP_MINIT_FUNCTION");
+  zend_class_entry ce;
+  /* JsFuture class */
+  INIT_CLASS_ENTRY(ce, "Js\\Future", node_php_jsfuture_methods);
+  php_ce_jsfuture = zend_register_internal_class(&ce TSRMLS_CC);
+  php_ce_jsfuture->ce_flags |= ZEND_ACC_FINAL;
+  php_ce_jsfuture->create_object = node_php_jsfuture_new;
+
+  /* JsFuture handlers */
+  memcpy(&node_php_jsfuture_handlers, zend_get_std_object_handlers(),
+         sizeof(zend_object_handlers));
+  node_php_jsfuture_handlers.clone_obj = nullptr;
+  node_php_jsfuture_handlers.cast_object = nullptr;
+  node_php_jsfuture_handlers.get_property_ptr_ptr = nullptr;
+
+  TRACE("< PHP_MINIT_FUNCTION");
+  return SUCCESS;
+}
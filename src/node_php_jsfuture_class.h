@@ -0,0 +1,42 @@
+// This is the result of a JavaScript function call made with a
+// Js\Async marker in place of its callback.  PHP code can keep
+// running while the call is outstanding, and `wait()` for the value
+// (or exception) passed to the callback later.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_NODE_PHP_JSFUTURE_CLASS_H_
+#define NODE_PHP_EMBED_NODE_PHP_JSFUTURE_CLASS_H_
+
+extern "C" {
+#include "main/php.h"
+#include "Zend/zend.h"
+}
+
+namespace node_php_embed {
+
+class MapperChannel;
+
+struct node_php_jsfuture {
+  zend_object std;
+  MapperChannel *channel;
+  bool done;
+  zval *value;
+  zval *exception;
+};
+
+/* Create a new (unresolved) future.  res should be allocated & inited,
+ * and it is owned by the caller. */
+void node_php_jsfuture_create(zval *res, MapperChannel *channel TSRMLS_DC);
+/* Returns true if the given zval is a Js\Future. */
+bool node_php_jsfuture_is(zval *z);
+/* Resolve the future with the given exception (if non-null) or value. */
+void node_php_jsfuture_resolve(zval *future, zval *exception, zval *value
+                               TSRMLS_DC);
+
+}  // namespace node_php_embed
+
+extern zend_class_entry *php_ce_jsfuture;
+
+PHP_MINIT_FUNCTION(node_php_jsfuture_class);
+
+#endif  // NODE_PHP_EMBED_NODE_PHP_JSFUTURE_CLASS_H_
@@ -15,6 +15,8 @@ extern "C" {
 
 #include "src/macros.h"
 #include "src/messages.h"
+#include "src/node_php_jsasync_class.h"
+#include "src/node_php_jsfuture_class.h"
 #include "src/values.h"
 
 // An alternative approach where we use an __isset magic method.
@@ -88,6 +90,11 @@ static void throwWrappedException(ZVal *e TSRMLS_DC) {
   return;
 }
 
+void node_php_embed::node_php_jsobject_throw_exception(zval *e TSRMLS_DC) {
+  ZVal z(e ZEND_FILE_LINE_CC);
+  throwWrappedException(&z TSRMLS_CC);
+}
+
 /* JsObject handlers */
 
 class JsHasPropertyMsg : public MessageToJs {
@@ -353,6 +360,52 @@ PHP_METHOD(JsObject, __unset) {
   TRACE("<");
 }
 
+/* Helpers for waiting on JS thenables from PHP.  The `data` of each
+ * of these functions is a node-style callback made by MakeCallback. */
+static void node_php_jsobject_resolved(
+    const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Value> argv[] = {
+    Nan::Null(),
+    info.Length() > 0 ? info[0] :
+      static_cast<v8::Local<v8::Value>>(Nan::Undefined())
+  };
+  Nan::CallAsFunction(info.Data().As<v8::Function>(), Nan::GetCurrentContext()
+                      ->Global(), 2, argv);
+}
+static void node_php_jsobject_rejected(
+    const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Value> reason = info.Length() > 0 ? info[0] :
+    static_cast<v8::Local<v8::Value>>(Nan::Undefined());
+  if (reason->IsNull() || reason->IsUndefined()) {
+    // A falsy rejection would look like success to the callback.
+    reason = Nan::Error("Promise rejected");
+  }
+  v8::Local<v8::Value> argv[] = { reason };
+  Nan::CallAsFunction(info.Data().As<v8::Function>(), Nan::GetCurrentContext()
+                      ->Global(), 1, argv);
+}
+// Returns the `then` method of `value`, or an empty handle if `value`
+// is not a thenable.
+static v8::Local<v8::Function> node_php_jsobject_then(
+    v8::Local<v8::Value> value) {
+  if (!value->IsObject()) { return v8::Local<v8::Function>(); }
+  v8::Local<v8::Value> then =
+    Nan::Get(value.As<v8::Object>(), NEW_STR("then"))
+    .FromMaybe<v8::Value>(Nan::Undefined());
+  if (!then->IsFunction()) { return v8::Local<v8::Function>(); }
+  return then.As<v8::Function>();
+}
+// Invoke `callback` node-style once `thenable` settles.
+static void node_php_jsobject_await(v8::Local<v8::Object> thenable,
+                                    v8::Local<v8::Function> then,
+                                    v8::Local<v8::Function> callback) {
+  v8::Local<v8::Value> argv[] = {
+    Nan::New<v8::Function>(node_php_jsobject_resolved, callback),
+    Nan::New<v8::Function>(node_php_jsobject_rejected, callback)
+  };
+  Nan::CallAsFunction(then, thenable, 2, argv);
+}
+
 class JsInvokeMsg : public MessageToJs {
  public:
   JsInvokeMsg(ObjectMapper *m, zval *callback, bool isSync,
@@ -390,10 +443,19 @@ class JsInvokeMsg : public MessageToJs {
         Nan::Get(jsObj.ToLocalChecked(), member)
           .FromMaybe<v8::Value>(Nan::Undefined()));
     }
-    if (method.IsEmpty()) {
-      return Nan::ThrowTypeError("method is not an object");
-    }
-    if (!method.ToLocalChecked()->IsFunction()) {
+    if (method.IsEmpty() || !method.ToLocalChecked()->IsFunction()) {
+      // `$promise->wait()` blocks until a JS thenable settles, unless
+      // the object has a `wait` method of its own.
+      v8::Local<v8::Function> then;
+      if (member->IsString() && IsWaitMethod(member) &&
+          !(then = node_php_jsobject_then(jsObj.ToLocalChecked()))
+          .IsEmpty()) {
+        node_php_jsobject_await(jsObj.ToLocalChecked(), then, MakeCallback());
+        return;
+      }
+      if (method.IsEmpty()) {
+        return Nan::ThrowTypeError("method is not an object");
+      }
       return Nan::ThrowTypeError("method is not a function");
     }
     v8::Local<v8::Function> func = method.ToLocalChecked().As<v8::Function>();
@@ -402,45 +464,77 @@ class JsInvokeMsg : public MessageToJs {
       static_cast<v8::Local<v8::Value>*>
       (alloca(sizeof(v8::Local<v8::Value>) * argc));
     bool sawWait = false;
+    v8::Local<v8::Function> callback;
     for (ulong i = 0; i < argc; i++) {
       new(&argv[i]) v8::Local<v8::Value>;
       if (argv_[i].IsWait() && !sawWait) {
         sawWait = true;
-        argv[i] = MakeCallback();
+        argv[i] = callback = MakeCallback();
       } else {
         argv[i] = argv_[i].ToJs(m);
       }
     }
     Nan::MaybeLocal<v8::Value> result =
       Nan::CallAsFunction(func, jsObj.ToLocalChecked(), argc, argv);
-    if (!result.IsEmpty() && !sawWait) {
-      // XXX perhaps if the result is a promise, we should wait on it?
-      // Better would be a PHP-side function we could call using the
-      // existing JsWait, ie:
-      //   $p = promiseReturningFunction();
-      //   $p.wait(new JsWait);
-      // where:
-      //   Promise.prototype.wait = function(cb) {
-      //     this.then(function(v) { cb(null, v); }, cb);
-      //   }
-      // This is actually Promise#nodify from prfun, so perhaps
-      // all that is needed is to call prfun's Promise.resolve()
-      // on any wrapped promise objects?
+    if (result.IsEmpty()) {
+      // An exception was thrown.
+    } else if (sawWait) {
+      // A promise-returning function won't invoke the Js\Wait
+      // callback; wait for the promise instead.  (If the function
+      // does both, whichever happens first wins.)
+      v8::Local<v8::Value> r = result.ToLocalChecked();
+      v8::Local<v8::Function> then = node_php_jsobject_then(r);
+      if (!then.IsEmpty()) {
+        node_php_jsobject_await(r.As<v8::Object>(), then, callback);
+      }
+    } else {
       retval_.Set(m, result.ToLocalChecked());
     }
     TRACE("< JsInvokeMsg");
   }
 
  private:
+  static bool IsWaitMethod(v8::Local<v8::Value> member) {
+    Nan::Utf8String name(member);
+    return name.length() == 4 && strcmp(*name, "wait") == 0;
+  }
+
   Value object_;
   Value member_;
   ulong argc_;
   Value argv_;
 };
 
-// XXX Figure out how to actually invoke methods async.
-// (or async methods sync, by passing a JS callback which will unblock
-// the PHP thread)
+// If any of the arguments is a Js\Async marker, send the invocation
+// without waiting for it.  The result is passed to the Js\Async's
+// callback, if it has one; otherwise we return a Js\Future for it.
+// Returns false (having done nothing) if there's no Js\Async.
+static bool node_php_jsobject_call_async(node_php_jsobject *obj,
+                                         zval *member, ulong argc,
+                                         zval **argv, zval *return_value
+                                         TSRMLS_DC) {
+  zval *async = node_php_embed::node_php_jsasync_find(argc, argv);
+  if (!async) {
+    return false;
+  }
+  zval *callback = node_php_embed::node_php_jsasync_callback(async
+                                                             TSRMLS_CC);
+  ZVal future{ZEND_FILE_LINE_C};
+  if (!callback) {
+    node_php_embed::node_php_jsfuture_create(future.Ptr(), obj->channel
+                                             TSRMLS_CC);
+    callback = future.Ptr();
+  }
+  // The message deletes itself once the response has been delivered
+  // to the callback, which releases this reference to the event loop.
+  JsInvokeMsg *msg = new JsInvokeMsg(obj->channel, callback, false,
+                                     obj->id, member, argc, argv TSRMLS_CC);
+  obj->channel->RefLoop();
+  obj->channel->SendToJs(msg, MessageFlags::ASYNC TSRMLS_CC);
+  RETVAL_ZVAL(future.Ptr(), 1, 0);  // Null, for callbacks.
+  return true;
+}
+
 ZEND_BEGIN_ARG_INFO_EX(node_php_jsobject_call_args, 0, 1/*return by ref*/, 1)
     ZEND_ARG_INFO(0, member)
     ZEND_ARG_ARRAY_INFO(0, args, 0)
@@ -463,6 +557,11 @@ PHP_METHOD(JsObject, __call) {
       argv[i] = *z;
     }
   }
+  if (node_php_jsobject_call_async(obj, member, argc, argv, return_value
+                                   TSRMLS_CC)) {
+    TRACE("< async");
+    return;
+  }
   JsInvokeMsg msg(obj->channel, nullptr, true,      // Sync call.
                   obj->id, member, argc, argv TSRMLS_CC);
   obj->channel->SendToJs(&msg, MessageFlags::SYNC TSRMLS_CC);
@@ -489,6 +588,12 @@ PHP_METHOD(JsObject, __invoke) {
                          "bad args to __invoke", 0 TSRMLS_CC);
     return;
   }
+  if (node_php_jsobject_call_async(obj, &member, argc, argv, return_value
+                                   TSRMLS_CC)) {
+    efree(argv);
+    TRACE("< async");
+    return;
+  }
   JsInvokeMsg msg(obj->channel, nullptr, true,      // Sync call.
                   obj->id, &member, argc, argv TSRMLS_CC);
   efree(argv);
@@ -569,18 +674,13 @@ static void node_php_jsobject_free_storage(void *object,
 
   zend_object_std_dtor(&c->std TSRMLS_CC);
 
-  // XXX We ought to deregister the id here.
   TRACE("PHP deallocate");
-
-  // You'd first remove the zval from the id->zval mapping table,
-  // since that could always been recreated, and then fire-and-forget
-  // a message to JS land.  On receipt JS would mark the value as
-  // 'dying', then fire off a new messge to PHP land.  PHP would
-  // respond with whether the object has been resurrected.  When JS
-  // gets this response, if the object has not been resurrected and
-  // the JS `dying` flag is still set (it would be removed if another
-  // reference to that object was made), then it could actually remove
-  // the ref from its table on the JS side.
+  // Let JS know it can drop its reference (unless we've been neutered).
+  // The mapper only holds us weakly, and sorts out the race with the
+  // object being sent to PHP again; see AsyncMapperChannel.
+  if (c->channel) {
+    c->channel->ReleaseJsObj(c->id TSRMLS_CC);
+  }
 
   efree(object);
   TRACE("<");
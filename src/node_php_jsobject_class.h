@@ -32,6 +32,9 @@ void node_php_jsobject_create(zval *res, MapperChannel *channel,
  * reference. */
 void node_php_jsobject_maybe_neuter(zval *o TSRMLS_DC);
 
+/* Throw a PHP exception wrapping the given JS exception. */
+void node_php_jsobject_throw_exception(zval *e TSRMLS_DC);
+
 /* Export a method call backdoor to work around the fact that we want
  * to call JS to get POST data before the request's function
  * caches are properly set up. */
@@ -69,6 +69,15 @@ void PhpObject::MaybeNeuter(MapperChannel *channel, v8::Local<v8::Object> obj) {
   p->id_ = 0;
 }
 
+objid_t PhpObject::IdFor(MapperChannel *channel, v8::Local<v8::Object> obj) {
+  v8::Local<v8::FunctionTemplate> t = Nan::New(cons_template());
+  if (!t->HasInstance(obj)) {
+    return 0;
+  }
+  PhpObject *p = Unwrap<PhpObject>(obj);
+  return (p->channel_ == channel) ? p->id_ : 0;
+}
+
 NAN_MODULE_INIT(PhpObject::Init) {
   v8::Local<v8::String> class_name = NEW_STR("PhpObject");
   v8::Local<v8::FunctionTemplate> tpl =
@@ -89,11 +98,13 @@ NAN_MODULE_INIT(PhpObject::Init) {
                                  PhpObject::IndexDelete,
                                  PhpObject::IndexEnumerate);
   Nan::Set(target, class_name, constructor());
+  Nan::SetMethod(target, "invokeAsync", PhpObject::InvokeAsync);
 }
 
 PhpObject::~PhpObject() {
-  // XXX remove from mapping table, notify PHP.
   TRACE("JS deallocate");
+  // Let PHP know it can drop its reference (unless we've been neutered).
+  if (channel_) { channel_->ReleasePhpObj(id_); }
 }
 
 NAN_METHOD(PhpObject::New) {
@@ -654,6 +665,17 @@ class PhpObject::PhpInvokeMsg : public MessageToPhp {
       v.Set(m, (*info)[idx]);
     });
   }
+  PhpInvokeMsg(ObjectMapper *m, Nan::Callback *callback, bool is_sync,
+               objid_t obj, v8::Local<v8::String> method,
+               v8::Local<v8::Array> args)
+      : MessageToPhp(m, callback, is_sync), method_(m, method),
+        argc_(args->Length()), argv_(),
+        should_convert_array_to_iterator_(false) {
+    obj_.SetJsObject(obj);
+    argv_.SetArrayByValue(argc_, [m, args](uint32_t idx, Value& v) {
+      v.Set(m, Nan::Get(args, idx).ToLocalChecked());
+    });
+  }
   inline bool should_convert_array_to_iterator() {
     return should_convert_array_to_iterator_;
   }
@@ -844,6 +866,29 @@ void PhpObject::MethodThunk_(v8::Local<v8::String> method,
     info.GetReturnValue().Set(msg.retval().ToJs(channel_));
   }
 }
+NAN_METHOD(PhpObject::InvokeAsync) {
+  REQUIRE_ARGUMENTS(4);
+  v8::Local<v8::FunctionTemplate> t = Nan::New(cons_template());
+  if (!(info[0]->IsObject() && t->HasInstance(info[0]))) {
+    return Nan::ThrowTypeError("PHP object expected");
+  }
+  REQUIRE_ARGUMENT_STRING_NOCONV(1);
+  if (!info[2]->IsArray()) {
+    return Nan::ThrowTypeError("argument array expected");
+  }
+  if (!info[3]->IsFunction()) {
+    return Nan::ThrowTypeError("callback expected");
+  }
+  PhpObject *p = Unwrap<PhpObject>(info[0].As<v8::Object>());
+  if (p->id_ == 0) {
+    return Nan::ThrowError("Invocation after PHP request has completed.");
+  }
+  // The message deletes itself once the callback has been invoked.
+  PhpInvokeMsg *msg = new PhpInvokeMsg(
+      p->channel_, new Nan::Callback(info[3].As<v8::Function>()), false,
+      p->id_, info[1].As<v8::String>(), info[2].As<v8::Array>());
+  p->channel_->SendToPhp(msg, MessageFlags::ASYNC);
+}
 void PhpObject::ArrayAccessOp(PhpObjectMapper *m, PropertyOp op,
                         const ZVal &arr, const ZVal &name, const ZVal &value,
                         Value *retval, Value *exception TSRMLS_DC) {
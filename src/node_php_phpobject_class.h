@@ -30,6 +30,13 @@ class PhpObject : public Nan::ObjectWrap {
   // set the id field to 0 to indicate an invalid reference to a closed
   // PHP context.
   static void MaybeNeuter(MapperChannel *channel, v8::Local<v8::Object> obj);
+  // If the given object is an instance of PhpObject from this channel,
+  // return its id; otherwise return 0.
+  static objid_t IdFor(MapperChannel *channel, v8::Local<v8::Object> obj);
+  // `invokeAsync(obj, method, args, callback)`: invoke a method of a
+  // PHP object without blocking JS; `callback` is invoked node-style
+  // with the result once PHP gets around to it.
+  static NAN_METHOD(InvokeAsync);
 
  private:
   explicit PhpObject(MapperChannel *channel, objid_t id)
@@ -0,0 +1,120 @@
+// OutputBuffer collects a request's output on the PHP side and sends
+// it to the JS stream in large chunks.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/outputbuffer.h"
+
+#include <string>
+#include <utility>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+}
+
+#include "src/macros.h"
+#include "src/messages.h"
+#include "src/phprequestworker.h"
+
+namespace node_php_embed {
+
+// Invokes `stream.write(buffer, callback)`, responding to PHP once the
+// callback has been invoked (that is, once the stream has accepted the
+// data).
+class OutputBuffer::JsWriteMsg : public MessageToJs {
+ public:
+  JsWriteMsg(MapperChannel *channel, OutputBuffer *buffer,
+             std::string *data, bool is_sync)
+      : MessageToJs(channel, nullptr, is_sync), buffer_(buffer),
+        worker_(buffer->worker_), data_(), size_(data->size()) {
+    data_.swap(*data);
+  }
+  void ExecutePhp(JsMessageChannel *channel TSRMLS_DC) override {
+    if (!IsSync()) {
+      buffer_->in_flight_ -= size_;
+    }
+    // This deletes `this` for fire-and-forget messages.
+    MessageToJs::ExecutePhp(channel TSRMLS_CC);
+  }
+
+ protected:
+  bool IsEmptyRetvalOk() override { return true; }
+  void InJs(JsObjectMapper *m) override {
+    Nan::MaybeLocal<v8::Object> stream =
+      Nan::To<v8::Object>(worker_->GetStream().ToJs(m));
+    if (stream.IsEmpty()) {
+      return Nan::ThrowTypeError("stream is not an object");
+    }
+    v8::Local<v8::Value> write =
+      Nan::Get(stream.ToLocalChecked(), NEW_STR("write"))
+      .FromMaybe<v8::Value>(Nan::Undefined());
+    if (!write->IsFunction()) {
+      return Nan::ThrowTypeError("stream.write is not a function");
+    }
+    v8::Local<v8::Value> argv[] = {
+      Nan::CopyBuffer(data_.data(), data_.size()).ToLocalChecked(),
+      MakeCallback()
+    };
+    // The data has been copied; don't hold on to it any longer.
+    std::string().swap(data_);
+    Nan::CallAsFunction(write.As<v8::Function>(), stream.ToLocalChecked(),
+                        2, argv);
+  }
+
+ private:
+  OutputBuffer *buffer_;  // Only touched from the PHP thread.
+  PhpRequestWorker *worker_;
+  std::string data_;
+  size_t size_;
+};
+
+void OutputBuffer::Write(MapperChannel *channel, const char *data,
+                         size_t len TSRMLS_DC) {
+  if (compressor_.IsActive()) {
+    compressor_.Compress(data, len, Z_NO_FLUSH, &pending_);
+  } else {
+    pending_.append(data, len);
+  }
+  if (pending_.size() >= ChunkSize().load()) {
+    size_t hwm = has_high_water_mark_ ? high_water_mark_ :
+      HighWaterMark().load();
+    Send(channel, in_flight_ + pending_.size() > hwm TSRMLS_CC);
+  }
+}
+
+void OutputBuffer::Flush(MapperChannel *channel, bool wait TSRMLS_DC) {
+  // Make everything written so far decodable by the client.
+  compressor_.Compress(nullptr, 0, Z_SYNC_FLUSH, &pending_);
+  if (wait) {
+    // Even if nothing is buffered, this waits for earlier chunks,
+    // since the stream acknowledges writes in order.
+    Send(channel, true TSRMLS_CC);
+  } else if (!pending_.empty()) {
+    Send(channel, false TSRMLS_CC);
+  }
+}
+
+void OutputBuffer::Finish(MapperChannel *channel TSRMLS_DC) {
+  compressor_.Compress(nullptr, 0, Z_FINISH, &pending_);
+  Send(channel, true TSRMLS_CC);
+}
+
+void OutputBuffer::Send(MapperChannel *channel, bool sync TSRMLS_DC) {
+  TRACEX("> %lu bytes%s", pending_.size(), sync ? " (sync)" : "");
+  if (sync) {
+    JsWriteMsg msg(channel, this, &pending_, true);
+    channel->SendToJs(&msg, MessageFlags::SYNC TSRMLS_CC);
+    // If JS is itself blocked waiting on PHP, it can't wait for the
+    // stream's callback, and MessageToJs raises a TypeError("deadlock")
+    // instead.  That's harmless here (the data was still written), so
+    // ignore it.
+  } else {
+    in_flight_ += pending_.size();
+    channel->SendToJs(new JsWriteMsg(channel, this, &pending_, false),
+                      MessageFlags::ASYNC TSRMLS_CC);
+  }
+  TRACE("<");
+}
+
+}  // namespace node_php_embed
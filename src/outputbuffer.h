@@ -0,0 +1,97 @@
+// OutputBuffer collects a request's output on the PHP side and sends
+// it to the JS stream in large chunks.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_OUTPUTBUFFER_H_
+#define NODE_PHP_EMBED_OUTPUTBUFFER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+extern "C" {
+#include "main/php.h"
+#include "main/SAPI.h"
+}
+
+#include "src/outputcompressor.h"
+
+namespace node_php_embed {
+
+class MapperChannel;
+class PhpRequestWorker;
+
+/* Rather than making a synchronous call to `stream.write` for every
+ * chunk PHP emits, output is accumulated here until there is a
+ * reasonably large chunk of it, which is then sent to JS as a
+ * fire-and-forget message.  JS acknowledges each chunk once the stream
+ * has accepted it; if too many bytes are awaiting acknowledgement, the
+ * next chunk is sent synchronously, which blocks PHP until the stream
+ * has caught up.  `Flush` (used for PHP's `flush()` and at the end of
+ * the request) sends whatever is buffered and waits for all of it to
+ * be written.
+ *
+ * If compression has been configured (and is switched on when the
+ * headers are sent), output is compressed here, on the PHP thread,
+ * and only compressed bytes cross over to JS.
+ *
+ * All methods except the static configuration methods must be called
+ * from the PHP thread.
+ */
+class OutputBuffer {
+ public:
+  explicit OutputBuffer(PhpRequestWorker *worker)
+      : worker_(worker), pending_(), in_flight_(0), high_water_mark_(0),
+        has_high_water_mark_(false), compressor_() { }
+  // Bytes to accumulate before sending them to JS; 0 sends every write
+  // immediately.
+  static void SetChunkSize(size_t bytes) { ChunkSize().store(bytes); }
+  // Bytes which may be awaiting acknowledgement from JS before PHP
+  // blocks.
+  static void SetHighWaterMark(size_t bytes) { HighWaterMark().store(bytes); }
+
+  // Override the process-wide high-water mark for this request only.
+  // Must be called before the request starts.
+  void SetRequestHighWaterMark(size_t bytes) {
+    high_water_mark_ = bytes;
+    has_high_water_mark_ = true;
+  }
+
+  OutputCompressor *GetCompressor() { return &compressor_; }
+
+  // Called just before the response headers are sent.
+  void StartCompression(sapi_headers_struct *sapi_headers TSRMLS_DC) {
+    compressor_.Start(sapi_headers TSRMLS_CC);
+  }
+  void Write(MapperChannel *channel, const char *data, size_t len
+             TSRMLS_DC);
+  // Send any buffered output to JS; if `wait` is true, don't return
+  // until the stream has accepted everything written so far.
+  void Flush(MapperChannel *channel, bool wait TSRMLS_DC);
+  // Like `Flush(channel, true)`, but also ends the compressed stream.
+  // Called at the end of the request.
+  void Finish(MapperChannel *channel TSRMLS_DC);
+
+ private:
+  class JsWriteMsg;
+  void Send(MapperChannel *channel, bool sync TSRMLS_DC);
+  static std::atomic<size_t> &ChunkSize() {
+    static std::atomic<size_t> chunk_size(64 * 1024);
+    return chunk_size;
+  }
+  static std::atomic<size_t> &HighWaterMark() {
+    static std::atomic<size_t> high_water_mark(1024 * 1024);
+    return high_water_mark;
+  }
+
+  PhpRequestWorker *worker_;
+  std::string pending_;
+  size_t in_flight_;  // Bytes sent but not yet acknowledged.
+  size_t high_water_mark_;
+  bool has_high_water_mark_;
+  OutputCompressor compressor_;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_OUTPUTBUFFER_H_
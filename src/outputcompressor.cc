@@ -0,0 +1,122 @@
+// OutputCompressor gzips or deflates a request's output on the PHP
+// thread.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/outputcompressor.h"
+
+#include <strings.h>  // for strncasecmp()
+#include <zlib.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include "main/php.h"
+#include "main/SAPI.h"
+}
+
+#include "src/macros.h"
+
+namespace node_php_embed {
+
+namespace {
+
+// Returns the value of `header` if its name is `name`, else nullptr.
+const char *HeaderValue(sapi_header_struct *header, const char *name) {
+  size_t len = strlen(name);
+  if (header->header_len <= len || header->header[len] != ':' ||
+      strncasecmp(header->header, name, len) != 0) {
+    return nullptr;
+  }
+  const char *value = header->header + len + 1;
+  while (*value == ' ' || *value == '\t') { value++; }
+  return value;
+}
+
+int IsContentLength(void *data, void *unused) {
+  return HeaderValue(static_cast<sapi_header_struct*>(data),
+                     "Content-Length") != nullptr;
+}
+
+void AddHeader(sapi_headers_struct *sapi_headers, const char *header) {
+  sapi_header_struct h;
+  h.header_len = strlen(header);
+  h.header = estrndup(header, h.header_len);
+  // The list's destructor frees `h.header`.
+  zend_llist_add_element(&sapi_headers->headers, &h);
+}
+
+}  // namespace
+
+void OutputCompressor::Start(sapi_headers_struct *sapi_headers TSRMLS_DC) {
+  if (encoding_ == Encoding::NONE || active_) { return; }
+  int code = sapi_headers->http_response_code;
+  if (code < 200 || code == 204 || code == 304) { return; }
+  bool has_length = false;
+  zend_llist_position pos;
+  for (sapi_header_struct *h = static_cast<sapi_header_struct*>(
+           zend_llist_get_first_ex(&sapi_headers->headers, &pos));
+       h; h = static_cast<sapi_header_struct*>(
+           zend_llist_get_next_ex(&sapi_headers->headers, &pos))) {
+    if (HeaderValue(h, "Content-Encoding")) {
+      // PHP (or the script) has already encoded the output.
+      return;
+    }
+    const char *length = HeaderValue(h, "Content-Length");
+    if (length) {
+      if (strtoull(length, nullptr, 10) < min_size_) { return; }
+      has_length = true;
+    }
+  }
+  // The default memLevel, with a gzip header (+16) if required.
+  int window_bits = 15 + (encoding_ == Encoding::GZIP ? 16 : 0);
+  memset(&zs_, 0, sizeof(zs_));
+  if (deflateInit2(&zs_, level_, Z_DEFLATED, window_bits, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    NPE_ERROR("! can't initialize zlib, not compressing");
+    return;
+  }
+  active_ = true;
+  dirty_ = false;
+  // The length is about to change.
+  if (has_length) {
+    zend_llist_del_element(&sapi_headers->headers, nullptr,
+                           IsContentLength);
+  }
+  AddHeader(sapi_headers, encoding_ == Encoding::GZIP ?
+            "Content-Encoding: gzip" : "Content-Encoding: deflate");
+  AddHeader(sapi_headers, "Vary: Accept-Encoding");
+}
+
+void OutputCompressor::Compress(const char *data, size_t len, int flush,
+                                std::string *out) {
+  if (!active_) { return; }
+  if (flush == Z_NO_FLUSH) {
+    if (len == 0) { return; }
+    dirty_ = true;
+  } else if (flush == Z_SYNC_FLUSH && !dirty_ && len == 0) {
+    return;  // Nothing new to flush.
+  }
+  zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  zs_.avail_in = static_cast<uInt>(len);
+  char buf[16 * 1024];
+  int status;
+  do {
+    zs_.next_out = reinterpret_cast<Bytef*>(buf);
+    zs_.avail_out = sizeof(buf);
+    status = deflate(&zs_, flush);
+    out->append(buf, sizeof(buf) - zs_.avail_out);
+  } while (zs_.avail_out == 0 || (flush == Z_FINISH && status == Z_OK));
+  if (flush != Z_NO_FLUSH) { dirty_ = false; }
+  if (flush == Z_FINISH) { End(); }
+}
+
+void OutputCompressor::End() {
+  if (active_) {
+    deflateEnd(&zs_);
+    active_ = false;
+  }
+}
+
+}  // namespace node_php_embed
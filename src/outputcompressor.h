@@ -0,0 +1,66 @@
+// OutputCompressor gzips or deflates a request's output on the PHP
+// thread.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_OUTPUTCOMPRESSOR_H_
+#define NODE_PHP_EMBED_OUTPUTCOMPRESSOR_H_
+
+#include <zlib.h>
+
+#include <cstddef>
+#include <string>
+
+extern "C" {
+#include "main/php.h"
+#include "main/SAPI.h"
+}
+
+namespace node_php_embed {
+
+/* A thin wrapper around a zlib stream.  JS negotiates the encoding
+ * (from the request's `Accept-Encoding`) and configures it before the
+ * request starts; compression is then switched on (or not) when PHP
+ * sends the response headers, so that the `Content-Encoding` header
+ * can be added.  Everything but `Configure` runs on the PHP thread.
+ */
+class OutputCompressor {
+ public:
+  enum class Encoding { NONE, GZIP, DEFLATE };
+
+  OutputCompressor() : encoding_(Encoding::NONE), level_(-1),
+                       min_size_(0), active_(false), dirty_(false) { }
+  ~OutputCompressor() { End(); }
+
+  // `level` is a zlib compression level (-1 for zlib's default).
+  // Responses whose `Content-Length` is below `min_size` are left
+  // alone.
+  void Configure(Encoding encoding, int level, size_t min_size) {
+    encoding_ = encoding;
+    level_ = level;
+    min_size_ = min_size;
+  }
+  // Decide whether to compress this response, given the headers PHP
+  // is about to send; if so, adjust the headers to match and start
+  // compressing.
+  void Start(sapi_headers_struct *sapi_headers TSRMLS_DC);
+  inline bool IsActive() { return active_; }
+  // Compress `len` bytes of `data`, appending the output to `out`.
+  // `flush` is a zlib flush mode: Z_NO_FLUSH, Z_SYNC_FLUSH (to make
+  // everything so far decodable), or Z_FINISH (which also ends
+  // compression).
+  void Compress(const char *data, size_t len, int flush, std::string *out);
+
+ private:
+  void End();
+
+  Encoding encoding_;
+  int level_;
+  size_t min_size_;
+  bool active_;
+  bool dirty_;  // Data has been compressed since the last flush.
+  z_stream zs_;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_OUTPUTCOMPRESSOR_H_
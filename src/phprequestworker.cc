@@ -4,39 +4,81 @@
 // Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
 #include "src/phprequestworker.h"
 
+#include <atomic>
+#include <string>
+#include <vector>
+
 #include "nan.h"
 
 extern "C" {
 #include "main/php.h"
 #include "main/php_main.h"
 #include "main/SAPI.h"
+#include "main/php_variables.h"
 #include "Zend/zend_exceptions.h"
 #include "Zend/zend_interfaces.h"
 #include "ext/standard/head.h"
 #include "ext/standard/info.h"
-#include "ext/standard/php_string.h"
 }
 
 #include "src/asyncmessageworker.h"
 #include "src/macros.h"
+#include "src/messages.h"
 #include "src/node_php_embed.h"  // for NODE_PHP_EMBED_G
+#include "src/servicecontext.h"
+#include "src/sourcecache.h"
 
 namespace node_php_embed {
 
+static std::atomic<uint64_t> warm_startups(0), cold_startups(0);
+
+// Sent from PHP once a service context's startup source has run, to
+// hand the ServiceContext handle to JS.
+class PhpRequestWorker::JsServiceOpenMsg : public MessageToJs {
+ public:
+  JsServiceOpenMsg(MapperChannel *channel, PhpRequestWorker *worker)
+      : MessageToJs(channel, nullptr, false), channel_(channel),
+        worker_(worker) { }
+
+ protected:
+  void InJs(JsObjectMapper *m) override {
+    worker_->service_->Attach(channel_);
+    Nan::Callback on_open(
+      worker_->GetFromPersistent("onOpen").As<v8::Function>());
+    v8::Local<v8::Value> argv[] = { worker_->GetServiceHandle() };
+    on_open.Call(1, argv);
+    retval_.SetNull();
+  }
+
+ private:
+  MapperChannel *channel_;
+  PhpRequestWorker *worker_;
+};
+
 PhpRequestWorker::PhpRequestWorker(Nan::Callback *callback,
                                    v8::Local<v8::String> source,
                                    v8::Local<v8::Object> stream,
                                    v8::Local<v8::Array> args,
                                    v8::Local<v8::Object> server_vars,
-                                   v8::Local<v8::Value> init_func,
+                                   v8::Local<v8::Object> options,
                                    const char *startup_file)
-    : AsyncMessageWorker(callback), result_(), stream_(), init_func_(),
+    : AsyncMessageWorker(callback), result_(), stream_(),
+      output_(this), post_body_(this),
       argc_(args->Length()), argv_(new char*[args->Length()]),
-      server_vars_(), startup_file_(startup_file) {
+      server_vars_(), server_names_(), other_values_(),
+      startup_file_(startup_file), use_source_cache_(true),
+      is_service_(false), service_(nullptr), memory_usage_(0) {
   JsStartupMapper mapper(this);
   source_.Set(&mapper, source);
   stream_.Set(&mapper, stream);
-  init_func_.Set(&mapper, init_func);
+  // Give JS a sink to push the request body into as it arrives.
+  v8::Local<v8::Value> set_sink = GET_PROPERTY(stream, "setPostSink");
+  if (set_sink->IsFunction()) {
+    v8::Local<v8::Object> sink = post_body_.CreateSink();
+    SaveToPersistent("postSink", sink);
+    v8::Local<v8::Value> argv[] = { sink };
+    Nan::CallAsFunction(set_sink.As<v8::Function>(), stream, 1, argv);
+  }
   // Turn the JS array into a char** suitable for PHP.
   for (uint32_t i = 0; i < argc_; i++) {
     Nan::Utf8String s(
@@ -44,17 +86,68 @@ PhpRequestWorker::PhpRequestWorker(Nan::Callback *callback,
       .FromMaybe(static_cast< v8::Local<v8::Value> >(Nan::EmptyString())));
     argv_[i] = strdup(*s ? *s : "");
   }
-  // Turn the server_vars object into a c++ string->string map.
+  // Turn the server_vars object into a c++ string->string map, plus
+  // a list of the (rarer) variables with non-string values, so that
+  // $_SERVER can be populated without calling back into JS.
   v8::Local<v8::Array> names =  Nan::GetPropertyNames(server_vars)
     .FromMaybe(Nan::New<v8::Array>(0));
+  std::vector<v8::Local<v8::Value>> other_values;
   for (uint32_t i = 0; i < names->Length(); i++) {
     v8::Local<v8::Value> key = Nan::Get(names, i).ToLocalChecked();
     v8::Local<v8::Value> value = Nan::Get(server_vars, key)
       .FromMaybe(static_cast<v8::Local<v8::Value> >(Nan::Undefined()));
-    if (!value->IsString()) { continue; }
-    Nan::Utf8String k(key), v(value);
-    if (!(*k && *v)) { continue; }
-    server_vars_.emplace(*k, *v);
+    Nan::Utf8String k(key);
+    if (!*k) { continue; }
+    if (value->IsString()) {
+      Nan::Utf8String v(value);
+      if (!*v) { continue; }
+      server_vars_.emplace(*k, std::string(*v, v.length()));
+    } else {
+      other_values.push_back(value);
+    }
+    server_names_.emplace_back(*k);
+  }
+  other_values_.SetArrayByValue(
+      other_values.size(), [&mapper, &other_values](uint32_t i, Value& v) {
+        v.Set(&mapper, other_values[i]);
+      });
+  // Per-request options.
+  v8::Local<v8::Value> source_cache = GET_PROPERTY(options, "sourceCache");
+  if (!source_cache->IsUndefined()) {
+    use_source_cache_ = Nan::To<bool>(source_cache).FromMaybe(true);
+  }
+  v8::Local<v8::Value> hwm = GET_PROPERTY(options, "outputHighWaterMark");
+  if (hwm->IsNumber()) {
+    output_.SetRequestHighWaterMark(static_cast<size_t>(
+        Nan::To<uint32_t>(hwm).FromMaybe(0)));
+  }
+  v8::Local<v8::Value> compress = GET_PROPERTY(options, "compress");
+  if (compress->IsObject()) {
+    v8::Local<v8::Object> c = compress.As<v8::Object>();
+    Nan::Utf8String encoding(GET_PROPERTY(c, "encoding"));
+    OutputCompressor::Encoding e = OutputCompressor::Encoding::NONE;
+    if (*encoding && strcmp(*encoding, "gzip") == 0) {
+      e = OutputCompressor::Encoding::GZIP;
+    } else if (*encoding && strcmp(*encoding, "deflate") == 0) {
+      e = OutputCompressor::Encoding::DEFLATE;
+    }
+    v8::Local<v8::Value> level = GET_PROPERTY(c, "level");
+    v8::Local<v8::Value> min_size = GET_PROPERTY(c, "minSize");
+    output_.GetCompressor()->Configure(
+        e, level->IsNumber() ? Nan::To<int32_t>(level).FromJust() : -1,
+        min_size->IsNumber() ? Nan::To<uint32_t>(min_size).FromJust() : 0);
+  }
+  v8::Local<v8::Value> uploads = GET_PROPERTY(options, "uploads");
+  if (uploads->IsObject()) {
+    uploads_.Set(uploads.As<v8::Object>());
+  }
+  v8::Local<v8::Value> on_open = GET_PROPERTY(options, "onOpen");
+  if (on_open->IsFunction()) {
+    v8::Local<v8::Object> handle = ServiceContext::Create(this);
+    SaveToPersistent("service", handle);
+    SaveToPersistent("onOpen", on_open);
+    service_ = Nan::ObjectWrap::Unwrap<ServiceContext>(handle);
+    is_service_ = true;
   }
 }
 
@@ -70,6 +163,15 @@ PhpRequestWorker::~PhpRequestWorker() {
 // should go on `this`.
 void PhpRequestWorker::Execute(MapperChannel *channel TSRMLS_DC) {
   TRACE("> PhpRequestWorker");
+  // Use this thread's prewarmed request context, if it has one and
+  // it is suitable for this request.
+  bool warm = NODE_PHP_EMBED_G(prewarmed);
+  NODE_PHP_EMBED_G(prewarmed) = false;
+  if (warm && !CanUsePrewarmed()) {
+    php_request_shutdown(nullptr);
+    warm = false;
+  }
+  (warm ? warm_startups : cold_startups)++;
   // Certain fields in request_info need to be set up before
   // php_request_startup is invoked.
   SG(request_info).argc = argc_;
@@ -98,10 +200,16 @@ void PhpRequestWorker::Execute(MapperChannel *channel TSRMLS_DC) {
   SET_REQUEST_INFO("PATH_TRANSLATED", path_translated);
   SET_REQUEST_INFO("REQUEST_URI", request_uri);
   SET_REQUEST_INFO("HTTP_COOKIE", cookie_data);
-  SET_REQUEST_INFO("HTTP_CONTENT_TYPE", content_type);
-  SG(request_info).content_length =
-    server_vars_.count("HTTP_CONTENT_LENGTH") ?
-    atol(server_vars_["HTTP_CONTENT_LENGTH"].c_str()) : 0;
+  if (uploads_.IsSet()) {
+    // The body has already been parsed; don't let PHP try to read it.
+    SG(request_info).content_type = nullptr;
+    SG(request_info).content_length = 0;
+  } else {
+    SET_REQUEST_INFO("HTTP_CONTENT_TYPE", content_type);
+    SG(request_info).content_length =
+      server_vars_.count("HTTP_CONTENT_LENGTH") ?
+      atol(server_vars_["HTTP_CONTENT_LENGTH"].c_str()) : 0;
+  }
   // Unlike the other settings, proto_num needs to be set *after* we
   // activate the new request.  Go figure.
   int proto_num = 1000;
@@ -111,7 +219,6 @@ void PhpRequestWorker::Execute(MapperChannel *channel TSRMLS_DC) {
       proto_num = 1000 + (sline[7] - '0');
     }
   }
-  server_vars_.clear();  // We don't need to keep these around any more.
   // SG(server_context) needs to be non-zero.  Believe it or not,
   // this is what the php-cgi binary does:
   SG(server_context) = reinterpret_cast<void*>(1);  // Sigh.
@@ -120,36 +227,36 @@ void PhpRequestWorker::Execute(MapperChannel *channel TSRMLS_DC) {
   NODE_PHP_EMBED_G(worker) = this;
   NODE_PHP_EMBED_G(channel) = channel;
   // Ok, *now* we can startup the request.
-  if (php_request_startup(TSRMLS_C) == FAILURE) {
+  if (warm) {
+    ActivatePrewarmed(TSRMLS_C);
+  } else if (php_request_startup(TSRMLS_C) == FAILURE) {
     Nan::ThrowError("can't create request");
     return;
   }
   SG(request_info).proto_num = proto_num;
+  if (uploads_.IsSet()) {
+    uploads_.Register(TSRMLS_C);
+  }
   {
     ZVal source{ZEND_FILE_LINE_C}, result{ZEND_FILE_LINE_C};
     zend_first_try {
       // First execute startup code.
       if (startup_file_) {
-          int nlen = 0;
-          char *f = php_addslashes(const_cast<char*>(startup_file_),
-                                   strlen(startup_file_),
-                                   &nlen, 0 TSRMLS_CC);
-          char *buf = new char[11 + nlen];
-          char startup_msg[] = { "startup" };
-          nlen = snprintf(buf, 11 + nlen, "require '%s'", f);
-          zend_eval_stringl_ex(buf, nlen, *result, startup_msg, false
-                               TSRMLS_CC);
-          result.SetNull();
-          delete[] buf;
-          efree(f);
+        SourceCache::ExecuteFile(startup_file_, *result TSRMLS_CC);
+        result.SetNull();
       }
       // Now execute the user's source.
       char eval_msg[] = { "request" };  // This shows up in error messages.
       source_.ToPhp(channel, source TSRMLS_CC);
       assert(Z_TYPE_P(*source) == IS_STRING);
       CHECK_ZVAL_STRING(*source);
-      zend_eval_stringl_ex(Z_STRVAL_P(*source), Z_STRLEN_P(*source), *result,
-                           eval_msg, false TSRMLS_CC);
+      if (use_source_cache_) {
+        SourceCache::EvalStringl(Z_STRVAL_P(*source), Z_STRLEN_P(*source),
+                                 *result, eval_msg TSRMLS_CC);
+      } else {
+        zend_eval_stringl_ex(Z_STRVAL_P(*source), Z_STRLEN_P(*source),
+                             *result, eval_msg, false TSRMLS_CC);
+      }
       if (EG(exception)) {
         // Can't call zend_clear_exception because there isn't a current
         // execution stack (ie, `EG(current_execute_data)`)
@@ -161,6 +268,13 @@ void PhpRequestWorker::Execute(MapperChannel *channel TSRMLS_DC) {
       }
       result_.Set(channel, *result TSRMLS_CC);
       result_.TakeOwnership();  // Since this will outlive scope of `result`.
+      if (is_service_ && !ErrorMessage()) {
+        // Stay open until JS closes us.
+        KeepAlive(true);
+        UpdateMemoryUsage(TSRMLS_C);
+        channel->SendToJs(new JsServiceOpenMsg(channel, this),
+                          MessageFlags::ASYNC TSRMLS_CC);
+      }
     } zend_catch {
       SetErrorMessage("<bailout>");
     } zend_end_try();
@@ -172,17 +286,48 @@ void PhpRequestWorker::Execute(MapperChannel *channel TSRMLS_DC) {
   TRACE("< PhpRequestWorker");
 }
 
+void PhpRequestWorker::RegisterServerVariables(zval *track_vars_array
+                                               TSRMLS_DC) {
+  MapperChannel *channel = NODE_PHP_EMBED_G(channel);
+  uint32_t other = 0;
+  // Both of these end in php_register_variable_ex, as JS-side
+  // `$_SERVER` setup used to, so names are mangled the same way they
+  // always have been: `.` and ` ` become `_`, and `[` starts an array
+  // key.
+  for (auto const &name : server_names_) {
+    char *var = const_cast<char*>(name.c_str());
+    auto it = server_vars_.find(name);
+    if (it != server_vars_.end()) {
+      php_register_variable_safe(var, const_cast<char*>(it->second.data()),
+                                 it->second.size(), track_vars_array
+                                 TSRMLS_CC);
+    } else {
+      ZVal value{ZEND_FILE_LINE_C};
+      other_values_[other++].ToPhp(channel, value TSRMLS_CC);
+      php_register_variable_ex(var, value.Transfer(TSRMLS_C),
+                               track_vars_array TSRMLS_CC);
+    }
+  }
+}
+
 void PhpRequestWorker::AfterAsyncLoop(TSRMLS_D) {
   TRACE("> PhpRequestWorker");
   // Flush the buffers, send the headers.
   // (If we wait until AfterExecute, the queues are already shut down.)
   php_header(TSRMLS_C);
   php_output_flush_all(TSRMLS_C);
+  // Wait for all of the output to be written, so that no write
+  // acknowledgements are still pending when the queues shut down.
+  output_.Finish(NODE_PHP_EMBED_G(channel) TSRMLS_CC);
   TRACE("< PhpRequestWorker");
 }
 
 void PhpRequestWorker::AfterExecute(TSRMLS_D) {
   TRACE("> PhpRequestWorker");
+  // We don't need to keep these around any more.
+  server_vars_.clear();
+  server_names_.clear();
+  other_values_.SetEmpty();
   NODE_PHP_EMBED_G(worker) = nullptr;
   NODE_PHP_EMBED_G(channel) = nullptr;
   TRACE("- request shutdown");
@@ -206,6 +351,83 @@ void PhpRequestWorker::CheckRequestInfo(TSRMLS_D) {
   CHECK_REQUEST_INFO(content_type);
 }
 
+bool PhpRequestWorker::Prewarm() {
+  TSRMLS_FETCH();
+  if (NODE_PHP_EMBED_G(prewarmed)) { return true; }
+  TRACE("> PhpRequestWorker");
+  // Start a request with empty request_info and no worker; the SAPI
+  // hooks which need the worker do nothing without one.
+  CheckRequestInfo(TSRMLS_C);
+  SG(request_info).argc = 0;
+  SG(request_info).argv = nullptr;
+  SG(request_info).content_length = 0;
+  SG(server_context) = reinterpret_cast<void*>(1);
+  NODE_PHP_EMBED_G(prewarmed) =
+    (php_request_startup(TSRMLS_C) == SUCCESS);
+  TRACE("< PhpRequestWorker");
+  return NODE_PHP_EMBED_G(prewarmed);
+}
+
+void PhpRequestWorker::DiscardPrewarmed() {
+  TSRMLS_FETCH();
+  if (!NODE_PHP_EMBED_G(prewarmed)) { return; }
+  NODE_PHP_EMBED_G(prewarmed) = false;
+  php_request_shutdown(nullptr);
+}
+
+void PhpRequestWorker::GetStartupStats(uint64_t *warm, uint64_t *cold) {
+  *warm = warm_startups;
+  *cold = cold_startups;
+}
+
+// A prewarmed context can't read a POST body, since sapi_activate()
+// only does that during startup; everything else is redone by
+// ActivatePrewarmed.
+bool PhpRequestWorker::CanUsePrewarmed() {
+  // A spooled body doesn't need to be read during request startup.
+  if (uploads_.IsSet()) { return true; }
+  auto method = server_vars_.find("REQUEST_METHOD");
+  return !(method != server_vars_.end() && method->second == "POST" &&
+           server_vars_.count("HTTP_CONTENT_TYPE"));
+}
+
+// Redo the parts of php_request_startup() which depend on the request,
+// now that SG(request_info) and the worker have been set up.
+void PhpRequestWorker::ActivatePrewarmed(TSRMLS_D) {
+  TRACE("> PhpRequestWorker");
+  SG(request_info).headers_only = SG(request_info).request_method &&
+    strcmp(SG(request_info).request_method, "HEAD") == 0;
+  // REQUEST_TIME should be when the request arrived, not when we
+  // warmed up.
+  SG(global_request_time) = 0;
+  if (PG(max_input_time) == -1) {
+    zend_set_timeout(EG(timeout_seconds), 1);
+  } else {
+    zend_set_timeout(PG(max_input_time), 1);
+  }
+  // Rebuild $_GET, $_COOKIE, $_SERVER, $argv, etc.
+  for (int i = 0; i < NUM_TRACK_VARS; i++) {
+    if (PG(http_globals)[i]) {
+      zval_ptr_dtor(&PG(http_globals)[i]);
+    }
+  }
+  php_hash_environment(TSRMLS_C);
+  TRACE("< PhpRequestWorker");
+}
+
+void PhpRequestWorker::BeforeJsShutdown() {
+  post_body_.Detach();
+  if (service_) {
+    service_->Detach();
+    service_ = nullptr;
+  }
+}
+
+v8::Local<v8::Value> PhpRequestWorker::GetServiceHandle() {
+  if (!is_service_) { return Nan::Undefined(); }
+  return GetFromPersistent("service");
+}
+
 // Executed when the async work is complete.
 // This function will be run inside the main event loop
 // so it is safe to use V8 again.
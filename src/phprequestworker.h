@@ -5,8 +5,10 @@
 #ifndef NODE_PHP_EMBED_PHPREQUESTWORKER_H_
 #define NODE_PHP_EMBED_PHPREQUESTWORKER_H_
 
+#include <atomic>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "nan.h"
 
@@ -15,20 +17,27 @@ extern "C" {
 }
 
 #include "src/asyncmessageworker.h"
+#include "src/outputbuffer.h"
+#include "src/postbody.h"
+#include "src/spooleduploads.h"
 #include "src/values.h"
 
 namespace node_php_embed {
 
+class ServiceContext;
+
 class PhpRequestWorker : public AsyncMessageWorker {
  public:
   PhpRequestWorker(Nan::Callback *callback, v8::Local<v8::String> source,
                    v8::Local<v8::Object> stream, v8::Local<v8::Array> args,
                    v8::Local<v8::Object> server_vars,
-                   v8::Local<v8::Value> init_func,
+                   v8::Local<v8::Object> options,
                    const char *startup_file);
   virtual ~PhpRequestWorker();
   const inline Value &GetStream() { return stream_; }
-  const inline Value &GetInitFunc() { return init_func_; }
+  // PHP thread only.
+  inline OutputBuffer *GetOutputBuffer() { return &output_; }
+  inline PostBody *GetPostBody() { return &post_body_; }
 
   // Executed inside the PHP thread.  It is not safe to access V8 or
   // V8 data structures here, so everything we need for input and output
@@ -39,19 +48,58 @@ class PhpRequestWorker : public AsyncMessageWorker {
 
   // Executed in the JS thread.
   void HandleOKCallback(JsObjectMapper *m) override;
+  void BeforeJsShutdown() override;
+  // The ServiceContext handle, if this is a service context (otherwise
+  // undefined).
+  v8::Local<v8::Value> GetServiceHandle();
+
+  // Used by service context messages, in the PHP thread.
+  void StopService(TSRMLS_D) { KeepAlive(false); }
+  void UpdateMemoryUsage(TSRMLS_D) {
+    memory_usage_ = zend_memory_usage(0 TSRMLS_CC);
+  }
+  bool UseSourceCache() { return use_source_cache_; }
+  // Callable from either thread.
+  size_t GetMemoryUsage() { return memory_usage_; }
+
+  // Populates $_SERVER from the server vars given to the constructor.
+  // PHP thread only.
+  void RegisterServerVariables(zval *track_vars_array TSRMLS_DC);
 
   // Used during module startup to check SG(request_info)
   static void CheckRequestInfo(TSRMLS_D);
 
+  // Called from idle PHP threads to start up a request context ahead
+  // of time (returning false if that failed), or to throw it away.
+  static bool Prewarm();
+  static void DiscardPrewarmed();
+  // Number of requests which did and didn't find a prewarmed context.
+  static void GetStartupStats(uint64_t *warm, uint64_t *cold);
+
  private:
+  bool CanUsePrewarmed();
+  static void ActivatePrewarmed(TSRMLS_D);
+
   Value source_;
   Value result_;
   Value stream_;
-  Value init_func_;
+  OutputBuffer output_;
+  PostBody post_body_;
+  SpooledUploads uploads_;
   uint32_t argc_;
   char **argv_;
   std::unordered_map<std::string, std::string> server_vars_;
+  // The names of all the server vars, in order; those which aren't
+  // in server_vars_ (because they aren't strings) are in other_values_.
+  std::vector<std::string> server_names_;
+  Value other_values_;
   const char *startup_file_;
+  bool use_source_cache_;
+  // Service contexts keep the request open until closed.
+  bool is_service_;
+  ServiceContext *service_;  // JS thread only.
+  std::atomic<size_t> memory_usage_;
+  class JsServiceOpenMsg;
 };
 
 }  // namespace node_php_embed
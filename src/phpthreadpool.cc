@@ -0,0 +1,223 @@
+// PhpThreadPool is a dedicated pool of threads for running PHP requests.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/phpthreadpool.h"
+
+#include <unistd.h>  // for sysconf()
+
+#include <list>
+#include <vector>
+
+#include "nan.h"
+
+extern "C" {
+#include "TSRM/TSRM.h"
+}
+
+#include "src/macros.h"
+#include "src/phprequestworker.h"
+
+namespace node_php_embed {
+
+PhpThreadPool::PhpThreadPool()
+    : pending_(), completed_(), threads_(), retired_(), target_threads_(1),
+      live_threads_(0), queue_limit_(-1), shutdown_(false), prewarm_(false),
+      outstanding_(0) {
+#ifdef ZTS
+  // By default, allow one PHP request per core.
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);  // NOLINT(runtime/int)
+  if (ncpu > 1) { target_threads_ = static_cast<unsigned>(ncpu); }
+#endif
+  uv_mutex_init(&lock_);
+  uv_cond_init(&cond_);
+  uv_async_init(uv_default_loop(), &complete_async_, Complete_);
+  complete_async_.data = this;
+  // Don't keep node alive until there's some work outstanding.
+  uv_unref(reinterpret_cast<uv_handle_t*>(&complete_async_));
+}
+
+PhpThreadPool *PhpThreadPool::Get() {
+  // Created on first use and never destroyed; its threads are joined
+  // at module shutdown.
+  static PhpThreadPool *pool = new PhpThreadPool();
+  return pool;
+}
+
+void PhpThreadPool::Configure(unsigned threads, int queue_limit) {
+  PhpThreadPool *pool = Get();
+#ifndef ZTS
+  // Without thread-safe resource management, only one thread may
+  // ever run PHP.
+  threads = 1;
+#endif
+  uv_mutex_lock(&pool->lock_);
+  pool->target_threads_ = (threads > 0) ? threads : 1;
+  pool->queue_limit_ = queue_limit;
+  // Surplus idle threads will notice and exit.
+  uv_cond_broadcast(&pool->cond_);
+  uv_mutex_unlock(&pool->lock_);
+  // Threads are only started once there's work to do (and PHP has
+  // been initialized), so only grow the pool if it's already running.
+  if (!pool->threads_.empty()) { pool->StartThreads(); }
+}
+
+void PhpThreadPool::SetPrewarm(bool enable) {
+  PhpThreadPool *pool = Get();
+  uv_mutex_lock(&pool->lock_);
+  pool->prewarm_ = enable;
+  // Idle threads will warm up, or cool down.
+  uv_cond_broadcast(&pool->cond_);
+  uv_mutex_unlock(&pool->lock_);
+}
+
+bool PhpThreadPool::CanQueue() {
+  PhpThreadPool *pool = Get();
+  bool ok;
+  uv_mutex_lock(&pool->lock_);
+  // Requests which will be picked up by an idle thread straight away
+  // don't count against the limit.
+  unsigned busy = pool->outstanding_ - pool->completed_.size() -
+    pool->pending_.size();
+  unsigned idle = (pool->target_threads_ > busy) ?
+    (pool->target_threads_ - busy) : 0;
+  ok = (pool->queue_limit_ < 0) ||
+    (pool->pending_.size() < idle + static_cast<unsigned>(pool->queue_limit_));
+  uv_mutex_unlock(&pool->lock_);
+  return ok;
+}
+
+void PhpThreadPool::Queue(Nan::AsyncWorker *worker) {
+  TRACE(">");
+  PhpThreadPool *pool = Get();
+  pool->StartThreads();
+  if (pool->outstanding_++ == 0) {
+    uv_ref(reinterpret_cast<uv_handle_t*>(&pool->complete_async_));
+  }
+  uv_mutex_lock(&pool->lock_);
+  pool->pending_.push_back(worker);
+  uv_cond_signal(&pool->cond_);
+  uv_mutex_unlock(&pool->lock_);
+  TRACE("<");
+}
+
+void PhpThreadPool::Shutdown() {
+  TRACE(">");
+  PhpThreadPool *pool = Get();
+  uv_mutex_lock(&pool->lock_);
+  pool->shutdown_ = true;
+  uv_cond_broadcast(&pool->cond_);
+  uv_mutex_unlock(&pool->lock_);
+  for (auto &thread : pool->threads_) {
+    uv_thread_join(&thread);
+  }
+  pool->threads_.clear();
+  pool->retired_.clear();  // These were all in `threads_` too.
+  TRACE("<");
+}
+
+void PhpThreadPool::StartThreads() {
+  ReapThreads();
+  uv_mutex_lock(&lock_);
+  while (live_threads_ < target_threads_ && !shutdown_) {
+    uv_thread_t thread;
+    if (uv_thread_create(&thread, ThreadMain_, this) != 0) {
+      NPE_ERROR("Can't create PHP thread");
+      break;
+    }
+    threads_.push_back(thread);
+    live_threads_++;
+  }
+  uv_mutex_unlock(&lock_);
+}
+
+void PhpThreadPool::ThreadMain_(void *arg) {
+  TRACE(">");
+  PhpThreadPool *pool = static_cast<PhpThreadPool*>(arg);
+#ifdef ZTS
+  // Set up this thread's PHP context once, up front.
+  ts_resource(0);
+#endif
+  // Whether we've tried to prewarm a request context since the last
+  // request.
+  bool tried = false;
+  uv_mutex_lock(&pool->lock_);
+  while (!pool->shutdown_ && pool->live_threads_ <= pool->target_threads_) {
+    if (pool->pending_.empty()) {
+      if (pool->prewarm_ != tried) {
+        // Do this outside the lock, so we don't hold up other threads.
+        uv_mutex_unlock(&pool->lock_);
+        if (tried) {
+          PhpRequestWorker::DiscardPrewarmed();
+          tried = false;
+        } else {
+          PhpRequestWorker::Prewarm();
+          tried = true;
+        }
+        uv_mutex_lock(&pool->lock_);
+        continue;
+      }
+      uv_cond_wait(&pool->cond_, &pool->lock_);
+      continue;
+    }
+    Nan::AsyncWorker *worker = pool->pending_.front();
+    pool->pending_.pop_front();
+    uv_mutex_unlock(&pool->lock_);
+    // This uses up the prewarmed context, if any.
+    worker->Execute();
+    tried = false;
+    uv_mutex_lock(&pool->lock_);
+    pool->completed_.push_back(worker);
+    uv_async_send(&pool->complete_async_);
+  }
+  pool->live_threads_--;
+  uv_mutex_unlock(&pool->lock_);
+  if (tried) { PhpRequestWorker::DiscardPrewarmed(); }
+#ifdef ZTS
+  ts_free_thread();
+#endif
+  // Unless `Shutdown` is joining us, we were surplus: have the JS
+  // thread join us, so the pool doesn't accumulate exited threads as
+  // it shrinks and grows.
+  uv_mutex_lock(&pool->lock_);
+  if (!pool->shutdown_) {
+    pool->retired_.push_back(uv_thread_self());
+    uv_async_send(&pool->complete_async_);
+  }
+  uv_mutex_unlock(&pool->lock_);
+  TRACE("<");
+}
+
+void PhpThreadPool::ReapThreads() {
+  std::vector<uv_thread_t> retired;
+  uv_mutex_lock(&lock_);
+  retired.swap(retired_);
+  uv_mutex_unlock(&lock_);
+  for (auto &thread : retired) {
+    // It has nothing left to do but return.
+    uv_thread_join(&thread);
+    for (auto it = threads_.begin(); it != threads_.end(); ++it) {
+      if (uv_thread_equal(&*it, &thread)) {
+        threads_.erase(it);
+        break;
+      }
+    }
+  }
+}
+
+NAUV_WORK_CB(PhpThreadPool::Complete_) {
+  PhpThreadPool *pool = static_cast<PhpThreadPool*>(async->data);
+  std::list<Nan::AsyncWorker *> done;
+  uv_mutex_lock(&pool->lock_);
+  done.swap(pool->completed_);
+  uv_mutex_unlock(&pool->lock_);
+  pool->ReapThreads();
+  for (Nan::AsyncWorker *worker : done) {
+    worker->WorkComplete();
+    worker->Destroy();
+    if (--pool->outstanding_ == 0) {
+      uv_unref(reinterpret_cast<uv_handle_t*>(&pool->complete_async_));
+    }
+  }
+}
+
+}  // namespace node_php_embed
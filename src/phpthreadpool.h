@@ -0,0 +1,79 @@
+// PhpThreadPool is a dedicated pool of threads for running PHP requests.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_PHPTHREADPOOL_H_
+#define NODE_PHP_EMBED_PHPTHREADPOOL_H_
+
+#include <list>
+#include <vector>
+
+#include "nan.h"
+
+namespace node_php_embed {
+
+/* PHP requests can run for a long time, and spend much of that time
+ * blocked waiting for JavaScript (for example, in `Js\Wait`).  If they
+ * ran on the libuv threadpool they would starve `fs`, `dns`, `zlib`
+ * and friends, so we run them on our own threads instead.  Each thread
+ * sets up its TSRM context once, when it starts, and keeps it for
+ * every request it runs.  Requests which arrive when all threads are
+ * busy wait in a bounded admission queue.
+ *
+ * Workers are Nan::AsyncWorkers, and are driven exactly as
+ * Nan::AsyncQueueWorker would: Execute() runs in a pool thread, and
+ * then WorkComplete() and Destroy() run in the JS thread.
+ *
+ * All methods must be called from the JS thread.
+ */
+class PhpThreadPool {
+ public:
+  // Set the number of threads and the maximum number of requests
+  // which may wait for a thread (negative means no limit).  Raising
+  // the thread count takes effect immediately; lowering it takes
+  // effect as threads finish their current requests.
+  static void Configure(unsigned threads, int queue_limit);
+  // Enable or disable prewarming of request contexts by idle threads.
+  static void SetPrewarm(bool enable);
+  // Returns false if the admission queue is full.  Otherwise the
+  // worker must be submitted with `Queue` before returning to the
+  // event loop.
+  static bool CanQueue();
+  static void Queue(Nan::AsyncWorker *worker);
+  // Stop all threads, waiting for them to finish; call before shutting
+  // down PHP.
+  static void Shutdown();
+
+ private:
+  PhpThreadPool();
+  void StartThreads();
+  // Join threads which have retired since the last call, and forget
+  // them.  JS thread only.
+  void ReapThreads();
+  static PhpThreadPool *Get();
+  static void ThreadMain_(void *arg);
+  static NAUV_WORK_CB(Complete_);
+
+  uv_mutex_t lock_;
+  uv_cond_t cond_;
+  // Work waiting for a thread, and work waiting for the JS thread to
+  // run its completion callbacks; both protected by `lock_`.
+  std::list<Nan::AsyncWorker *> pending_;
+  std::list<Nan::AsyncWorker *> completed_;
+  std::vector<uv_thread_t> threads_;  // Live threads.  JS thread only.
+  // Threads which have exited (or are about to), waiting to be joined.
+  std::vector<uv_thread_t> retired_;  // protected by `lock_`
+  unsigned target_threads_;  // protected by `lock_`
+  unsigned live_threads_;  // protected by `lock_`
+  int queue_limit_;  // protected by `lock_`
+  bool shutdown_;  // protected by `lock_`
+  bool prewarm_;  // protected by `lock_`
+  // Wakes the JS thread to run completions.  Referenced only while
+  // there is outstanding work, so that idle PHP threads don't keep
+  // node alive.  JS thread only.
+  uv_async_t complete_async_;
+  unsigned outstanding_;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_PHPTHREADPOOL_H_
@@ -0,0 +1,270 @@
+// PostBody buffers a request's body on its way from JS to PHP.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/postbody.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+}
+
+#include "src/macros.h"
+#include "src/messages.h"
+#include "src/phprequestworker.h"
+
+namespace node_php_embed {
+
+// Blocks PHP until there is data in the queue (or the body has ended).
+class PostBody::JsWaitMsg : public MessageToJs {
+ public:
+  JsWaitMsg(MapperChannel *channel, PostBody *body)
+      : MessageToJs(channel, nullptr, true), body_(body) { }
+
+ protected:
+  bool IsEmptyRetvalOk() override { return true; }
+  void InJs(JsObjectMapper *m) override {
+    body_->Release();
+    uv_mutex_lock(&body_->lock_);
+    bool ready = (body_->size_ > 0) || body_->ended_;
+    uv_mutex_unlock(&body_->lock_);
+    if (ready) {
+      retval_.SetNull();
+    } else {
+      // Push and End happen in this thread, so there's no race here.
+      body_->waiter_.Reset(MakeCallback());
+    }
+  }
+
+ private:
+  PostBody *body_;
+};
+
+// Tells the JS side it can resume pushing data.
+class PostBody::JsDrainMsg : public MessageToJs {
+ public:
+  JsDrainMsg(MapperChannel *channel, PhpRequestWorker *worker)
+      : MessageToJs(channel, nullptr, false), worker_(worker) { }
+
+ protected:
+  bool IsEmptyRetvalOk() override { return true; }
+  void InJs(JsObjectMapper *m) override {
+    worker_->GetPostBody()->Release();
+    v8::Local<v8::Value> stream = worker_->GetStream().ToJs(m);
+    if (!stream->IsObject()) { return; }
+    v8::Local<v8::Value> resume =
+      Nan::Get(stream.As<v8::Object>(), NEW_STR("resumePost"))
+      .FromMaybe<v8::Value>(Nan::Undefined());
+    if (resume->IsFunction()) {
+      Nan::CallAsFunction(resume.As<v8::Function>(), stream.As<v8::Object>(),
+                          0, nullptr);
+    }
+  }
+
+ private:
+  PhpRequestWorker *worker_;
+};
+
+PostBody::PostBody(PhpRequestWorker *worker)
+    : worker_(worker), chunks_(), consumed_(), offset_(0), size_(0),
+      ended_(false), paused_(false), error_(), sink_(nullptr), waiter_() {
+  uv_mutex_init(&lock_);
+}
+
+PostBody::~PostBody() {
+  Detach();
+  uv_mutex_destroy(&lock_);
+}
+
+v8::Local<v8::Object> PostBody::CreateSink() {
+  Nan::EscapableHandleScope scope;
+  v8::Local<v8::Object> handle = PostSink::Create(this);
+  sink_ = Nan::ObjectWrap::Unwrap<PostSink>(handle);
+  return scope.Escape(handle);
+}
+
+bool PostBody::Push(v8::Local<v8::Object> buffer) {
+  size_t len = node::Buffer::Length(buffer);
+  Release();
+  uv_mutex_lock(&lock_);
+  if (len > 0 && !ended_) {
+    chunks_.push_back(Chunk{ new BufferRef(buffer),
+                             node::Buffer::Data(buffer), len });
+    size_ += len;
+  }
+  bool more = size_ < kHighWaterMark;
+  if (!more) { paused_ = true; }
+  uv_mutex_unlock(&lock_);
+  Wake();
+  return more;
+}
+
+void PostBody::End() {
+  uv_mutex_lock(&lock_);
+  ended_ = true;
+  uv_mutex_unlock(&lock_);
+  Wake();
+}
+
+void PostBody::Error(const std::string &message) {
+  uv_mutex_lock(&lock_);
+  if (!ended_) {
+    ended_ = true;
+    error_ = message;
+  }
+  uv_mutex_unlock(&lock_);
+  Wake();
+}
+
+void PostBody::Detach() {
+  if (sink_) {
+    sink_->Detach();
+    sink_ = nullptr;
+  }
+  waiter_.Reset();
+  // PHP won't read anything more.
+  uv_mutex_lock(&lock_);
+  for (auto const &chunk : chunks_) { consumed_.push_back(chunk.buffer); }
+  chunks_.clear();
+  offset_ = size_ = 0;
+  ended_ = true;
+  uv_mutex_unlock(&lock_);
+  Release();
+}
+
+void PostBody::Release() {
+  std::vector<BufferRef*> done;
+  uv_mutex_lock(&lock_);
+  done.swap(consumed_);
+  uv_mutex_unlock(&lock_);
+  for (BufferRef *buffer : done) {
+    buffer->Reset();
+    delete buffer;
+  }
+}
+
+void PostBody::Wake() {
+  if (waiter_.IsEmpty()) { return; }
+  Nan::HandleScope scope;
+  v8::Local<v8::Function> cb = Nan::New(waiter_);
+  waiter_.Reset();
+  Nan::CallAsFunction(cb, Nan::GetCurrentContext()->Global(), 0, nullptr);
+}
+
+size_t PostBody::Read(MapperChannel *channel, char *buffer, size_t count
+                      TSRMLS_DC) {
+  TRACE(">");
+  size_t done = 0;
+  std::string error;
+  while (true) {
+    uv_mutex_lock(&lock_);
+    while (done < count && !chunks_.empty()) {
+      const Chunk &front = chunks_.front();
+      size_t amt = std::min(count - done, front.len - offset_);
+      // The Buffer's contents don't move, and JS keeps it alive until
+      // we hand it back, so this is safe without touching V8.
+      memcpy(buffer + done, front.data + offset_, amt);
+      done += amt;
+      offset_ += amt;
+      size_ -= amt;
+      if (offset_ == front.len) {
+        consumed_.push_back(front.buffer);
+        chunks_.pop_front();
+        offset_ = 0;
+      }
+    }
+    bool ended = ended_;
+    if (ended && chunks_.empty() && !error_.empty()) {
+      // Only warn once.
+      error.swap(error_);
+    }
+    bool resume = paused_ && size_ <= kHighWaterMark / 2;
+    if (resume) { paused_ = false; }
+    uv_mutex_unlock(&lock_);
+    if (resume) {
+      channel->SendToJs(new JsDrainMsg(channel, worker_),
+                        MessageFlags::ASYNC TSRMLS_CC);
+    }
+    // PHP treats a short read as the end of the body.
+    if (done == count || ended) { break; }
+    JsWaitMsg msg(channel, this);
+    channel->SendToJs(&msg, MessageFlags::SYNC TSRMLS_CC);
+    if (msg.HasException()) {
+      // Most likely a "deadlock": JS is blocked waiting on PHP, so it
+      // can't deliver any more data.
+      NPE_ERROR("- exception caught (ignoring)");
+      break;
+    }
+  }
+  if (!error.empty()) {
+    php_error_docref(nullptr TSRMLS_CC, E_WARNING,
+                     "Request body truncated: %s", error.c_str());
+  }
+  TRACEX("< (read %lu)", done);
+  return done;
+}
+
+NAN_MODULE_INIT(PostSink::Init) {
+  v8::Local<v8::String> class_name = NEW_STR("PostSink");
+  v8::Local<v8::FunctionTemplate> tpl =
+    Nan::New<v8::FunctionTemplate>(PostSink::New);
+  tpl->SetClassName(class_name);
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  Nan::SetPrototypeMethod(tpl, "push", PostSink::Push);
+  Nan::SetPrototypeMethod(tpl, "end", PostSink::End);
+  Nan::SetPrototypeMethod(tpl, "error", PostSink::Error);
+  cons_template().Reset(tpl);
+  // Instances are only created by PostBody, so we don't export the
+  // constructor.
+}
+
+v8::Local<v8::Object> PostSink::Create(PostBody *body) {
+  Nan::EscapableHandleScope scope;
+  PostSink *obj = new PostSink(body);
+  v8::Local<v8::Value> argv[] = { Nan::New<v8::External>(obj) };
+  v8::Local<v8::Function> cons =
+    Nan::GetFunction(Nan::New(cons_template())).ToLocalChecked();
+  return scope.Escape(cons->NewInstance(1, argv));
+}
+
+NAN_METHOD(PostSink::New) {
+  if (!info.IsConstructCall()) {
+    return Nan::ThrowTypeError("You must use `new` with this constructor.");
+  }
+  if (!info[0]->IsExternal()) {
+    return Nan::ThrowTypeError("This constructor is for internal use only.");
+  }
+  // This object was made by PostSink::Create()
+  PostSink *obj = reinterpret_cast<PostSink*>
+    (v8::Local<v8::External>::Cast(info[0])->Value());
+  obj->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(PostSink::Push) {
+  PostSink *sink = Unwrap<PostSink>(info.Holder());
+  if (!(info.Length() > 0 && node::Buffer::HasInstance(info[0]))) {
+    return Nan::ThrowTypeError("buffer expected");
+  }
+  // Once the request is over, any further data is simply discarded.
+  bool more = !sink->body_ ||
+    sink->body_->Push(info[0].As<v8::Object>());
+  info.GetReturnValue().Set(more);
+}
+
+NAN_METHOD(PostSink::End) {
+  PostSink *sink = Unwrap<PostSink>(info.Holder());
+  if (sink->body_) { sink->body_->End(); }
+}
+
+NAN_METHOD(PostSink::Error) {
+  PostSink *sink = Unwrap<PostSink>(info.Holder());
+  REQUIRE_ARGUMENT_STRING(0, message);
+  if (sink->body_) { sink->body_->Error(*message); }
+}
+
+}  // namespace node_php_embed
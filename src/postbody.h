@@ -0,0 +1,115 @@
+// PostBody buffers a request's body on its way from JS to PHP.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_POSTBODY_H_
+#define NODE_PHP_EMBED_POSTBODY_H_
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+}
+
+namespace node_php_embed {
+
+class MapperChannel;
+class PhpRequestWorker;
+class PostSink;
+
+/* Rather than having PHP ask JS for each block of the request body
+ * (and wait for the answer), JS pushes the body into this queue as
+ * it arrives, through a `PostSink` handle.  PHP only has to wait for
+ * JS when the queue is empty.  The queue is bounded: once it holds
+ * `kHighWaterMark` bytes, `Push` returns false and JS should pause the
+ * input stream until PHP has caught up (signalled by a call to the
+ * stream's `resumePost` method).
+ *
+ * The queue holds on to the pushed Buffers themselves, so PHP copies
+ * each byte only once, straight into its own buffer.  JS must not
+ * modify a Buffer after pushing it.
+ */
+class PostBody {
+ public:
+  static const size_t kHighWaterMark = 1024 * 1024;
+
+  explicit PostBody(PhpRequestWorker *worker);
+  ~PostBody();
+
+  // Called from the JS thread.
+  // Returns a new sink handle for JS to push data to.
+  v8::Local<v8::Object> CreateSink();
+  // Returns false if JS should stop pushing for now.
+  bool Push(v8::Local<v8::Object> buffer);
+  void End();
+  // Ends the body early; PHP is warned that it has been truncated.
+  void Error(const std::string &message);
+  // Called when the PHP request is shutting down.
+  void Detach();
+
+  // Called from the PHP thread.  Blocks until `count` bytes have been
+  // read or the body has ended; returns the number of bytes read.
+  size_t Read(MapperChannel *channel, char *buffer, size_t count TSRMLS_DC);
+
+ private:
+  class JsWaitMsg;
+  class JsDrainMsg;
+  typedef Nan::Persistent<v8::Object> BufferRef;
+  struct Chunk {
+    BufferRef *buffer;
+    const char *data;
+    size_t len;
+  };
+  // Call the callback waiting for data, if there is one.  JS thread only.
+  void Wake();
+  // Let go of the Buffers which PHP has finished with.  JS thread only.
+  void Release();
+
+  PhpRequestWorker *worker_;
+  uv_mutex_t lock_;
+  // Protected by lock_.
+  std::deque<Chunk> chunks_;
+  std::vector<BufferRef*> consumed_;  // Read by PHP, not yet released.
+  size_t offset_;  // Bytes already read from chunks_.front().
+  size_t size_;  // Unread bytes in chunks_.
+  bool ended_;
+  bool paused_;  // Push has returned false, and we haven't resumed JS.
+  std::string error_;  // Why the body ended early, if it did.
+  // JS thread only.
+  PostSink *sink_;
+  Nan::Persistent<v8::Function> waiter_;
+};
+
+// The JS handle used to push data into a PostBody.
+class PostSink : public Nan::ObjectWrap {
+ public:
+  // Register this class with Node.
+  static NAN_MODULE_INIT(Init);
+  static v8::Local<v8::Object> Create(PostBody *body);
+  void Detach() { body_ = nullptr; }
+
+ private:
+  explicit PostSink(PostBody *body) : body_(body) { }
+  ~PostSink() override { }
+
+  static NAN_METHOD(New);
+  static NAN_METHOD(Push);
+  static NAN_METHOD(End);
+  static NAN_METHOD(Error);
+
+  // Stash away the constructor's template for later use.
+  static inline Nan::Persistent<v8::FunctionTemplate> & cons_template() {
+    static Nan::Persistent<v8::FunctionTemplate> my_template;
+    return my_template;
+  }
+
+  PostBody *body_;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_POSTBODY_H_
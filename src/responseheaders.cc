@@ -0,0 +1,151 @@
+// ResponseHeaders delivers a request's response headers to JS.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/responseheaders.h"
+
+#include <strings.h>  // for strncasecmp()
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+#include "main/SAPI.h"
+}
+
+#include "src/macros.h"
+#include "src/messages.h"
+#include "src/phprequestworker.h"
+
+namespace node_php_embed {
+
+namespace {
+
+// Header names are case-insensitive.
+bool SameName(const std::string &a, const std::string &b) {
+  return a.size() == b.size() &&
+    strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// Technically headers are ISO-8859-1 encoded, with a strong
+// recommendation to only use ASCII.
+// See RFC 2616, https://tools.ietf.org/html/rfc7230#section-3.2.4
+v8::Local<v8::String> Latin1(const std::string &s) {
+  return Nan::NewOneByteString(reinterpret_cast<const uint8_t*>(s.data()),
+                               s.size()).ToLocalChecked();
+}
+
+}  // namespace
+
+// Invokes `stream.sendHeaders(statusCode, statusMessage, headers)`.
+class ResponseHeaders::JsSendHeadersMsg : public MessageToJs {
+ public:
+  JsSendHeadersMsg(MapperChannel *channel, PhpRequestWorker *worker,
+                   sapi_headers_struct *sapi_headers)
+      : MessageToJs(channel, nullptr, true), worker_(worker),
+        status_code_(sapi_headers->http_response_code), status_message_(),
+        headers_() {
+    // Requests run with `args` look like CLI requests, and don't get a
+    // default status code; node would reject a 0 and drop the headers.
+    if (status_code_ == 0) { status_code_ = 200; }
+    // The status line looks like "HTTP/1.1 404 Not Found"; PHP has
+    // already parsed out the code, but we want the message as well.
+    if (sapi_headers->http_status_line) {
+      const char *s = strchr(sapi_headers->http_status_line, ' ');
+      if (s) { s = strchr(s + 1, ' '); }
+      if (s) { status_message_.assign(s + 1); }
+    }
+    zend_llist_position pos;
+    for (sapi_header_struct *h = static_cast<sapi_header_struct*>(
+             zend_llist_get_first_ex(&sapi_headers->headers, &pos));
+         h; h = static_cast<sapi_header_struct*>(
+             zend_llist_get_next_ex(&sapi_headers->headers, &pos))) {
+      Add(h->header, h->header_len);
+    }
+  }
+
+ protected:
+  bool IsEmptyRetvalOk() override { return true; }
+  void InJs(JsObjectMapper *m) override {
+    Nan::MaybeLocal<v8::Object> stream =
+      Nan::To<v8::Object>(worker_->GetStream().ToJs(m));
+    if (stream.IsEmpty()) {
+      return Nan::ThrowTypeError("stream is not an object");
+    }
+    v8::Local<v8::Value> send =
+      Nan::Get(stream.ToLocalChecked(), NEW_STR("sendHeaders"))
+      .FromMaybe<v8::Value>(Nan::Undefined());
+    if (!send->IsFunction()) {
+      return Nan::ThrowTypeError("stream.sendHeaders is not a function");
+    }
+    v8::Local<v8::Object> headers = Nan::New<v8::Object>();
+    for (auto const &h : headers_) {
+      v8::Local<v8::Value> value;
+      if (h.second.size() == 1) {
+        value = Latin1(h.second[0]);
+      } else {
+        // Some headers may be emitted more than once; node.js wants
+        // an array of values in that case.
+        v8::Local<v8::Array> values = Nan::New<v8::Array>(h.second.size());
+        for (uint32_t i = 0; i < h.second.size(); i++) {
+          Nan::Set(values, i, Latin1(h.second[i]));
+        }
+        value = values;
+      }
+      Nan::Set(headers, Latin1(h.first), value);
+    }
+    v8::Local<v8::Value> argv[] = {
+      Nan::New(status_code_),
+      status_message_.empty() ? v8::Local<v8::Value>(Nan::Undefined()) :
+        v8::Local<v8::Value>(Latin1(status_message_)),
+      headers
+    };
+    Nan::CallAsFunction(send.As<v8::Function>(), stream.ToLocalChecked(),
+                        3, argv);
+  }
+
+ private:
+  // Split "Name: value" and add it to `headers_`.
+  void Add(const char *header, size_t len) {
+    const char *colon = static_cast<const char*>(memchr(header, ':', len));
+    if (!colon || colon == header ||
+        memchr(header, ' ', colon - header) != nullptr) {
+      NPE_ERRORX("! unexpected header, skipping: %.*s",
+                 static_cast<int>(len), header);
+      return;
+    }
+    std::string name(header, colon - header);
+    const char *value = colon + 1, *end = header + len;
+    while (value < end && (*value == ' ' || *value == '\t')) { value++; }
+    for (auto &h : headers_) {
+      if (SameName(h.first, name)) {
+        h.second.emplace_back(value, end - value);
+        return;
+      }
+    }
+    headers_.emplace_back(std::move(name), std::vector<std::string>());
+    headers_.back().second.emplace_back(value, end - value);
+  }
+
+  PhpRequestWorker *worker_;
+  int status_code_;
+  std::string status_message_;
+  // Header names (in the order first seen) and their values.
+  std::vector<std::pair<std::string, std::vector<std::string>>> headers_;
+};
+
+void ResponseHeaders::Send(PhpRequestWorker *worker, MapperChannel *channel,
+                           sapi_headers_struct *sapi_headers TSRMLS_DC) {
+  TRACE(">");
+  JsSendHeadersMsg msg(channel, worker, sapi_headers);
+  channel->SendToJs(&msg, MessageFlags::SYNC TSRMLS_CC);
+  if (msg.HasException()) {
+    NPE_ERROR("- exception caught (ignoring)");
+  }
+  TRACE("<");
+}
+
+}  // namespace node_php_embed
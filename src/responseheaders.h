@@ -0,0 +1,35 @@
+// ResponseHeaders delivers a request's response headers to JS.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_RESPONSEHEADERS_H_
+#define NODE_PHP_EMBED_RESPONSEHEADERS_H_
+
+extern "C" {
+#include "main/php.h"
+#include "main/SAPI.h"
+}
+
+namespace node_php_embed {
+
+class MapperChannel;
+class PhpRequestWorker;
+
+/* PHP collects the response headers in `SG(sapi_headers)` until the
+ * first output is sent.  Rather than making one call to JS for each
+ * header, we parse the whole list (and the status line) on the PHP
+ * side and send it across in a single message, in the form that
+ * node's `response.writeHead` expects.
+ */
+class ResponseHeaders {
+ public:
+  // Blocks until JS has handled the headers.  PHP thread only.
+  static void Send(PhpRequestWorker *worker, MapperChannel *channel,
+                   sapi_headers_struct *sapi_headers TSRMLS_DC);
+
+ private:
+  class JsSendHeadersMsg;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_RESPONSEHEADERS_H_
@@ -0,0 +1,224 @@
+// A long-lived PHP request, which JavaScript can use to run code in
+// the same request context many times.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/servicecontext.h"
+
+#include <cassert>
+#include <vector>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+#include "Zend/zend.h"
+#include "Zend/zend_exceptions.h"
+}
+
+#include "src/macros.h"
+#include "src/messages.h"
+#include "src/phprequestworker.h"
+#include "src/sourcecache.h"
+#include "src/values.h"
+
+namespace node_php_embed {
+
+class ServiceContext::PhpServiceMsg : public MessageToPhp {
+ public:
+  enum class Op { EVAL, CALL, CLOSE };
+  PhpServiceMsg(MapperChannel *m, Nan::Callback *callback,
+                PhpRequestWorker *worker, Op op,
+                v8::Local<v8::Value> code, v8::Local<v8::Array> args)
+      : MessageToPhp(m, callback, false), channel_(m), worker_(worker),
+        op_(op), code_(), argc_(0), argv_() {
+    if (op != Op::CLOSE) {
+      code_.Set(m, code);
+    }
+    if (!args.IsEmpty()) {
+      argc_ = args->Length();
+      argv_.SetArrayByValue(argc_, [m, args](uint32_t idx, Value& v) {
+        v.Set(m, Nan::Get(args, idx).ToLocalChecked());
+      });
+    }
+  }
+
+ protected:
+  void InPhp(PhpObjectMapper *m TSRMLS_DC) override {
+    ZVal retval{ZEND_FILE_LINE_C};
+    zend_try {
+      switch (op_) {
+      case Op::EVAL: {
+        ZVal code{ZEND_FILE_LINE_C};
+        code_.ToPhp(m, code TSRMLS_CC);
+        assert(code.IsString());
+        char eval_msg[] = { "context" };  // This shows up in error messages.
+        if (worker_->UseSourceCache()) {
+          SourceCache::EvalStringl(Z_STRVAL_P(*code), Z_STRLEN_P(*code),
+                                   *retval, eval_msg TSRMLS_CC);
+        } else {
+          zend_eval_stringl_ex(Z_STRVAL_P(*code), Z_STRLEN_P(*code),
+                               *retval, eval_msg, false TSRMLS_CC);
+        }
+        break;
+      }
+      case Op::CALL: {
+        ZVal name{ZEND_FILE_LINE_C};
+        code_.ToPhp(m, name TSRMLS_CC);
+        std::vector<ZVal> args;
+        args.reserve(argc_);
+        std::vector<zval*> nargs(argc_);
+        for (uint32_t i = 0; i < argc_; i++) {
+          args.emplace_back(ZEND_FILE_LINE_C);
+          argv_[i].ToPhp(m, args[i] TSRMLS_CC);
+          nargs[i] = args[i].Ptr();
+        }
+        if (call_user_function(EG(function_table), nullptr, name.Ptr(),
+                               retval.Ptr(), argc_, nargs.data()
+                               TSRMLS_CC) == FAILURE && !EG(exception)) {
+          exception_.SetConstantString("not callable");
+        }
+        break;
+      }
+      case Op::CLOSE:
+        worker_->StopService(TSRMLS_C);
+        break;
+      }
+    } zend_catch {
+      // The request is no longer usable.
+      exception_.SetConstantString("<bailout>");
+      worker_->StopService(TSRMLS_C);
+    } zend_end_try();
+    worker_->UpdateMemoryUsage(TSRMLS_C);
+    if (EG(exception)) {
+      // Can't call zend_clear_exception because there isn't a current
+      // execution stack (see PhpRequestWorker::Execute).
+      zval *e = EG(exception);
+      EG(exception) = nullptr;
+      exception_.Set(m, e TSRMLS_CC);
+      zval_ptr_dtor(&e);
+    } else if (exception_.IsEmpty()) {
+      retval_.Set(m, retval.Ptr() TSRMLS_CC);
+      retval_.TakeOwnership();  // This will outlive scope of `retval`
+    }
+    // Send along any output the call produced, without waiting for it.
+    php_output_flush_all(TSRMLS_C);
+    worker_->GetOutputBuffer()->Flush(channel_, false TSRMLS_CC);
+  }
+
+ private:
+  MapperChannel *channel_;
+  PhpRequestWorker *worker_;
+  Op op_;
+  Value code_;
+  uint32_t argc_;
+  Value argv_;
+};
+
+NAN_MODULE_INIT(ServiceContext::Init) {
+  v8::Local<v8::String> class_name = NEW_STR("ServiceContext");
+  v8::Local<v8::FunctionTemplate> tpl =
+    Nan::New<v8::FunctionTemplate>(ServiceContext::New);
+  tpl->SetClassName(class_name);
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  Nan::SetPrototypeMethod(tpl, "eval", ServiceContext::Eval);
+  Nan::SetPrototypeMethod(tpl, "call", ServiceContext::Call);
+  Nan::SetPrototypeMethod(tpl, "close", ServiceContext::Close);
+  Nan::SetPrototypeMethod(tpl, "memoryUsage", ServiceContext::MemoryUsage);
+  cons_template().Reset(tpl);
+  // Instances are only created by `php.openContext`, so we don't
+  // export the constructor.
+}
+
+v8::Local<v8::Object> ServiceContext::Create(PhpRequestWorker *worker) {
+  Nan::EscapableHandleScope scope;
+  ServiceContext *obj = new ServiceContext(worker);
+  v8::Local<v8::Value> argv[] = { Nan::New<v8::External>(obj) };
+  v8::Local<v8::Function> cons =
+    Nan::GetFunction(Nan::New(cons_template())).ToLocalChecked();
+  return scope.Escape(cons->NewInstance(1, argv));
+}
+
+void ServiceContext::Attach(MapperChannel *channel) {
+  channel_ = channel;
+}
+
+void ServiceContext::Detach() {
+  channel_ = nullptr;
+  worker_ = nullptr;
+}
+
+NAN_METHOD(ServiceContext::New) {
+  if (!info.IsConstructCall()) {
+    return Nan::ThrowTypeError("You must use `new` with this constructor.");
+  }
+  if (!info[0]->IsExternal()) {
+    return Nan::ThrowTypeError("This constructor is for internal use only.");
+  }
+  // This object was made by ServiceContext::Create()
+  ServiceContext *obj = reinterpret_cast<ServiceContext*>
+    (v8::Local<v8::External>::Cast(info[0])->Value());
+  obj->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+#define REQUIRE_OPEN_CONTEXT(c)                                         \
+  if (!(c)->channel_ || (c)->closing_) {                                \
+    return Nan::ThrowError("PHP context is not open");                  \
+  }
+
+NAN_METHOD(ServiceContext::Eval) {
+  TRACE(">");
+  ServiceContext *c = Unwrap<ServiceContext>(info.Holder());
+  REQUIRE_ARGUMENT_STRING_NOCONV(0);
+  if (!(info.Length() > 1 && info[1]->IsFunction())) {
+    return Nan::ThrowTypeError("callback expected");
+  }
+  REQUIRE_OPEN_CONTEXT(c);
+  PhpServiceMsg *msg = new PhpServiceMsg(
+      c->channel_, new Nan::Callback(info[1].As<v8::Function>()),
+      c->worker_, PhpServiceMsg::Op::EVAL, info[0], v8::Local<v8::Array>());
+  c->channel_->SendToPhp(msg, MessageFlags::ASYNC);
+  TRACE("<");
+}
+
+NAN_METHOD(ServiceContext::Call) {
+  TRACE(">");
+  ServiceContext *c = Unwrap<ServiceContext>(info.Holder());
+  REQUIRE_ARGUMENT_STRING_NOCONV(0);
+  if (!(info.Length() > 1 && info[1]->IsArray())) {
+    return Nan::ThrowTypeError("argument array expected");
+  }
+  if (!(info.Length() > 2 && info[2]->IsFunction())) {
+    return Nan::ThrowTypeError("callback expected");
+  }
+  REQUIRE_OPEN_CONTEXT(c);
+  PhpServiceMsg *msg = new PhpServiceMsg(
+      c->channel_, new Nan::Callback(info[2].As<v8::Function>()),
+      c->worker_, PhpServiceMsg::Op::CALL, info[0],
+      info[1].As<v8::Array>());
+  c->channel_->SendToPhp(msg, MessageFlags::ASYNC);
+  TRACE("<");
+}
+
+NAN_METHOD(ServiceContext::Close) {
+  TRACE(">");
+  ServiceContext *c = Unwrap<ServiceContext>(info.Holder());
+  REQUIRE_OPEN_CONTEXT(c);
+  // Messages are processed in order, so anything already sent will
+  // still run before the request shuts down.
+  c->closing_ = true;
+  PhpServiceMsg *msg = new PhpServiceMsg(
+      c->channel_, nullptr, c->worker_, PhpServiceMsg::Op::CLOSE,
+      v8::Local<v8::Value>(), v8::Local<v8::Array>());
+  c->channel_->SendToPhp(msg, MessageFlags::ASYNC);
+  TRACE("<");
+}
+
+NAN_METHOD(ServiceContext::MemoryUsage) {
+  ServiceContext *c = Unwrap<ServiceContext>(info.Holder());
+  double usage = c->worker_ ?
+    static_cast<double>(c->worker_->GetMemoryUsage()) : 0;
+  info.GetReturnValue().Set(Nan::New<v8::Number>(usage));
+}
+
+}  // namespace node_php_embed
@@ -0,0 +1,62 @@
+// A long-lived PHP request, which JavaScript can use to run code in
+// the same request context many times.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_SERVICECONTEXT_H_
+#define NODE_PHP_EMBED_SERVICECONTEXT_H_
+
+#include "nan.h"
+
+namespace node_php_embed {
+
+class MapperChannel;
+class PhpRequestWorker;
+
+/* A service context is a PhpRequestWorker which, after running its
+ * startup source, keeps its PHP request open (and its thread pinned)
+ * until it is explicitly closed.  This is the JavaScript handle for
+ * it: `eval` and `call` send asynchronous messages to be executed in
+ * the open request, in order.
+ *
+ * The handle can't be used until the PHP side has opened the context,
+ * and stops working when the request shuts down.
+ */
+class ServiceContext : public Nan::ObjectWrap {
+ public:
+  // Register this class with Node.
+  static NAN_MODULE_INIT(Init);
+  // Create a new handle for the given worker.
+  static v8::Local<v8::Object> Create(PhpRequestWorker *worker);
+  // Called from the JS thread once the PHP request is open.
+  void Attach(MapperChannel *channel);
+  // Called from the JS thread when the PHP request is shutting down.
+  void Detach();
+
+ private:
+  explicit ServiceContext(PhpRequestWorker *worker)
+    : worker_(worker), channel_(nullptr), closing_(false) { }
+  ~ServiceContext() override { }
+
+  static NAN_METHOD(New);
+  static NAN_METHOD(Eval);
+  static NAN_METHOD(Call);
+  static NAN_METHOD(Close);
+  static NAN_METHOD(MemoryUsage);
+
+  // Stash away the constructor's template for later use.
+  static inline Nan::Persistent<v8::FunctionTemplate> & cons_template() {
+    static Nan::Persistent<v8::FunctionTemplate> my_template;
+    return my_template;
+  }
+  // Messages
+  class PhpServiceMsg;
+
+  // Members
+  PhpRequestWorker *worker_;
+  MapperChannel *channel_;
+  bool closing_;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_SERVICECONTEXT_H_
@@ -0,0 +1,298 @@
+// SourceCache lets evaluated source strings benefit from the opcode cache.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/sourcecache.h"
+
+#include <sys/time.h>  // for utimes()
+#include <unistd.h>  // for unlink(), rmdir()
+
+#include <cstdio>
+#include <cstdlib>  // for mkdtemp()
+#include <iterator>
+#include <string>
+#include <utility>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+#include "Zend/zend_compile.h"
+#include "Zend/zend_execute.h"
+}
+
+#include "src/macros.h"
+
+namespace node_php_embed {
+
+SourceCache::SourceCache()
+    : parent_(), dir_(), dir_created_(false), capacity_(0), next_file_(0),
+      lru_(), evicted_(), free_paths_(), index_(), stats_() {
+  uv_mutex_init(&lock_);
+}
+
+SourceCache *SourceCache::Get() {
+  // Created on first use and never destroyed.
+  static SourceCache *cache = new SourceCache();
+  return cache;
+}
+
+void SourceCache::SetDirectory(const char *dir) {
+  SourceCache *c = Get();
+  uv_mutex_lock(&c->lock_);
+  if (c->parent_.empty()) {
+    c->parent_ = dir;
+  }
+  uv_mutex_unlock(&c->lock_);
+}
+
+void SourceCache::SetCapacity(size_t capacity) {
+  SourceCache *c = Get();
+  uv_mutex_lock(&c->lock_);
+  c->capacity_ = capacity;
+  while (c->index_.size() > c->capacity_) { c->Evict(); }
+  uv_mutex_unlock(&c->lock_);
+}
+
+void SourceCache::GetStats(Stats *stats) {
+  SourceCache *c = Get();
+  uv_mutex_lock(&c->lock_);
+  *stats = c->stats_;
+  stats->entries = c->index_.size();
+  stats->capacity = c->capacity_;
+  uv_mutex_unlock(&c->lock_);
+}
+
+void SourceCache::Shutdown() {
+  SourceCache *c = Get();
+  uv_mutex_lock(&c->lock_);
+  for (auto &e : c->lru_) { unlink(e.path.c_str()); }
+  for (auto &e : c->evicted_) { unlink(e.path.c_str()); }
+  c->lru_.clear();
+  c->evicted_.clear();
+  c->free_paths_.clear();
+  c->index_.clear();
+  if (c->dir_created_) { rmdir(c->dir_.c_str()); }
+  c->dir_created_ = false;
+  c->dir_.clear();
+  uv_mutex_unlock(&c->lock_);
+}
+
+SourceCache::Entry *SourceCache::Acquire(const char *source, size_t len
+                                         TSRMLS_DC) {
+  Entry *result = nullptr;
+  uv_mutex_lock(&lock_);
+  if (capacity_ == 0 || parent_.empty()) {
+    uv_mutex_unlock(&lock_);
+    return nullptr;
+  }
+  std::string key(source, len);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    stats_.hits++;
+    // Move to the front of the LRU list.
+    lru_.splice(lru_.begin(), lru_, it->second);
+    result = &(*it->second);
+  } else {
+    stats_.misses++;
+    if (!dir_created_) {
+      // PHP will execute whatever it finds in this directory, so it
+      // must not be one that another local user could have created
+      // (or could write to).  mkdtemp makes a fresh directory, with
+      // an unpredictable name, which only we can write to.
+      std::string tmpl = parent_ + "/php-embed-XXXXXX";
+      if (mkdtemp(&tmpl[0])) {
+        dir_ = tmpl;
+        dir_created_ = true;
+      }
+    }
+    if (dir_created_) {
+      // Evict first, so that the evicted path can be reused.
+      while (index_.size() >= capacity_) { Evict(); }
+      std::string path;
+      bool reused = !free_paths_.empty();
+      if (reused) {
+        path = std::move(free_paths_.back());
+        free_paths_.pop_back();
+      } else {
+        path = dir_ + "/" + std::to_string(next_file_++) + ".php";
+      }
+      if (!WriteFile(path, source, len)) {
+        free_paths_.push_back(std::move(path));
+      } else {
+        // Opcache may still have the script which used to live at
+        // this path; make sure it's forgotten before anyone can look.
+        if (reused) { InvalidateOpcache(path TSRMLS_CC); }
+        lru_.push_front(Entry { nullptr, path, 0, false });
+        auto ins = index_.emplace(std::move(key), lru_.begin());
+        lru_.front().source = &(ins.first->first);
+        result = &lru_.front();
+      }
+    }
+  }
+  if (result) { result->pins++; }
+  uv_mutex_unlock(&lock_);
+  return result;
+}
+
+void SourceCache::Release(Entry *entry) {
+  uv_mutex_lock(&lock_);
+  if (--entry->pins == 0 && entry->evicted) {
+    unlink(entry->path.c_str());
+    free_paths_.push_back(entry->path);
+    for (auto it = evicted_.begin(); it != evicted_.end(); ++it) {
+      if (&(*it) == entry) { evicted_.erase(it); break; }
+    }
+  }
+  uv_mutex_unlock(&lock_);
+}
+
+// Called with the lock held.
+void SourceCache::Evict() {
+  EntryRef victim = std::prev(lru_.end());
+  stats_.evictions++;
+  index_.erase(*(victim->source));
+  victim->source = nullptr;
+  if (victim->pins == 0) {
+    unlink(victim->path.c_str());
+    free_paths_.push_back(std::move(victim->path));
+    lru_.erase(victim);
+  } else {
+    // Another thread is still compiling from this file; leave it
+    // until that thread is done.
+    victim->evicted = true;
+    evicted_.splice(evicted_.end(), lru_, victim);
+  }
+}
+
+// Called with the lock held.
+bool SourceCache::WriteFile(const std::string &path,
+                            const char *source, size_t len) {
+  // Write to a temporary name, then rename, so that a partially-written
+  // file is never visible.
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) { return false; }
+  // Same wrapping as `zend_eval_stringl` does for an expression.
+  static const char prefix[] = "<?php return ";
+  bool ok =
+    fwrite(prefix, 1, sizeof(prefix) - 1, f) == sizeof(prefix) - 1 &&
+    fwrite(source, 1, len, f) == len &&
+    fputc(';', f) != EOF;
+  ok = (fclose(f) == 0) && ok;
+  if (ok) {
+    // Opcache won't cache a file modified within the last
+    // `opcache.file_update_protection` seconds, in case it is still
+    // being written.  We know it isn't, so backdate it.
+    struct timeval times[2];
+    gettimeofday(&times[0], nullptr);
+    times[0].tv_sec -= 60;
+    times[1] = times[0];
+    utimes(tmp.c_str(), times);
+    ok = (rename(tmp.c_str(), path.c_str()) == 0);
+  }
+  if (!ok) {
+    NPE_ERROR("Can't write source cache file");
+    unlink(tmp.c_str());
+  }
+  return ok;
+}
+
+// Called with the lock held (opcache never calls back into us).
+void SourceCache::InvalidateOpcache(const std::string &path TSRMLS_DC) {
+  static const char name[] = "opcache_invalidate";
+  if (!zend_hash_exists(EG(function_table), name, sizeof(name))) {
+    return;  // Opcache isn't loaded.
+  }
+  zval func, retval, *args[2];
+  INIT_ZVAL(func);
+  ZVAL_STRINGL(&func, const_cast<char*>(name), sizeof(name) - 1, 0);
+  INIT_ZVAL(retval);
+  MAKE_STD_ZVAL(args[0]);
+  ZVAL_STRINGL(args[0], path.c_str(), path.size(), 1);
+  MAKE_STD_ZVAL(args[1]);
+  ZVAL_BOOL(args[1], 1);  // Even if the timestamp looks unchanged.
+  if (call_user_function(EG(function_table), nullptr, &func, &retval, 2, args
+                         TSRMLS_CC) == SUCCESS) {
+    zval_dtor(&retval);
+  }
+  zval_ptr_dtor(&args[0]);
+  zval_ptr_dtor(&args[1]);
+}
+
+// Modeled on `zend_eval_stringl`, but compiles a file (so that
+// `zend_compile_file`, and thus opcache, is used).
+int SourceCache::ExecuteFile(const char *path, zval *retval_ptr TSRMLS_DC) {
+  zend_file_handle file_handle;
+  file_handle.type = ZEND_HANDLE_FILENAME;
+  file_handle.filename = path;
+  file_handle.opened_path = nullptr;
+  file_handle.free_filename = 0;
+  file_handle.handle.fp = nullptr;
+  zend_op_array *new_op_array = zend_compile_file(&file_handle, ZEND_INCLUDE
+                                                  TSRMLS_CC);
+  zend_destroy_file_handle(&file_handle TSRMLS_CC);
+  if (!new_op_array) { return FAILURE; }
+
+  zend_op_array *original_active_op_array = EG(active_op_array);
+  zval *local_retval_ptr = nullptr;
+  zval **original_return_value_ptr_ptr = EG(return_value_ptr_ptr);
+  zend_op **original_opline_ptr = EG(opline_ptr);
+  int orig_interactive = CG(interactive);
+
+  EG(return_value_ptr_ptr) = &local_retval_ptr;
+  EG(active_op_array) = new_op_array;
+  EG(no_extensions) = 1;
+  if (!EG(active_symbol_table)) {
+    zend_rebuild_symbol_table(TSRMLS_C);
+  }
+  CG(interactive) = 0;
+
+  zend_try {
+    zend_execute(new_op_array TSRMLS_CC);
+  } zend_catch {
+    destroy_op_array(new_op_array TSRMLS_CC);
+    efree(new_op_array);
+    zend_bailout();
+  } zend_end_try();
+
+  CG(interactive) = orig_interactive;
+  if (local_retval_ptr) {
+    if (retval_ptr) {
+      COPY_PZVAL_TO_ZVAL(*retval_ptr, local_retval_ptr);
+    } else {
+      zval_ptr_dtor(&local_retval_ptr);
+    }
+  } else if (retval_ptr) {
+    INIT_ZVAL(*retval_ptr);
+  }
+
+  EG(no_extensions) = 0;
+  EG(return_value_ptr_ptr) = original_return_value_ptr_ptr;
+  EG(opline_ptr) = original_opline_ptr;
+  EG(active_op_array) = original_active_op_array;
+  destroy_op_array(new_op_array TSRMLS_CC);
+  efree(new_op_array);
+  return SUCCESS;
+}
+
+int SourceCache::EvalStringl(char *str, int str_len, zval *retval_ptr,
+                             char *string_name TSRMLS_DC) {
+  SourceCache *c = Get();
+  Entry *entry = c->Acquire(str, str_len TSRMLS_CC);
+  if (!entry) {
+    // Cache disabled or unavailable; do it the slow way.
+    return zend_eval_stringl_ex(str, str_len, retval_ptr, string_name,
+                                false TSRMLS_CC);
+  }
+  int result = FAILURE;
+  zend_try {
+    result = ExecuteFile(entry->path.c_str(), retval_ptr TSRMLS_CC);
+  } zend_catch {
+    c->Release(entry);
+    zend_bailout();
+  } zend_end_try();
+  c->Release(entry);
+  return result;
+}
+
+}  // namespace node_php_embed
@@ -0,0 +1,97 @@
+// SourceCache lets evaluated source strings benefit from the opcode cache.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_SOURCECACHE_H_
+#define NODE_PHP_EMBED_SOURCECACHE_H_
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+}
+
+namespace node_php_embed {
+
+/* Opcache doesn't cache code compiled by `eval`, and compiled op_arrays
+ * can't safely be shared between ZTS threads by hand (they live in each
+ * thread's request-scoped heap).  So instead we write each distinct
+ * source string to a file named after it, and compile *that* file with
+ * `zend_compile_file`; opcache then keeps the compiled script in
+ * shared memory, where every thread can use it.
+ *
+ * The set of files is bounded, with the least recently used source
+ * evicted (and its file removed) when the cache is full.  Evicted
+ * paths are reused for new sources (after telling opcache to forget
+ * them), so opcache never holds more scripts than we have entries.
+ * The cache is shared by all PHP threads and protected by a mutex.
+ */
+class SourceCache {
+ public:
+  struct Stats {
+    uint64_t hits, misses, evictions;
+    size_t entries, capacity;
+  };
+  // Called from the JS thread during startup/configuration.  The
+  // cache's own directory is created inside `dir` when first needed.
+  static void SetDirectory(const char *dir);
+  // Maximum number of cached sources; 0 (the default) disables the
+  // cache.
+  static void SetCapacity(size_t capacity);
+  static void GetStats(Stats *stats);
+  // Remove the cache directory; called at module shutdown.
+  static void Shutdown();
+
+  // A drop-in replacement for `zend_eval_stringl_ex` (with
+  // `handle_exceptions` false) which evaluates `str` as an expression.
+  // Called from PHP threads.
+  static int EvalStringl(char *str, int str_len, zval *retval_ptr,
+                         char *string_name TSRMLS_DC);
+  // Compile (using the opcode cache, if present) and execute the given
+  // file in the current scope, like `include`.
+  static int ExecuteFile(const char *path, zval *retval_ptr TSRMLS_DC);
+
+ private:
+  struct Entry {
+    const std::string *source;  // Points at our key in `index_`.
+    std::string path;
+    unsigned pins;  // Number of threads currently compiling this file.
+    bool evicted;
+  };
+  typedef std::list<Entry>::iterator EntryRef;
+
+  SourceCache();
+  static SourceCache *Get();
+  // Returns the cache entry for `source`, creating it if necessary, or
+  // nullptr if it can't be cached.  The entry is pinned until it is
+  // passed to `Release`.
+  Entry *Acquire(const char *source, size_t len TSRMLS_DC);
+  void Release(Entry *entry);
+  void Evict();
+  bool WriteFile(const std::string &path, const char *source, size_t len);
+  static void InvalidateOpcache(const std::string &path TSRMLS_DC);
+
+  uv_mutex_t lock_;
+  std::string parent_;
+  std::string dir_;
+  bool dir_created_;
+  size_t capacity_;
+  uint64_t next_file_;
+  // Most recently used entries are at the front.
+  std::list<Entry> lru_;
+  // Entries evicted while pinned; their files are removed on release.
+  std::list<Entry> evicted_;
+  // Paths whose files have been removed, waiting to be reused.
+  std::vector<std::string> free_paths_;
+  std::unordered_map<std::string, EntryRef> index_;
+  Stats stats_;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_SOURCECACHE_H_
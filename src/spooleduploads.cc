@@ -0,0 +1,130 @@
+// SpooledUploads populates $_POST and $_FILES from a multipart body
+// which was already parsed on the JS side.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#include "src/spooleduploads.h"
+
+#include <string>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+#include "main/php_globals.h"
+#include "main/php_variables.h"
+#include "main/SAPI.h"
+}
+
+#include "src/macros.h"
+
+namespace node_php_embed {
+
+namespace {
+
+std::string GetString(v8::Local<v8::Object> o, const char *key) {
+  Nan::Utf8String s(GET_PROPERTY(o, key));
+  return std::string(*s ? *s : "", *s ? s.length() : 0);
+}
+
+long GetLong(v8::Local<v8::Object> o,  // NOLINT(runtime/int)
+             const char *key) {
+  return static_cast<long>(  // NOLINT(runtime/int)
+      Nan::To<double>(GET_PROPERTY(o, key)).FromMaybe(0));
+}
+
+// The destructor for SG(rfc1867_uploaded_files) entries, which are
+// emalloc'ed file names.
+void FreeFilename(void *p) {
+  efree(*reinterpret_cast<char**>(p));
+}
+
+// Registers `value` as `$_FILES[field][key]`, or for array-style field
+// names like "field[a][]", as `$_FILES['field'][key]['a'][]`.
+void RegisterFileVar(const std::string &field, const char *key,
+                     zval *value, zval *track_vars_array TSRMLS_DC) {
+  size_t bracket = field.find('[');
+  std::string var = field.substr(0, bracket) + "[" + key + "]" +
+    (bracket == std::string::npos ? "" : field.substr(bracket));
+  php_register_variable_ex(const_cast<char*>(var.c_str()), value,
+                           track_vars_array TSRMLS_CC);
+}
+
+}  // namespace
+
+void SpooledUploads::Set(v8::Local<v8::Object> uploads) {
+  is_set_ = true;
+  v8::Local<v8::Value> fields = GET_PROPERTY(uploads, "fields");
+  if (fields->IsArray()) {
+    v8::Local<v8::Array> a = fields.As<v8::Array>();
+    for (uint32_t i = 0; i < a->Length(); i++) {
+      v8::Local<v8::Value> f = Nan::Get(a, i).ToLocalChecked();
+      if (!f->IsArray()) { continue; }
+      Nan::Utf8String name(Nan::Get(f.As<v8::Object>(), 0).ToLocalChecked());
+      v8::Local<v8::Value> value =
+        Nan::Get(f.As<v8::Object>(), 1).ToLocalChecked();
+      if (!(*name && node::Buffer::HasInstance(value))) { continue; }
+      fields_.emplace_back(
+          std::string(*name, name.length()),
+          std::string(node::Buffer::Data(value), node::Buffer::Length(value)));
+    }
+  }
+  v8::Local<v8::Value> files = GET_PROPERTY(uploads, "files");
+  if (files->IsArray()) {
+    v8::Local<v8::Array> a = files.As<v8::Array>();
+    for (uint32_t i = 0; i < a->Length(); i++) {
+      v8::Local<v8::Value> f = Nan::Get(a, i).ToLocalChecked();
+      if (!f->IsObject()) { continue; }
+      v8::Local<v8::Object> o = f.As<v8::Object>();
+      files_.push_back(File{
+          GetString(o, "field"), GetString(o, "name"), GetString(o, "type"),
+          GetString(o, "tmpName"), GetLong(o, "size"), GetLong(o, "error")});
+    }
+  }
+}
+
+void SpooledUploads::Register(TSRMLS_D) {
+  TRACE(">");
+  zval *post = PG(http_globals)[TRACK_VARS_POST];
+  zval *files = PG(http_globals)[TRACK_VARS_FILES];
+  if (post) {
+    for (auto const &f : fields_) {
+      php_register_variable_safe(const_cast<char*>(f.first.c_str()),
+                                 const_cast<char*>(f.second.data()),
+                                 f.second.size(), post TSRMLS_CC);
+    }
+  }
+  if (files) {
+    for (auto const &f : files_) {
+      if (!f.tmp_name.empty()) {
+        // This is what makes is_uploaded_file() and move_uploaded_file()
+        // accept the file, and what ensures it is removed at the end
+        // of the request.
+        if (!SG(rfc1867_uploaded_files)) {
+          ALLOC_HASHTABLE(SG(rfc1867_uploaded_files));
+          zend_hash_init(SG(rfc1867_uploaded_files), 8, nullptr,
+                         FreeFilename, 0);
+        }
+        char *tmp = estrndup(f.tmp_name.data(), f.tmp_name.size());
+        zend_hash_add(SG(rfc1867_uploaded_files), tmp, f.tmp_name.size() + 1,
+                      &tmp, sizeof(char *), nullptr);
+      }
+      zval z;
+      ZVAL_STRINGL(&z, f.name.data(), f.name.size(), 1);
+      RegisterFileVar(f.field, "name", &z, files TSRMLS_CC);
+      ZVAL_STRINGL(&z, f.type.data(), f.type.size(), 1);
+      RegisterFileVar(f.field, "type", &z, files TSRMLS_CC);
+      ZVAL_STRINGL(&z, f.tmp_name.data(), f.tmp_name.size(), 1);
+      RegisterFileVar(f.field, "tmp_name", &z, files TSRMLS_CC);
+      ZVAL_LONG(&z, f.error);
+      RegisterFileVar(f.field, "error", &z, files TSRMLS_CC);
+      ZVAL_LONG(&z, f.size);
+      RegisterFileVar(f.field, "size", &z, files TSRMLS_CC);
+    }
+  }
+  // We don't need these any more.
+  fields_.clear();
+  files_.clear();
+  TRACE("<");
+}
+
+}  // namespace node_php_embed
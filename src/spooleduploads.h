@@ -0,0 +1,49 @@
+// SpooledUploads populates $_POST and $_FILES from a multipart body
+// which was already parsed on the JS side.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_SPOOLEDUPLOADS_H_
+#define NODE_PHP_EMBED_SPOOLEDUPLOADS_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nan.h"
+
+extern "C" {
+#include "main/php.h"
+}
+
+namespace node_php_embed {
+
+/* When `php.request` is asked to spool uploads, lib/multipart.js
+ * reads the whole multipart/form-data body in node, writing uploaded
+ * files straight to temporary files.  The request is then started
+ * without a body, and this class fills in `$_POST` and `$_FILES` the
+ * way PHP's own rfc1867 parser would have, registering the temporary
+ * files so that `move_uploaded_file` accepts them and PHP removes
+ * them at the end of the request.
+ */
+class SpooledUploads {
+ public:
+  SpooledUploads() : is_set_(false), fields_(), files_() { }
+  // Called from the JS thread, with the result of `multipart.spool`.
+  void Set(v8::Local<v8::Object> uploads);
+  inline bool IsSet() const { return is_set_; }
+  // Called from the PHP thread, once the request has started.
+  void Register(TSRMLS_D);
+
+ private:
+  struct File {
+    std::string field, name, type, tmp_name;
+    long size, error;  // NOLINT(runtime/int)
+  };
+  bool is_set_;
+  std::vector<std::pair<std::string, std::string>> fields_;
+  std::vector<File> files_;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_SPOOLEDUPLOADS_H_
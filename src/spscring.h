@@ -0,0 +1,77 @@
+// SpscRing is a bounded lock-free single-producer/single-consumer queue.
+
+// Copyright (c) 2015 C. Scott Ananian <cscott@cscott.net>
+#ifndef NODE_PHP_EMBED_SPSCRING_H_
+#define NODE_PHP_EMBED_SPSCRING_H_
+
+#include <atomic>
+#include <cstddef>
+
+namespace node_php_embed {
+
+// A fixed-size ring buffer which may be used concurrently by exactly
+// one producer thread and exactly one consumer thread, without locks.
+// `Size` must be a power of two.  Each side keeps a private cached copy
+// of the other side's index, so that in the common case a push or a pop
+// touches only cache lines owned by the calling thread.
+template<typename T, std::size_t Size>
+class SpscRing {
+  static_assert(Size >= 2 && (Size & (Size - 1)) == 0,
+                "SpscRing size must be a power of two");
+  // Typical cache line size; used to keep the two indices apart.
+  static const std::size_t kLine = 64;
+
+ public:
+  SpscRing() : head_(0), tail_cache_(0), tail_(0), head_cache_(0) { }
+
+  // Callable only from the producer thread.  Returns false if the
+  // ring is full, in which case `item` was not enqueued.
+  bool TryPush(const T &item) {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ == Size) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ == Size) { return false; }
+    }
+    items_[tail & (Size - 1)] = item;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Callable only from the consumer thread.  Returns false if the
+  // ring is empty, in which case `*item` was not touched.
+  bool TryPop(T *item) {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) { return false; }
+    }
+    *item = items_[head & (Size - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Callable from either thread, but the answer may be stale by the
+  // time the caller looks at it.
+  bool IsEmpty() const {
+    return head_.load(std::memory_order_acquire) ==
+      tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  // Consumer-owned cache line.
+  std::atomic<std::size_t> head_;
+  std::size_t tail_cache_;
+  char pad1_[kLine - sizeof(std::atomic<std::size_t>) - sizeof(std::size_t)];
+  // Producer-owned cache line.
+  std::atomic<std::size_t> tail_;
+  std::size_t head_cache_;
+  char pad2_[kLine - sizeof(std::atomic<std::size_t>) - sizeof(std::size_t)];
+  T items_[Size];
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+};
+
+}  // namespace node_php_embed
+
+#endif  // NODE_PHP_EMBED_SPSCRING_H_
@@ -8,9 +8,9 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 
 #include <limits>
-#include <new>
 #include <sstream>
 #include <string>
 
@@ -22,7 +22,9 @@ extern "C" {
 }
 
 #include "src/macros.h"
+#include "src/node_php_jsasync_class.h"  // ...to recognize Js\Async in PHP land
 #include "src/node_php_jsbuffer_class.h"  // ...to recognize buffers in PHP land
+#include "src/node_php_jsbyref_class.h"  // ...to recognize Js\ByRef in PHP land
 #include "src/node_php_jswait_class.h"  // ...to recognize JsWait in PHP land
 
 namespace node_php_embed {
@@ -31,24 +33,30 @@ namespace node_php_embed {
 typedef uint32_t objid_t;
 
 // Methods in JsObjectMapper are/should be accessed only from the JS thread.
-// The mapper will hold persistent references to the objects for which it
-// has ids.
+// The mapper will hold persistent references to the JS objects for which
+// it has ids, but only weak references to its proxies for PHP objects.
 class JsObjectMapper {
  public:
   virtual ~JsObjectMapper() { }
   virtual objid_t IdForJsObj(const v8::Local<v8::Object> o) = 0;
   virtual v8::Local<v8::Object> JsObjForId(objid_t id) = 0;
+  // The JS proxy for the PHP object with this id has been garbage
+  // collected.  This may be called during GC, so must not touch the
+  // JS heap.
+  virtual void ReleasePhpObj(objid_t id) = 0;
 };
 
 // Methods in PhpObjectMapper are/should be accessed only from the PHP thread.
-// The mapper will hold references for the zvals it returns.
+// The mapper will hold references to the PHP objects for which it has
+// ids, but only weak references to its proxies for JS objects.
 class PhpObjectMapper {
  public:
   virtual ~PhpObjectMapper() { }
   virtual objid_t IdForPhpObj(zval *o) = 0;
-  // Returned value is owned by PhpObjectMapper, caller should not
-  // release it.
+  // Returns a new reference, which the caller should release.
   virtual zval * PhpObjForId(objid_t id TSRMLS_DC) = 0;
+  // The PHP proxy for the JS object with this id has been freed.
+  virtual void ReleaseJsObj(objid_t id TSRMLS_DC) = 0;
 };
 
 // An ObjectMapper is used by both threads, so inherits both interfaces.
@@ -106,13 +114,9 @@ class ZVal {
   inline void UnwrapByRef(TSRMLS_D) {
     if (!IsObject()) { return; }
     assert(zvalp && !transferred_);
-    zend_class_entry *ce = Z_OBJCE_P(zvalp);
-    // XXX cache the zend_class_entry at startup so we can do a simple
-    // pointer comparison instead of looking at the class name
-    if (ce->name_length == 8 && strcmp("Js\\ByRef", ce->name) == 0) {
+    if (Z_OBJCE_P(zvalp) == php_ce_jsbyref) {
       // Unwrap!
-      zval *rv;
-      zend_call_method_with_0_params(&zvalp, nullptr, nullptr, "getValue", &rv);
+      zval *rv = node_php_jsbyref_get(zvalp TSRMLS_CC);
       if (rv) {
         zval_ptr_dtor(&zvalp);
         zvalp = rv;
@@ -184,326 +188,24 @@ class ZVal {
   NAN_DISALLOW_ASSIGN_COPY(ZVal)
 };
 
-/* A poor man's tagged union, so that we can stack allocate messages
+/* A compact tagged union, so that we can stack allocate messages
  * containing values without having to pay for heap allocation.
  * It also provides safe storage for values independent of the PHP or
  * JS runtimes.
+ *
+ * A Value is 16 bytes of plain data (no vtable, no pointers into
+ * itself), so arrays of them are dense and could be moved with memcpy.
+ * Owned strings and buffers which are short enough are stored inline.
  */
 class Value {
-  class Base {
-   public:
-    Base() { }
-    virtual ~Base() { }
-    virtual v8::Local<v8::Value> ToJs(JsObjectMapper *m) const = 0;
-    virtual void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const = 0;
-    /* For debugging.  The returned value should not be deallocated. */
-    virtual const char *TypeString() const = 0;
-    /* For debugging purposes. Caller (implicitly) deallocates. */
-    virtual std::string ToString() const {
-      return std::string(TypeString());
-    }
-    NAN_DISALLOW_ASSIGN_COPY_MOVE(Base)
-  };
-  class Null : public Base {
-   public:
-    Null() { }
-    const char *TypeString() const override { return "Null"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      return scope.Escape(Nan::Null());
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      RETURN_NULL();
-    }
-  };
-  template <class T>
-  class Prim : public Base {
-    friend class Value;
-   public:
-    explicit Prim(T value) : value_(value) { }
-    std::string ToString() const override {
-      std::stringstream ss;
-      ss << TypeString() << "(" << value_ << ")";
-      return ss.str();
-    }
-
-   private:
-    T value_;
-  };
-  class Bool : public Prim<bool> {
-   public:
-    using Prim::Prim;
-    const char *TypeString() const override { return "Bool"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      return scope.Escape(Nan::New(value_));
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      RETURN_BOOL(value_);
-    }
-  };
-  class Int : public Prim<int64_t> {
-   public:
-    using Prim::Prim;
-    const char *TypeString() const override { return "Int"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      if (value_ >= 0 && value_ <= std::numeric_limits<uint32_t>::max()) {
-        return scope.Escape(Nan::New((uint32_t)value_));
-      } else if (value_ >= std::numeric_limits<int32_t>::min() &&
-                 value_ <= std::numeric_limits<int32_t>::max()) {
-        return scope.Escape(Nan::New((int32_t)value_));
-      }
-      return scope.Escape(Nan::New(static_cast<double>(value_)));
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      if (value_ >= std::numeric_limits<long>::min() &&  // NOLINT(runtime/int)
-          value_ <= std::numeric_limits<long>::max()) {  // NOLINT(runtime/int)
-        RETURN_LONG((long)value_);                       // NOLINT(runtime/int)
-      }
-      RETURN_DOUBLE((double)value_);
-    }
-  };
-  class Double : public Prim<double> {
-   public:
-    using Prim::Prim;
-    const char *TypeString() const override { return "Double"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      return scope.Escape(Nan::New(value_));
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      RETURN_DOUBLE(value_);
-    }
-  };
-  enum OwnerType { NOT_OWNED, PHP_OWNED, CPP_OWNED };
-  class Str : public Base {
-    friend class Value;
-   protected:
-    const char *data_;
-    std::size_t length_;
-    virtual OwnerType Owner() const { return NOT_OWNED; }
-
-   public:
-    explicit Str(const char *data, std::size_t length)
-        : data_(data), length_(length) { }
-    virtual ~Str() { Destroy(); }
-    const char *TypeString() const override { return "Str"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      return scope.Escape(Nan::New(data_, length_).ToLocalChecked());
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      // If we ever wanted to set `dup=0`, we'd need to ensure that the
-      // data was null-terminated, since Buffers aren't, necessarily,
-      // and PHP expects null-terminated strings.
-      RETURN_STRINGL(data_, length_, 1);
-    }
-    std::string ToString() const override {
-      std::stringstream ss;
-      ss << TypeString() << "(" << length_ << ",";
-      if (length_ > 10) {
-        ss << std::string(data_, 7) << "...";
-      } else {
-        ss << std::string(data_, length_);
-      }
-      ss << ")";
-      return ss.str();
-    }
-
-   private:
-    void Destroy() {
-      if (data_ == nullptr) { return; }
-      switch (Owner()) {
-      case NOT_OWNED: break;
-      case PHP_OWNED: efree(const_cast<char*>(data_)); break;
-      case CPP_OWNED: delete[] data_; break;
-      }
-      data_ = nullptr;
-    }
-  };
-  class OStr : public Str {
-    // An "owned string", will copy data on creation and free it on delete.
-   public:
-    explicit OStr(const char *data, std::size_t length)
-        : Str(nullptr, length) {
-      char *ndata = new char[length + 1];
-      memcpy(ndata, data, length);
-      ndata[length] = 0;
-      data_ = ndata;
-    }
-    virtual ~OStr() { Destroy(); }
-    const char *TypeString() const override { return "OStr"; }
-   protected:
-    OwnerType Owner() const override { return CPP_OWNED; }
-  };
-  class Buf : public Str {
-    friend class Value;
-   public:
-    Buf(const char *data, std::size_t length) : Str(data, length) { }
-    virtual ~Buf() { Destroy(); }
-    const char *TypeString() const override { return "Buf"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      return scope.Escape(Nan::CopyBuffer(data_, length_).ToLocalChecked());
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      node_php_jsbuffer_create(return_value, data_, length_,
-                               OwnershipType::PHP_OWNED TSRMLS_CC);
-    }
-  };
-  class OBuf : public Buf {
-   public:
-    OBuf(const char *data, std::size_t length) : Buf(nullptr, length) {
-      char *tmp = new char[length];
-      memcpy(tmp, data, length);
-      data_ = tmp;
-    }
-    virtual ~OBuf() { Destroy(); }
-    const char *TypeString() const override { return "OBuf"; }
-   protected:
-    OwnerType Owner() const override { return CPP_OWNED; }
-  };
-  class Obj : public Base {
-    objid_t id_;
-   public:
-    explicit Obj(objid_t id) : id_(id) { }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      return scope.Escape(m->JsObjForId(id_));
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      zval_ptr_dtor(&return_value);
-      *return_value_ptr = return_value = m->PhpObjForId(id_ TSRMLS_CC);
-      // The object mapper owns the reference returned, but we need a
-      // reference owned by the caller --- so increment reference count.
-      Z_ADDREF_P(return_value);
-    }
-    std::string ToString() const override {
-      std::stringstream ss;
-      ss << TypeString() << "(" << id_ << ")";
-      return ss.str();
-    }
-  };
-  class JsObj : public Obj {
-   public:
-    using Obj::Obj;
-    explicit JsObj(JsObjectMapper *m, v8::Local<v8::Object> o)
-        : Obj(m->IdForJsObj(o)) { }
-    const char *TypeString() const override { return "JsObj"; }
-  };
-  class PhpObj : public Obj {
-   public:
-    using Obj::Obj;
-    explicit PhpObj(PhpObjectMapper *m, zval *o)
-        : Obj(m->IdForPhpObj(o)) { }
-    const char *TypeString() const override { return "PhpObj"; }
-  };
-  // Wait objects are empty marker values used to indicate that
-  // the callee should substitute a node-style callback function
-  // for this value.
-  class Wait : public Base {
-   public:
-    Wait() { }
-    const char *TypeString() const override { return "Wait"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      // Default serialize as a null for safety; the MessageToJs should
-      // handle this specially by calling MessageToJs::MakeCallback() and
-      // replacing the value.
-      return scope.Escape(Nan::Null());
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      node_php_jswait_create(return_value TSRMLS_CC);
-    }
-  };
-  // Method thunks are empty marker values which are returned to
-  // signal that the caller should create a callback thunk.
-  // (That is, that the named property is a method on the PHP side.)
-  class MethodThunk : public Base {
-   public:
-    MethodThunk() { }
-    const char *TypeString() const override { return "MethodThunk"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      assert(false); /* should never reach here */
-      return scope.Escape(Nan::Undefined());
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-                       zval **return_value_ptr TSRMLS_DC) const override {
-      assert(false); /* should never reach here */
-      RETURN_NULL();
-    }
-  };
-  // Normally arrays are passed "by reference" between Node and PHP;
-  // that is, they are wrapped in proxies and the actual manipulation
-  // happens on the "host" side.  However, for implementing certain
-  // messages (invocations with variable arguments, property enumeration)
-  // it can be useful to transfer multiple Value objects as a single
-  // Value.  This type allows that, and it provides ToJs and ToPhp
-  // implementations that create appropriate "native" arrays.
-  // However `ArrayByValue` is never created by the `Set` methods
-  // which convert native values; it is only created explicitly for
-  // internal use.
-  class ArrayByValue : public Base {
-    friend class Value;
-    uint32_t length_;
-    Value *item_;
-
-   public:
-    explicit ArrayByValue(uint32_t length)
-        : length_(length), item_(new Value[length]) { }
-    virtual ~ArrayByValue() { delete[] item_; }
-    const char *TypeString() const override { return "ArrayByValue"; }
-    v8::Local<v8::Value> ToJs(JsObjectMapper *m) const override {
-      Nan::EscapableHandleScope scope;
-      v8::Local<v8::Array> arr = Nan::New<v8::Array>(length_);
-      for (uint32_t i = 0; i < length_; i++) {
-        Nan::Set(arr, i, item_[i].ToJs(m));
-      }
-      return scope.Escape(arr);
-    }
-    void ToPhp(PhpObjectMapper *m, zval *return_value,
-               zval **return_value_ptr TSRMLS_DC) const override {
-      array_init(return_value);
-      for (uint32_t i = 0; i < length_; i++) {
-        ZVal item{ZEND_FILE_LINE_C};
-        item_[i].ToPhp(m, item TSRMLS_CC);
-        add_index_zval(return_value, i, item.Escape());
-      }
-    }
-    std::string ToString() const override {
-      std::stringstream ss;
-      ss << TypeString() << "[" << length_ << "](";
-      for (uint32_t i = 0; i < length_ && i < 10; i++) {
-        if (i > 0) { ss << ", "; }
-        ss << item_[i].ToString();
-      }
-      if (length_ > 10) { ss << ", ..."; }
-      ss << ")";
-      return ss.str();
-    }
-  };
-
  public:
-  Value() : type_(VALUE_EMPTY), empty_(0) { }
-  virtual ~Value() { PerhapsDestroy(); }
+  Value() { word_.type = VALUE_EMPTY; }
+  ~Value() { PerhapsDestroy(); }
 
-  explicit Value(JsObjectMapper *m, v8::Local<v8::Value> v)
-      : type_(VALUE_EMPTY), empty_(0) {
+  explicit Value(JsObjectMapper *m, v8::Local<v8::Value> v) : Value() {
     Set(m, v);
   }
-  explicit Value(PhpObjectMapper *m, zval *v TSRMLS_DC)
-      : type_(VALUE_EMPTY), empty_(0) {
+  explicit Value(PhpObjectMapper *m, zval *v TSRMLS_DC) : Value() {
     Set(m, v TSRMLS_CC);
   }
   void Set(JsObjectMapper *m, v8::Local<v8::Value> v) {
@@ -574,8 +276,9 @@ class Value {
         SetBuffer(b->data, b->length);
         return;
       }
-      // Special case for JsWait objects.
-      if (Z_OBJCE_P(v) == php_ce_jswait) {
+      // Special case for JsWait objects.  Js\Async markers look the
+      // same on the JS side; only the PHP side waits differently.
+      if (Z_OBJCE_P(v) == php_ce_jswait || Z_OBJCE_P(v) == php_ce_jsasync) {
         SetWait();
         return;
       }
@@ -588,82 +291,87 @@ class Value {
   }
   void SetEmpty() {
     PerhapsDestroy();
-    type_ = VALUE_EMPTY;
-    empty_ = 0;
   }
   void SetNull() {
     PerhapsDestroy();
-    type_ = VALUE_NULL;
-    new (&null_) Null();
+    word_.type = VALUE_NULL;
   }
   void SetBool(bool value) {
     PerhapsDestroy();
-    type_ = VALUE_BOOL;
-    new (&bool_) Bool(value);
+    word_.type = VALUE_BOOL;
+    word_.b = value;
   }
   void SetInt(int64_t value) {
     PerhapsDestroy();
-    type_ = VALUE_INT;
-    new (&int_) Int(value);
+    word_.type = VALUE_INT;
+    word_.i = value;
   }
   void SetDouble(double value) {
     PerhapsDestroy();
-    type_ = VALUE_DOUBLE;
-    new (&double_) Double(value);
+    word_.type = VALUE_DOUBLE;
+    word_.d = value;
   }
   void SetString(const char *data, std::size_t length) {
-    PerhapsDestroy();
-    type_ = VALUE_STR;
-    new (&str_) Str(data, length);
+    SetBytes(VALUE_STR, data, length);
   }
+  // An "owned string", will copy data on creation and free it on delete.
   void SetOwnedString(const char *data, std::size_t length) {
-    PerhapsDestroy();
-    type_ = VALUE_OSTR;
-    new (&ostr_) OStr(data, length);
+    SetOwnedBytes(VALUE_ISTR, VALUE_OSTR, data, length);
   }
   void SetBuffer(const char *data, std::size_t length) {
-    PerhapsDestroy();
-    type_ = VALUE_BUF;
-    new (&buf_) Buf(data, length);
+    SetBytes(VALUE_BUF, data, length);
   }
   void SetOwnedBuffer(const char *data, std::size_t length) {
-    PerhapsDestroy();
-    type_ = VALUE_OBUF;
-    new (&obuf_) OBuf(data, length);
+    SetOwnedBytes(VALUE_IBUF, VALUE_OBUF, data, length);
   }
   void SetJsObject(JsObjectMapper *m, v8::Local<v8::Object> o) {
     SetJsObject(m->IdForJsObj(o));
   }
   void SetJsObject(objid_t id) {
     PerhapsDestroy();
-    type_ = VALUE_JSOBJ;
-    new (&jsobj_) JsObj(id);
+    word_.type = VALUE_JSOBJ;
+    word_.id = id;
   }
   void SetPhpObject(PhpObjectMapper *m, const zval *o) {
     SetPhpObject(m->IdForPhpObj(const_cast<zval*>(o)));
   }
   void SetPhpObject(objid_t id) {
     PerhapsDestroy();
-    type_ = VALUE_PHPOBJ;
-    new (&phpobj_) PhpObj(id);
+    word_.type = VALUE_PHPOBJ;
+    word_.id = id;
   }
+  // Wait objects are empty marker values used to indicate that
+  // the callee should substitute a node-style callback function
+  // for this value.
   void SetWait() {
     PerhapsDestroy();
-    type_ = VALUE_WAIT;
-    new (&wait_) Wait();
+    word_.type = VALUE_WAIT;
   }
+  // Method thunks are empty marker values which are returned to
+  // signal that the caller should create a callback thunk.
+  // (That is, that the named property is a method on the PHP side.)
   void SetMethodThunk() {
     PerhapsDestroy();
-    type_ = VALUE_METHOD_THUNK;
-    new (&method_thunk_) MethodThunk();
+    word_.type = VALUE_METHOD_THUNK;
   }
+  // Normally arrays are passed "by reference" between Node and PHP;
+  // that is, they are wrapped in proxies and the actual manipulation
+  // happens on the "host" side.  However, for implementing certain
+  // messages (invocations with variable arguments, property enumeration)
+  // it can be useful to transfer multiple Value objects as a single
+  // Value.  This type allows that, and it provides ToJs and ToPhp
+  // implementations that create appropriate "native" arrays.
+  // However `ArrayByValue` is never created by the `Set` methods
+  // which convert native values; it is only created explicitly for
+  // internal use.  The items live in a single contiguous allocation.
   template<typename Func>
   void SetArrayByValue(uint32_t length, Func func) {
     PerhapsDestroy();
-    type_ = VALUE_ARRAY_BY_VALUE;
-    new (&array_by_value_) ArrayByValue(length);
+    word_.type = VALUE_ARRAY_BY_VALUE;
+    word_.length = length;
+    word_.items = (length == 0) ? nullptr : new Value[length];
     for (uint32_t i = 0; i < length; i++) {
-      func(i, array_by_value_.item_[i]);
+      func(i, word_.items[i]);
     }
   }
 
@@ -673,12 +381,106 @@ class Value {
   }
 
   v8::Local<v8::Value> ToJs(JsObjectMapper *m) const {
-    return AsBase().ToJs(m);
+    Nan::EscapableHandleScope scope;
+    switch (Type()) {
+    case VALUE_EMPTY:
+    default:
+      assert(false);  // Should never get here.
+    case VALUE_NULL:
+      return scope.Escape(Nan::Null());
+    case VALUE_BOOL:
+      return scope.Escape(Nan::New(word_.b));
+    case VALUE_INT:
+      if (word_.i >= 0 &&
+          word_.i <= std::numeric_limits<uint32_t>::max()) {
+        return scope.Escape(Nan::New((uint32_t)word_.i));
+      } else if (word_.i >= std::numeric_limits<int32_t>::min() &&
+                 word_.i <= std::numeric_limits<int32_t>::max()) {
+        return scope.Escape(Nan::New((int32_t)word_.i));
+      }
+      return scope.Escape(Nan::New(static_cast<double>(word_.i)));
+    case VALUE_DOUBLE:
+      return scope.Escape(Nan::New(word_.d));
+    case VALUE_STR:
+    case VALUE_OSTR:
+    case VALUE_ISTR:
+      return scope.Escape(Nan::New(Data(), Length()).ToLocalChecked());
+    case VALUE_BUF:
+    case VALUE_OBUF:
+    case VALUE_IBUF:
+      return scope.Escape(Nan::CopyBuffer(Data(), Length()).ToLocalChecked());
+    case VALUE_JSOBJ:
+    case VALUE_PHPOBJ:
+      return scope.Escape(m->JsObjForId(word_.id));
+    case VALUE_WAIT:
+      // Default serialize as a null for safety; the MessageToJs should
+      // handle this specially by calling MessageToJs::MakeCallback() and
+      // replacing the value.
+      return scope.Escape(Nan::Null());
+    case VALUE_METHOD_THUNK:
+      assert(false); /* should never reach here */
+      return scope.Escape(Nan::Undefined());
+    case VALUE_ARRAY_BY_VALUE: {
+      v8::Local<v8::Array> arr = Nan::New<v8::Array>(word_.length);
+      for (uint32_t i = 0; i < word_.length; i++) {
+        Nan::Set(arr, i, word_.items[i].ToJs(m));
+      }
+      return scope.Escape(arr);
+    }
+    }
   }
   // The caller owns the zval.
   void ToPhp(PhpObjectMapper *m, zval *return_value,
              zval **return_value_ptr TSRMLS_DC) const {
-    AsBase().ToPhp(m, return_value, return_value_ptr TSRMLS_CC);
+    switch (Type()) {
+    case VALUE_EMPTY:
+    default:
+      assert(false);  // Should never get here.
+    case VALUE_NULL:
+      RETURN_NULL();
+    case VALUE_BOOL:
+      RETURN_BOOL(word_.b);
+    case VALUE_INT:
+      if (word_.i >= std::numeric_limits<long>::min() &&  // NOLINT(runtime/int)
+          word_.i <= std::numeric_limits<long>::max()) {  // NOLINT(runtime/int)
+        RETURN_LONG((long)word_.i);                       // NOLINT(runtime/int)
+      }
+      RETURN_DOUBLE((double)word_.i);
+    case VALUE_DOUBLE:
+      RETURN_DOUBLE(word_.d);
+    case VALUE_STR:
+    case VALUE_OSTR:
+    case VALUE_ISTR:
+      // If we ever wanted to set `dup=0`, we'd need to ensure that the
+      // data was null-terminated, since Buffers aren't, necessarily,
+      // and PHP expects null-terminated strings.
+      RETURN_STRINGL(Data(), Length(), 1);
+    case VALUE_BUF:
+    case VALUE_OBUF:
+    case VALUE_IBUF:
+      node_php_jsbuffer_create(return_value, Data(), Length(),
+                               OwnershipType::PHP_OWNED TSRMLS_CC);
+      return;
+    case VALUE_JSOBJ:
+    case VALUE_PHPOBJ:
+      zval_ptr_dtor(&return_value);
+      *return_value_ptr = return_value = m->PhpObjForId(word_.id TSRMLS_CC);
+      return;
+    case VALUE_WAIT:
+      node_php_jswait_create(return_value TSRMLS_CC);
+      return;
+    case VALUE_METHOD_THUNK:
+      assert(false); /* should never reach here */
+      RETURN_NULL();
+    case VALUE_ARRAY_BY_VALUE:
+      array_init(return_value);
+      for (uint32_t i = 0; i < word_.length; i++) {
+        ZVal item{ZEND_FILE_LINE_C};
+        word_.items[i].ToPhp(m, item TSRMLS_CC);
+        add_index_zval(return_value, i, item.Escape());
+      }
+      return;
+    }
   }
   // Caller owns the ZVal, and is responsible for freeing it.
   inline void ToPhp(PhpObjectMapper *m, ZVal &z TSRMLS_DC) const {
@@ -686,43 +488,43 @@ class Value {
     ToPhp(m, z.Ptr(), z.PtrPtr() TSRMLS_CC);
   }
   inline bool IsEmpty() const {
-    return (type_ == VALUE_EMPTY);
+    return (Type() == VALUE_EMPTY);
   }
   inline bool IsWait() const {
-    return (type_ == VALUE_WAIT);
+    return (Type() == VALUE_WAIT);
   }
   inline bool IsMethodThunk() const {
-    return (type_ == VALUE_METHOD_THUNK);
+    return (Type() == VALUE_METHOD_THUNK);
   }
   inline bool IsArrayByValue() const {
-    return (type_ == VALUE_ARRAY_BY_VALUE);
+    return (Type() == VALUE_ARRAY_BY_VALUE);
   }
   inline Value& operator[](int i) const {
     assert(IsArrayByValue());
-    return array_by_value_.item_[i];
+    return word_.items[i];
   }
   bool AsBool() const {
-    switch (type_) {
+    switch (Type()) {
     case VALUE_BOOL:
-      return bool_.value_;
+      return word_.b;
     case VALUE_INT:
-      return int_.value_ != 0;
+      return word_.i != 0;
     default:
       return false;
     }
   }
   // Convert unowned values into owned values so the caller can disappear.
   void TakeOwnership() {
-    switch (type_) {
+    switch (Type()) {
     case VALUE_STR:
-      SetOwnedString(str_.data_, str_.length_);
+      SetOwnedString(word_.data, word_.length);
       break;
     case VALUE_BUF:
-      SetOwnedBuffer(buf_.data_, buf_.length_);
+      SetOwnedBuffer(word_.data, word_.length);
       break;
     case VALUE_ARRAY_BY_VALUE:
-      for (uint32_t i = 0; i < array_by_value_.length_; i++) {
-        array_by_value_.item_[i].TakeOwnership();
+      for (uint32_t i = 0; i < word_.length; i++) {
+        word_.items[i].TakeOwnership();
       }
       break;
     default:
@@ -731,69 +533,158 @@ class Value {
   }
   /* For debugging: describe the value. Caller implicitly deallocates. */
   std::string ToString() const {
-    if (IsEmpty()) {
-      return std::string("Empty");
-    } else {
-      return AsBase().ToString();
+    std::stringstream ss;
+    ss << TypeString();
+    switch (Type()) {
+    case VALUE_BOOL:
+      ss << "(" << word_.b << ")";
+      break;
+    case VALUE_INT:
+      ss << "(" << word_.i << ")";
+      break;
+    case VALUE_DOUBLE:
+      ss << "(" << word_.d << ")";
+      break;
+    case VALUE_STR: case VALUE_OSTR: case VALUE_ISTR:
+    case VALUE_BUF: case VALUE_OBUF: case VALUE_IBUF:
+      ss << "(" << Length() << ",";
+      if (Length() > 10) {
+        ss << std::string(Data(), 7) << "...";
+      } else {
+        ss << std::string(Data(), Length());
+      }
+      ss << ")";
+      break;
+    case VALUE_JSOBJ:
+    case VALUE_PHPOBJ:
+      ss << "(" << word_.id << ")";
+      break;
+    case VALUE_ARRAY_BY_VALUE:
+      ss << "[" << word_.length << "](";
+      for (uint32_t i = 0; i < word_.length && i < 10; i++) {
+        if (i > 0) { ss << ", "; }
+        ss << word_.items[i].ToString();
+      }
+      if (word_.length > 10) { ss << ", ..."; }
+      ss << ")";
+      break;
+    default:
+      break;
     }
+    return ss.str();
   }
 
  private:
-  void PerhapsDestroy() {
-    if (!IsEmpty()) {
-      AsBase().~Base();
-    }
-    type_ = VALUE_EMPTY;
-  }
-  enum ValueTypes {
+  enum ValueTypes : uint8_t {
     VALUE_EMPTY, VALUE_NULL, VALUE_BOOL, VALUE_INT, VALUE_DOUBLE,
-    VALUE_STR, VALUE_OSTR, VALUE_BUF, VALUE_OBUF,
+    // Strings and buffers: not owned, owned, and owned but inline.
+    VALUE_STR, VALUE_OSTR, VALUE_ISTR, VALUE_BUF, VALUE_OBUF, VALUE_IBUF,
     VALUE_JSOBJ, VALUE_PHPOBJ,
     VALUE_WAIT, VALUE_METHOD_THUNK, VALUE_ARRAY_BY_VALUE
-  } type_;
+  };
+  // Both representations start with the type tag, so it can always be
+  // read through word_.
+  struct Word {
+    ValueTypes type;
+    uint32_t length;  // Of a string, buffer or array.
+    union {
+      bool b;
+      int64_t i;
+      double d;
+      objid_t id;
+      const char *data;
+      Value *items;
+    };
+  };
+  static const std::size_t kInlineLength = 14;
+  struct Inline {
+    ValueTypes type;
+    uint8_t length;
+    char data[kInlineLength];
+  };
   union {
-    int empty_; Null null_; Bool bool_; Int int_; Double double_;
-    Str str_; OStr ostr_; Buf buf_; OBuf obuf_;
-    JsObj jsobj_; PhpObj phpobj_;
-    Wait wait_; MethodThunk method_thunk_;
-    ArrayByValue array_by_value_;
+    Word word_;
+    Inline inline_;
   };
 
-  const Base &AsBase() const {
-    switch (type_) {
-    default:
-      assert(false);  // Should never get here.
-    case VALUE_NULL:
-      return null_;
-    case VALUE_BOOL:
-      return bool_;
-    case VALUE_INT:
-      return int_;
-    case VALUE_DOUBLE:
-      return double_;
-    case VALUE_STR:
-      return str_;
+  inline ValueTypes Type() const { return word_.type; }
+  inline const char *Data() const {
+    return (Type() == VALUE_ISTR || Type() == VALUE_IBUF) ?
+      inline_.data : word_.data;
+  }
+  inline std::size_t Length() const {
+    return (Type() == VALUE_ISTR || Type() == VALUE_IBUF) ?
+      inline_.length : word_.length;
+  }
+  void SetBytes(ValueTypes type, const char *data, std::size_t length) {
+    assert(length <= std::numeric_limits<uint32_t>::max());
+    PerhapsDestroy();
+    word_.type = type;
+    word_.length = length;
+    word_.data = data;
+  }
+  void SetOwnedBytes(ValueTypes inline_type, ValueTypes owned_type,
+                     const char *data, std::size_t length) {
+    assert(length <= std::numeric_limits<uint32_t>::max());
+    if (length <= kInlineLength) {
+      // `data` may point into our own (unowned) storage, so copy first.
+      char tmp[kInlineLength];
+      memcpy(tmp, data, length);
+      PerhapsDestroy();
+      inline_.type = inline_type;
+      inline_.length = length;
+      memcpy(inline_.data, tmp, length);
+      return;
+    }
+    char *ndata = new char[length + 1];
+    memcpy(ndata, data, length);
+    ndata[length] = 0;
+    PerhapsDestroy();
+    word_.type = owned_type;
+    word_.length = length;
+    word_.data = ndata;
+  }
+  void PerhapsDestroy() {
+    switch (Type()) {
     case VALUE_OSTR:
-      return ostr_;
-    case VALUE_BUF:
-      return buf_;
     case VALUE_OBUF:
-      return obuf_;
-    case VALUE_JSOBJ:
-      return jsobj_;
-    case VALUE_PHPOBJ:
-      return phpobj_;
-    case VALUE_WAIT:
-      return wait_;
-    case VALUE_METHOD_THUNK:
-      return method_thunk_;
+      delete[] word_.data;
+      break;
     case VALUE_ARRAY_BY_VALUE:
-      return array_by_value_;
+      delete[] word_.items;
+      break;
+    default:
+      break;
+    }
+    word_.type = VALUE_EMPTY;
+  }
+  /* For debugging.  The returned value should not be deallocated. */
+  const char *TypeString() const {
+    switch (Type()) {
+    default:
+    case VALUE_EMPTY: return "Empty";
+    case VALUE_NULL: return "Null";
+    case VALUE_BOOL: return "Bool";
+    case VALUE_INT: return "Int";
+    case VALUE_DOUBLE: return "Double";
+    case VALUE_STR: return "Str";
+    case VALUE_OSTR: return "OStr";
+    case VALUE_ISTR: return "IStr";
+    case VALUE_BUF: return "Buf";
+    case VALUE_OBUF: return "OBuf";
+    case VALUE_IBUF: return "IBuf";
+    case VALUE_JSOBJ: return "JsObj";
+    case VALUE_PHPOBJ: return "PhpObj";
+    case VALUE_WAIT: return "Wait";
+    case VALUE_METHOD_THUNK: return "MethodThunk";
+    case VALUE_ARRAY_BY_VALUE: return "ArrayByValue";
     }
   }
   NAN_DISALLOW_ASSIGN_COPY_MOVE(Value)
 };
 
+static_assert(sizeof(Value) <= 16, "Value should fit in 16 bytes");
+
 }  // namespace node_php_embed
 
 #endif  // NODE_PHP_EMBED_VALUES_H_
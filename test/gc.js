@@ -0,0 +1,129 @@
+require('should');
+
+var StringStream = require('../test-stream.js');
+
+describe('Garbage collection of objects shared between JS and PHP', function() {
+  var php = require('../');
+  var ROWS = 20000;
+  var ROW_SIZE = 16384;
+  // If every row leaked we'd grow by ROWS * ROW_SIZE = 320MB.
+  var MAX_GROWTH = 64 * 1024 * 1024;
+  var gc = global.gc || (function() {
+    try {
+      require('v8').setFlagsFromString('--expose_gc');
+      return require('vm').runInNewContext('gc');
+    } catch (e) {
+      return null;
+    }
+  })();
+
+  var makeContext = function(samples) {
+    return {
+      row: function(i) {
+        var pad = new Buffer(ROW_SIZE);
+        pad.fill(0);
+        return { i: i, pad: pad };
+      },
+      take: function(row) {
+        return row.i;
+      },
+      sample: function() {
+        if (gc) { gc(); }
+        samples.push(process.memoryUsage().rss);
+      },
+    };
+  };
+  var checkSamples = function(samples) {
+    samples.length.should.be.above(2);
+    // Skip the first sample, taken before things warm up.
+    var base = samples[1];
+    var peak = Math.max.apply(Math, samples);
+    (peak - base).should.be.below(MAX_GROWTH);
+  };
+
+  it('should release JS objects dropped by PHP', function() {
+    this.timeout(60000);
+    var samples = [];
+    var out = new StringStream();
+    return php.request({
+      stream: out,
+      context: makeContext(samples),
+      source: [
+        'call_user_func(function () {',
+        '  $c = $_SERVER["CONTEXT"];',
+        '  $sum = 0;',
+        '  for ($i = 0; $i < ' + ROWS + '; $i++) {',
+        '    $row = $c->row($i);',
+        '    $sum += $row->i;',
+        '    if ($i % 1000 === 0) { $c->sample(); }',
+        '  }',
+        '  return $sum;',
+        '})',
+      ].join('\n'),
+    }).then(function(v) {
+      v.should.equal(ROWS * (ROWS - 1) / 2);
+      out.toString().should.equal('');
+      checkSamples(samples);
+    });
+  });
+
+  it('should release PHP objects dropped by JS', function() {
+    this.timeout(60000);
+    var samples = [];
+    var out = new StringStream();
+    return php.request({
+      stream: out,
+      context: makeContext(samples),
+      source: [
+        'call_user_func(function () {',
+        '  class Row {',
+        '    public $i;',
+        '    public $pad;',
+        '    public function __construct($i) {',
+        '      $this->i = $i;',
+        '      $this->pad = str_repeat("x", ' + ROW_SIZE + ');',
+        '    }',
+        '  }',
+        '  $c = $_SERVER["CONTEXT"];',
+        '  $sum = 0;',
+        '  for ($i = 0; $i < ' + ROWS + '; $i++) {',
+        '    $sum += $c->take(new Row($i));',
+        '    if ($i % 1000 === 0) { $c->sample(); }',
+        '  }',
+        '  return $sum;',
+        '})',
+      ].join('\n'),
+    }).then(function(v) {
+      v.should.equal(ROWS * (ROWS - 1) / 2);
+      out.toString().should.equal('');
+      checkSamples(samples);
+    });
+  });
+
+  it('should keep object identity in concurrent requests', function() {
+    var shared = { x: 1 };
+    var context = {
+      a: shared,
+      b: shared,
+      isShared: function(o) { return o === shared; },
+      isSame: function(o1, o2) { return o1 === o2; },
+    };
+    var source = [
+      'call_user_func(function () {',
+      '  $c = $_SERVER["CONTEXT"];',
+      '  $o = new stdClass();',
+      '  return ($c->a === $c->b) && $c->isShared($c->b) &&',
+      '    $c->isSame($o, $o) && !$c->isSame($o, new stdClass());',
+      '})',
+    ].join('\n');
+    return Promise.all([1, 2, 3].map(function() {
+      return php.request({
+        stream: new StringStream(),
+        context: context,
+        source: source,
+      });
+    })).then(function(v) {
+      v.should.eql([true, true, true]);
+    });
+  });
+});
@@ -2,7 +2,9 @@ var Promise = require('prfun');
 var StringStream = require('../test-stream.js');
 var http = require('http');
 var querystring = require('querystring');
+var stream = require('readable-stream');
 var should = require('should');
+var zlib = require('zlib');
 require('should-http');
 
 describe('Feeding POST data from JS to PHP', function() {
@@ -36,8 +38,12 @@ describe('Feeding POST data from JS to PHP', function() {
           responseResolver.resolve(res);
           outputResolver.resolve(out.toString());
         });
-        // Pipe the output to a string stream
-        res.pipe(out);
+        // Pipe the (decompressed) output to a string stream
+        if (/^(gzip|deflate)$/.test(res.headers['content-encoding'])) {
+          res.pipe(zlib.createUnzip()).pipe(out);
+        } else {
+          res.pipe(out);
+        }
       });
       req.on('error', responseResolver.reject);
       if (requestFunc) { requestFunc(req); }
@@ -49,21 +55,22 @@ describe('Feeding POST data from JS to PHP', function() {
       responseResolver.promise,
     ]);
   };
+  // Returns the request line as PHP sees it in $_SERVER.
+  var requestLine = [
+    '  return $_SERVER["REQUEST_METHOD"] . " " . $_SERVER["REQUEST_URI"] .',
+    '    " " . $_SERVER["QUERY_STRING"];',
+  ];
   it('should handle a basic GET request', function() {
-    var serverOk = false;
     return makeServer({
       path: '/index.html?abc=def&foo=bar+bat',
     }, {
-      // We have to dereference $_SERVER in order to trigger the
-      // _testInitServer method.
-      source: 'var_dump($_SERVER["CONTEXT"] ? $_GET : $_GET)',
-      _testInitServer: function(server) {
-        serverOk = (server.REQUEST_METHOD === 'GET' &&
-        server.REQUEST_URI === '/index.html?abc=def&foo=bar+bat' &&
-        server.QUERY_STRING === 'abc=def&foo=bar+bat');
-      },
+      source: [
+        'call_user_func(function() {',
+        '  var_dump($_GET);',
+      ].concat(requestLine, '})').join('\n'),
     }).spread(function(phpvalue, output, response) {
-      should(phpvalue).be.null();
+      should(phpvalue).be.equal(
+        'GET /index.html?abc=def&foo=bar+bat abc=def&foo=bar+bat');
       output.should.be.equal([
         'array(2) {',
         '  ["abc"]=>',
@@ -76,11 +83,25 @@ describe('Feeding POST data from JS to PHP', function() {
       response.should.be.html();
       response.should.have.status(200);
       response.should.have.header('x-powered-by');
-      serverOk.should.be.true();
+    });
+  });
+  it('should register $_SERVER names as before', function() {
+    var out = new StringStream();
+    return php.request({
+      stream: out,
+      source: 'json_encode([$_SERVER["A_B"], $_SERVER["C_D"], ' +
+        '$_SERVER["E"]["F"], $_SERVER["G_H"]])',
+      serverInitFunc: function(server) {
+        server['A.B'] = 'dot';
+        server['C D'] = 'space';
+        server['E[F]'] = 'array';
+        server['G.H'] = 42;  // Not a string.
+      },
+    }).then(function(result) {
+      JSON.parse(result).should.eql(['dot', 'space', 'array', 42]);
     });
   });
   it('should handle a basic POST request', function() {
-    var serverOk = false;
     var postData = querystring.stringify({
       msg: 'Hello World!',
       foo: 'bar bat',
@@ -93,18 +114,14 @@ describe('Feeding POST data from JS to PHP', function() {
         'Content-Length': postData.length,
       },
     }, {
-      // We have to dereference $_SERVER in order to trigger the
-      // _testInitServer method.
-      source: 'var_dump($_SERVER["CONTEXT"] ? $_POST : $_POST)',
-      _testInitServer: function(server) {
-        serverOk = (server.REQUEST_METHOD === 'POST' &&
-        server.REQUEST_URI === '/post' &&
-        server.QUERY_STRING === '');
-      },
+      source: [
+        'call_user_func(function() {',
+        '  var_dump($_POST);',
+      ].concat(requestLine, '})').join('\n'),
     }, function(request) {
       request.write(postData);
     }).spread(function(phpvalue, output, response) {
-      should(phpvalue).be.null();
+      should(phpvalue).be.equal('POST /post ');
       output.should.be.equal([
         'array(2) {',
         '  ["msg"]=>',
@@ -117,11 +134,117 @@ describe('Feeding POST data from JS to PHP', function() {
       response.should.be.html();
       response.should.have.status(200);
       response.should.have.header('x-powered-by');
-      serverOk.should.be.true();
+    });
+  });
+  it('should handle a POST body larger than the read-ahead queue', function() {
+    var chunk = new Buffer(64 * 1024);
+    for (var i = 0; i < chunk.length; i++) { chunk[i] = i & 0xFF; }
+    var count = 48; // 3MB, which exceeds the native queue's limit.
+    var hash = require('crypto').createHash('md5');
+    for (i = 0; i < count; i++) { hash.update(chunk); }
+    return makeServer({
+      path: '/upload',
+      method: 'POST',
+      headers: {
+        'Content-Type': 'application/octet-stream',
+        'Content-Length': chunk.length * count,
+      },
+    }, {
+      source: [
+        'call_user_func(function() {',
+        '  $body = file_get_contents("php://input");',
+        '  echo strlen($body), " ", md5($body);',
+        '})',
+      ].join('\n'),
+    }, function(request) {
+      for (var j = 0; j < count; j++) { request.write(chunk); }
+    }).spread(function(phpvalue, output, response) {
+      output.should.be.equal((chunk.length * count) + ' ' +
+                             hash.digest('hex'));
+      response.should.have.status(200);
+    });
+  });
+  it('should report a request stream error', function() {
+    var request = new stream.PassThrough();
+    request.method = 'POST';
+    request.url = '/upload';
+    request.httpVersion = '1.1';
+    request.headers = { 'content-type': 'application/octet-stream' };
+    // This listener runs after the one which pushes the data to PHP.
+    request.once('data', function() {
+      request.emit('error', new Error('connection reset'));
+    });
+    request.write('partial');
+    var out = new StringStream();
+    return php.request({
+      request: request,
+      stream: out,
+      source: [
+        'call_user_func(function() {',
+        '  $body = @file_get_contents("php://input");',
+        '  $e = error_get_last();',
+        '  echo $body, " ", $e["message"];',
+        '})',
+      ].join('\n'),
+    }).then(function() {
+      throw new Error('should have failed');
+    }, function(e) {
+      e.message.should.equal('connection reset');
+      out.toString().should.match(
+        /^partial .*Request body truncated: connection reset$/);
+    });
+  });
+  it('should compress the response on the PHP side', function() {
+    var text = new Array(1001).join('hello, world\n');
+    return makeServer({
+      path: '/compress',
+      headers: { 'Accept-Encoding': 'deflate;q=0.5, gzip' },
+    }, {
+      source: [
+        'call_user_func(function() {',
+        '  echo str_repeat("hello, world\\n", 500);',
+        '  flush();',
+        '  echo str_repeat("hello, world\\n", 500);',
+        '})',
+      ].join('\n'),
+      compress: { level: 9 },
+    }).spread(function(phpvalue, output, response) {
+      response.should.have.status(200);
+      response.should.have.header('content-encoding', 'gzip');
+      response.should.have.header('vary', 'Accept-Encoding');
+      output.should.be.equal(text);
+    });
+  });
+  it('should not compress small or unacceptable responses', function() {
+    return Promise.all([
+      makeServer({
+        path: '/small',
+        headers: { 'Accept-Encoding': 'gzip' },
+      }, {
+        source: [
+          'call_user_func(function() {',
+          '  header("Content-Length: 5");',
+          '  echo "small";',
+          '})',
+        ].join('\n'),
+        compress: true,
+      }),
+      makeServer({
+        path: '/identity',
+        headers: { 'Accept-Encoding': 'identity' },
+      }, {
+        source: 'call_user_func(function() { echo "plain"; })',
+        compress: true,
+      }),
+    ]).then(function(results) {
+      results.forEach(function(result) {
+        result[2].should.not.have.header('content-encoding');
+      });
+      results[0][1].should.equal('small');
+      results[1][1].should.equal('plain');
     });
   });
   it('should handle cookies', function() {
-    var serverOk = false;
     return makeServer({
       path: '/cookie/test',
       headers: {
@@ -135,22 +258,13 @@ describe('Feeding POST data from JS to PHP', function() {
     }, {
       source: [
         'call_user_func(function() {',
-        '  # ensure that _testInitServer is triggered',
-        '  $_SERVER["CONTEXT"];',
         '  # ensure we handle duplicate headers sent from PHP',
         '  setcookie("a", "b");',
         '  setcookie("c", "d", 0, "/");',
         '  var_dump($_COOKIE);',
-        '  return 1;',
-        '})',
-      ].join('\n'),
-      _testInitServer: function(server) {
-        serverOk = (server.REQUEST_METHOD === 'GET' &&
-        server.REQUEST_URI === '/cookie/test' &&
-        server.QUERY_STRING === '');
-      },
+      ].concat(requestLine, '})').join('\n'),
     }).spread(function(phpvalue, output, response) {
-      should(phpvalue).be.equal(1);
+      should(phpvalue).be.equal('GET /cookie/test ');
       output.should.be.equal([
         'array(2) {',
         '  ["foo"]=>',
@@ -168,7 +282,44 @@ describe('Feeding POST data from JS to PHP', function() {
         'a=b',
         'c=d; path=/',
       ]);
-      serverOk.should.be.true();
+    });
+  });
+  it('should send the status line and headers', function() {
+    return makeServer({ path: '/missing' }, {
+      source: [
+        'call_user_func(function() {',
+        '  header("HTTP/1.1 404 Gone Fishing");',
+        '  header("Content-Type: text/plain");',
+        '  header("X-Multi: one");',
+        '  header("x-multi: two", false);',
+        '  header("Cache-Control:no-cache");',
+        '  echo "nothing here";',
+        '})',
+      ].join('\n'),
+    }).spread(function(phpvalue, output, response) {
+      output.should.be.equal('nothing here');
+      response.should.have.status(404);
+      response.statusMessage.should.equal('Gone Fishing');
+      response.should.have.header('content-type', 'text/plain');
+      response.should.have.header('cache-control', 'no-cache');
+      response.headers['x-multi'].should.equal('one, two');
+    });
+  });
+  it('should send headers from requests with args', function() {
+    return makeServer({ path: '/args' }, {
+      args: [ 'a', 'b' ],
+      source: [
+        'call_user_func(function() {',
+        '  header("X-Args: yes");',
+        '  setcookie("a", "b");',
+        '  echo count($argv);',
+        '})',
+      ].join('\n'),
+    }).spread(function(phpvalue, output, response) {
+      output.should.be.equal('2');
+      response.should.have.status(200);
+      response.should.have.header('x-args', 'yes');
+      response.headers['set-cookie'].should.eql(['a=b']);
     });
   });
 });
@@ -1,3 +1,4 @@
+var Promise = require('prfun');
 var StringStream = require('../test-stream.js');
 require('should');
 
@@ -25,6 +26,17 @@ describe('Invoking asynchronous JS methods from PHP', function() {
         throw new Error('late sync exception (after cb registered)');
       }
     },
+    testPromise: function(value) {
+      return new Promise(function(resolve, reject) {
+        setTimeout(function() {
+          if (value === 'reject') {
+            reject(new Error('rejected'));
+          } else {
+            resolve(value + 1);
+          }
+        }, 1);
+      });
+    },
   };
   it('should return values and not block the JS thread', function() {
     var out = new StringStream();
@@ -106,4 +118,76 @@ describe('Invoking asynchronous JS methods from PHP', function() {
       out.toString().should.equal('');
     });
   });
+  it('should wait for promises', function() {
+    var out = new StringStream();
+    return php.request({
+      stream: out,
+      context: context,
+      source: [
+        'call_user_func(function () {',
+        '  $c = $_SERVER["CONTEXT"];',
+        '  $a = $c->testPromise(1, new Js\\Wait());',
+        '  $b = $c->testPromise(10)->wait();',
+        '  try {',
+        '    $c->testPromise("reject")->wait();',
+        '  } catch (Exception $e) {',
+        '    return "$a $b exception caught";',
+        '  }',
+        '})',
+      ].join('\n'),
+    }).then(function(v) {
+      v.should.equal('2 11 exception caught');
+      out.toString().should.equal('');
+    });
+  });
+  it('should run async calls concurrently', function() {
+    var out = new StringStream();
+    return php.request({
+      stream: out,
+      context: context,
+      source: [
+        'call_user_func(function () {',
+        '  $c = $_SERVER["CONTEXT"];',
+        // Never waited for, but the request won't finish before it does.
+        '  $c->setTimeout(new Js\\Async(), 10);',
+        '  $a = $c->testAsync(1, 2, new Js\\Async());',
+        '  $b = $c->testPromise(10, new Js\\Async());',
+        '  $l = $c->testAsync("late", "x", new Js\\Async());',
+        '  $r = Js\\Future::all(["a" => $a, "b" => $b, 5]);',
+        '  try {',
+        '    $l->wait();',
+        '  } catch (Exception $e) {',
+        '    $r[] = "exception caught";',
+        '  }',
+        '  return implode(" ", $r) . ($a->isDone() ? " done" : "");',
+        '})',
+      ].join('\n'),
+    }).then(function(v) {
+      v.should.equal('4 11 5 exception caught done');
+      out.toString().should.equal('');
+    });
+  });
+  it('should run callbacks on the PHP event loop', function() {
+    var out = new StringStream();
+    return php.request({
+      stream: out,
+      context: context,
+      source: [
+        'call_user_func(function () {',
+        '  $c = $_SERVER["CONTEXT"];',
+        '  $c->testAsync(1, 2, new Js\\Async(function($e, $v) {',
+        '    echo "got $v ";',
+        '  }));',
+        '  $c->testAsync("late", "x", new Js\\Async(function($e, $v) {',
+        '    echo $e ? "exception caught" : "no exception";',
+        '  }));',
+        '  echo "started ";',
+        '  return 5;',
+        '})',
+      ].join('\n'),
+    }).then(function(v) {
+      v.should.equal(5);
+      out.toString().should.equal('started got 4 exception caught');
+    });
+  });
 });
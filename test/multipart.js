@@ -0,0 +1,139 @@
+var crypto = require('crypto');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var stream = require('readable-stream');
+var StringStream = require('../test-stream.js');
+require('should');
+
+describe('Spooling multipart uploads in node', function() {
+  var php = require('../');
+  var multipart = require('../lib/multipart.js');
+  var boundary = '----SpoolTest';
+  var body = [
+    '--' + boundary,
+    'Content-Disposition: form-data; name="title"',
+    '',
+    'Hello, world',
+    '--' + boundary,
+    'Content-Disposition: form-data; name="tags[]"',
+    '',
+    'a',
+    '--' + boundary,
+    'Content-Disposition: form-data; name="tags[]"',
+    '',
+    'b',
+    '--' + boundary,
+    'Content-Disposition: form-data; name="doc"; filename="dir/notes.txt"',
+    'Content-Type: text/plain',
+    '',
+    'spooled contents',
+    '--' + boundary,
+    'Content-Disposition: form-data; name="empty"; filename=""',
+    'Content-Type: application/octet-stream',
+    '',
+    '',
+    '--' + boundary + '--',
+    '',
+  ].join('\r\n');
+  var fakeRequest = function() {
+    var request = new stream.PassThrough();
+    request.method = 'POST';
+    request.url = '/upload';
+    request.httpVersion = '1.1';
+    request.headers = {
+      'content-type': 'multipart/form-data; boundary=' + boundary,
+      'content-length': '' + body.length,
+    };
+    // Deliver the body in small pieces, to exercise the parser.
+    for (var i = 0; i < body.length; i += 5) {
+      request.write(body.slice(i, i + 5));
+    }
+    request.end();
+    return request;
+  };
+  it('should find the boundary', function() {
+    multipart.boundary('multipart/form-data; boundary="a b"')
+      .should.equal('a b');
+    multipart.boundary('multipart/form-data; charset=utf-8; boundary=xyz')
+      .should.equal('xyz');
+    (multipart.boundary('text/plain') === null).should.be.true();
+  });
+  it('should populate $_POST and $_FILES', function() {
+    var out = new StringStream();
+    return php.request({
+      request: fakeRequest(),
+      stream: out,
+      spoolUploads: true,
+      source: [
+        'call_user_func(function() {',
+        '  $doc = $_FILES["doc"];',
+        '  $moved = tempnam(sys_get_temp_dir(), "moved");',
+        '  $ok = move_uploaded_file($doc["tmp_name"], $moved);',
+        '  $contents = file_get_contents($moved);',
+        '  unlink($moved);',
+        '  unset($_FILES["doc"]["tmp_name"]);',
+        '  return json_encode([$_POST, $_FILES, $ok, $contents]);',
+        '})',
+      ].join('\n'),
+    }).then(function(result) {
+      JSON.parse(result).should.eql([
+        { title: 'Hello, world', tags: ['a', 'b'] },
+        {
+          doc: { name: 'notes.txt', type: 'text/plain', error: 0, size: 16 },
+          empty: {
+            name: '', type: 'application/octet-stream', tmp_name: '',
+            error: 4, size: 0,
+          },
+        },
+        true,
+        'spooled contents',
+      ]);
+    });
+  });
+  it('should report files which are too large', function() {
+    return php.request({
+      request: fakeRequest(),
+      stream: new StringStream(),
+      spoolUploads: { maxFileSize: 10 },
+      source: 'json_encode($_FILES["doc"])',
+    }).then(function(result) {
+      JSON.parse(result).should.eql({
+        name: 'notes.txt', type: 'text/plain', tmp_name: '', error: 1,
+        size: 0,
+      });
+    });
+  });
+  it('should fail requests which exceed the limits', function() {
+    var dir = path.join(os.tmpdir(),
+                        'spooltest' + crypto.randomBytes(8).toString('hex'));
+    fs.mkdirSync(dir);
+    var fails = function(limits, message) {
+      limits.dir = dir;
+      return php.request({
+        request: fakeRequest(),
+        stream: new StringStream(),
+        spoolUploads: limits,
+        source: '"not reached"',
+      }).then(function() {
+        throw new Error('should have failed');
+      }, function(e) {
+        e.message.should.equal(message);
+        // Any spooled files should have been removed.
+        fs.readdirSync(dir).should.eql([]);
+      });
+    };
+    return fails({ maxFieldSize: 5 }, 'multipart field too large')
+      .then(function() {
+        return fails({ maxFields: 2 }, 'too many multipart fields');
+      }).then(function() {
+        return fails({ maxFiles: 0 }, 'too many multipart files');
+      }).then(function() {
+        // The file has been spooled by the time the body is too large.
+        return fails({ maxBodySize: body.length - 1 },
+                     'multipart body too large');
+      }).finally(function() {
+        fs.rmdirSync(dir);
+      });
+  });
+});
@@ -0,0 +1,151 @@
+var Promise = require('prfun');
+var StringStream = require('../test-stream.js');
+var util = require('util');
+require('should');
+
+// A StringStream which also counts the writes made to it.
+var CountingStream = function(opts) {
+  CountingStream.super_.call(this, opts);
+  this.writes = 0;
+};
+util.inherits(CountingStream, StringStream);
+CountingStream.prototype._write = function(chunk, encoding, callback) {
+  this.writes++;
+  return StringStream.prototype._write.call(this, chunk, encoding, callback);
+};
+
+describe('Buffered PHP output', function() {
+  var php = require('../');
+  afterEach(function() {
+    php.configure({ outputChunkSize: 64 * 1024,
+                    outputHighWaterMark: 1024 * 1024, });
+  });
+  var big = [
+    'call_user_func(function() {',
+    '  for ($i = 0; $i < 2000; $i++) {',
+    '    echo str_repeat("x", 99), "\\n";',
+    '  }',
+    '})',
+  ].join('\n');
+  it('should deliver large output intact, in a few writes', function() {
+    var out = new CountingStream();
+    return php.request({ source: big, stream: out }).then(function() {
+      out.toString().should.equal(
+        new Array(2001).join(new Array(100).join('x') + '\n')
+      );
+      out.writes.should.be.below(10);
+    });
+  });
+  it('should deliver everything with a tiny high-water mark', function() {
+    php.configure({ outputChunkSize: 0, outputHighWaterMark: 1 });
+    var out = new CountingStream();
+    return php.request({ source: big, stream: out }).then(function() {
+      out.toString().length.should.equal(200000);
+      out.writes.should.be.above(10);
+    });
+  });
+  it('should write everything out on flush()', function() {
+    var out = new StringStream();
+    return php.request({
+      stream: out,
+      context: { peek: function() { return out.toString(); } },
+      source: [
+        'call_user_func(function() {',
+        '  echo "before";',
+        '  ob_flush(); flush();',
+        '  echo "|", $_SERVER["CONTEXT"]->peek();',
+        '})',
+      ].join('\n'),
+    }).then(function() {
+      out.toString().should.equal('before|before');
+    });
+  });
+});
+
+describe('php.requestStream', function() {
+  var php = require('../');
+  var zlib = require('zlib');
+  it('should pipe through a compressor', function() {
+    var out = php.requestStream({
+      source: 'call_user_func(function() { echo str_repeat("abc", 100000); })',
+    });
+    var chunks = [];
+    var gz = out.pipe(zlib.createGzip());
+    gz.on('data', function(d) { chunks.push(d); });
+    return new Promise(function(resolve, reject) {
+      gz.on('end', resolve);
+      gz.on('error', reject);
+    }).then(function() {
+      var s = zlib.gunzipSync(Buffer.concat(chunks)).toString();
+      s.length.should.equal(300000);
+      return out.result;
+    });
+  });
+  it('should block PHP when the reader falls behind', function() {
+    var highWaterMark = 4096;
+    // PHP may have one chunk collected and one waiting to be accepted,
+    // on top of what the stream itself buffers.
+    var limit = 2 * 64 * 1024 + highWaterMark + 1000;
+    var produced = 0;
+    var consumed = 0;
+    var behind = 0;
+    var stalledAt = [];
+    var out = php.requestStream({
+      highWaterMark: highWaterMark,
+      context: {
+        progress: function(i) {
+          produced = i;
+          behind = Math.max(behind, i * 1000 - consumed);
+        },
+      },
+      source: [
+        'call_user_func(function() {',
+        '  for ($i = 1; $i <= 200; $i++) {',
+        '    echo str_repeat("x", 1000);',
+        '    $_SERVER["CONTEXT"]->progress($i);',
+        '  }',
+        '})',
+      ].join('\n'),
+    });
+    // Don't read anything until PHP stops making progress.  Without
+    // backpressure PHP would run to the end, far past `limit`.
+    var ended = false;
+    var last = -1;
+    var idle = 0;
+    var poll = function() {
+      if (ended) { return; }
+      // (Waiting for PHP to start doesn't count.)
+      idle = (produced > 0 && produced === last) ? idle + 1 : 0;
+      last = produced;
+      if (idle >= 3) {
+        stalledAt.push(produced);
+        var d;
+        while ((d = out.read()) !== null) { consumed += d.length; }
+        idle = 0;
+      }
+      setImmediate(poll);
+    };
+    poll();
+    return new Promise(function(resolve) {
+      out.on('end', resolve);
+    }).then(function() {
+      ended = true;
+      consumed.should.equal(200000);
+      produced.should.equal(200);
+      // PHP blocked part way through, until we read.
+      stalledAt[0].should.be.below(200);
+      behind.should.be.below(limit);
+    });
+  });
+  it('should report errors', function() {
+    var out = php.requestStream({
+      source: 'call_user_func(function() { throw new Exception("boo"); })',
+    });
+    out.resume();
+    return new Promise(function(resolve) {
+      out.on('error', resolve);
+    }).then(function(e) {
+      e.should.be.an.instanceOf(Error);
+    });
+  });
+});
@@ -1,3 +1,4 @@
+var Promise = require('prfun');
 var StringStream = require('../test-stream.js');
 
 require('should');
@@ -445,6 +446,49 @@ describe('Wrapped PHP objects accessed from JavaScript', function() {
       });
     });
   });
+  describe('should call asynchronously', function() {
+    var asyncCode = [
+      'call_user_func(function () {',
+      '  class Counter {',
+      '    public $n = 0;',
+      '    public function add($x) { $this->n += $x; return $this->n; }',
+      '    public function boom() { throw new Exception("boom"); }',
+      '  }',
+      '  $c = $_SERVER["CONTEXT"];',
+      '  return $c->jsfunc(new Counter(), new Js\\Wait());',
+      '})',
+    ].join('\n');
+    var testAsync = function(f) {
+      return php.request({
+        source: asyncCode,
+        context: { jsfunc: f },
+        stream: new StringStream(),
+      });
+    };
+    it('methods, in order', function() {
+      return testAsync(function(c, cb) {
+        Promise.all([
+          php.invokeAsync(c, 'add', [1]),
+          php.invokeAsync(c, 'add', [2]),
+        ]).then(function(r) {
+          cb(null, r.join(','));
+        }, cb);
+      }).then(function(v) {
+        v.should.equal('1,3');
+      });
+    });
+    it('methods which throw', function() {
+      return testAsync(function(c, cb) {
+        php.invokeAsync(c, 'boom').then(function() {
+          cb(null, 'not reached');
+        }, function(e) {
+          cb(null, e instanceof Error ? 'rejected' : 'huh');
+        });
+      }).then(function(v) {
+        v.should.equal('rejected');
+      });
+    });
+  });
   describe('should invoke', function() {
     it.skip('magic methods', function() {
       return test(function(c, m) {
@@ -0,0 +1,75 @@
+require('should');
+
+var stream = require('readable-stream');
+var StringStream = require('../test-stream.js');
+
+describe('Prewarmed request contexts', function() {
+  var php = require('../');
+  var source = [
+    'call_user_func(function() {',
+    '  return json_encode([',
+    '    $_GET, $_COOKIE, $_SERVER["REQUEST_URI"], $_SERVER["CONTEXT"]->x,',
+    '  ]);',
+    '})',
+  ].join('\n');
+  var fakeRequest = function(url) {
+    return {
+      method: 'GET',
+      url: url,
+      httpVersion: '1.1',
+      headers: { cookie: 'flavor=oatmeal' },
+    };
+  };
+  var run = function(url, x) {
+    return php.request({
+      source: source,
+      request: fakeRequest(url),
+      context: { x: x },
+      stream: new StringStream(),
+    }).then(JSON.parse);
+  };
+  // Give idle threads a chance to warm up.
+  var idle = function() {
+    return new Promise(function(resolve) { setTimeout(resolve, 100); });
+  };
+  afterEach(function() {
+    php.configure({ prewarm: false });
+  });
+  it('should see the details of each request', function() {
+    php.configure({ prewarm: true });
+    var before = php.stats().startup;
+    return idle().then(function() {
+      return run('/one?a=1', 1);
+    }).then(function(r) {
+      r.should.eql([{ a: '1' }, { flavor: 'oatmeal' }, '/one?a=1', 1]);
+      return idle();
+    }).then(function() {
+      return run('/two?b=2', 2);
+    }).then(function(r) {
+      r.should.eql([{ b: '2' }, { flavor: 'oatmeal' }, '/two?b=2', 2]);
+      var after = php.stats().startup;
+      (after.warm - before.warm).should.be.above(0);
+    });
+  });
+  it('should still accept POST bodies', function() {
+    php.configure({ prewarm: true });
+    var request = new stream.PassThrough();
+    request.end('a=b');
+    request.method = 'POST';
+    request.url = '/post';
+    request.httpVersion = '1.1';
+    request.headers = {
+      'content-type': 'application/x-www-form-urlencoded',
+      'content-length': '3',
+    };
+    return idle().then(function() {
+      return php.request({
+        source: 'json_encode($_POST)',
+        request: request,
+        stream: new StringStream(),
+      });
+    }).then(function(r) {
+      JSON.parse(r).should.eql({ a: 'b' });
+    });
+  });
+});
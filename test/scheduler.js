@@ -0,0 +1,112 @@
+require('should');
+
+var Promise = require('prfun');
+var Scheduler = require('../lib/scheduler.js');
+
+describe('Request scheduler', function() {
+  // Returns a task function plus a way to finish it.
+  var task = function(log, name) {
+    var finish;
+    var fn = function() {
+      log.push(name);
+      return new Promise(function(resolve) { finish = resolve; });
+    };
+    fn.finish = function() { finish(name); };
+    return fn;
+  };
+  it('should limit the number of requests in flight', function() {
+    var log = [];
+    var s = new Scheduler({ maxInFlight: 2 });
+    var a = task(log, 'a'), b = task(log, 'b'), c = task(log, 'c');
+    var pa = s.schedule({}, a);
+    var pb = s.schedule({}, b);
+    var pc = s.schedule({}, c);
+    log.should.eql(['a', 'b']);
+    s.stats().should.have.properties({ inFlight: 2, queued: 1 });
+    a.finish();
+    return pa.then(function(v) {
+      v.should.equal('a');
+      log.should.eql(['a', 'b', 'c']);
+      b.finish(); c.finish();
+      return Promise.all([pb, pc]);
+    }).then(function(v) {
+      v.should.eql(['b', 'c']);
+      s.stats().should.have.properties({
+        inFlight: 0, queued: 0, started: 3, completed: 3,
+      });
+    });
+  });
+  it('should start higher priority requests first', function() {
+    var log = [];
+    var s = new Scheduler({ maxInFlight: 1 });
+    var first = task(log, 'first');
+    var all = [
+      s.schedule({}, first),
+      s.schedule({ priority: 'low' }, task(log, 'low')),
+      s.schedule({ priority: 'normal' }, task(log, 'normal')),
+      s.schedule({ priority: 'high' }, task(log, 'high')),
+    ];
+    s.stats().queuedByPriority.should.eql({ high: 1, normal: 1, low: 1 });
+    first.finish();
+    return all[0].then(function() {
+      log.should.eql(['first', 'high']);
+    });
+  });
+  it('should reject requests when the queue is full', function() {
+    var log = [];
+    var s = new Scheduler({ maxInFlight: 1, maxQueued: 1 });
+    s.schedule({}, task(log, 'a'));
+    s.schedule({}, task(log, 'b'));
+    return s.schedule({}, task(log, 'c')).then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.should.have.property('code', 'EPHPQUEUEFULL');
+      s.stats().rejected.should.equal(1);
+      log.should.eql(['a']);
+    });
+  });
+  it('should shed lower priority requests to admit higher', function() {
+    var log = [];
+    var s = new Scheduler({ maxInFlight: 1, maxQueued: 1 });
+    var a = task(log, 'a');
+    s.schedule({}, a);
+    var low = s.schedule({ priority: 'low' }, task(log, 'low'));
+    s.schedule({ priority: 'high' }, task(log, 'high'));
+    return low.then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.should.have.property('code', 'EPHPQUEUEFULL');
+      a.finish();
+      return Promise.delay(0);
+    }).then(function() {
+      log.should.eql(['a', 'high']);
+    });
+  });
+  it('should drop requests whose deadline passes while queued', function() {
+    var log = [];
+    var s = new Scheduler({ maxInFlight: 1 });
+    var a = task(log, 'a');
+    s.schedule({}, a);
+    var late = s.schedule({ deadline: Date.now() + 10 }, task(log, 'late'));
+    return late.then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.should.have.property('code', 'EPHPDEADLINE');
+      s.stats().should.have.properties({ queued: 0, expired: 1 });
+      a.finish();
+      return Promise.delay(0);
+    }).then(function() {
+      log.should.eql(['a']);
+    });
+  });
+  it('should reject requests whose deadline has already passed', function() {
+    var s = new Scheduler();
+    return s.schedule({ deadline: Date.now() - 1 }, function() {
+      throw new Error('should not be reached');
+    }).then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.should.have.property('code', 'EPHPDEADLINE');
+    });
+  });
+});
@@ -0,0 +1,97 @@
+require('should');
+
+var StringStream = require('../test-stream.js');
+
+describe('Long-lived PHP contexts', function() {
+  var php = require('../');
+  var setup = [
+    'call_user_func(function() {',
+    '  $GLOBALS["count"] = 0;',
+    '  function bump($n) { return $GLOBALS["count"] += $n; }',
+    '  return null;',
+    '})',
+  ].join('\n');
+  it('should keep state between calls', function() {
+    var out = new StringStream();
+    var ctx;
+    return php.openContext({ source: setup, stream: out }).then(function(c) {
+      ctx = c;
+      return ctx.call('bump', [1]);
+    }).then(function(v) {
+      v.should.equal(1);
+      return ctx.call('bump', [41]);
+    }).then(function(v) {
+      v.should.equal(42);
+      return ctx.eval('print("count is " . $GLOBALS["count"])');
+    }).then(function() {
+      return ctx.close();
+    }).then(function() {
+      out.toString().should.equal('count is 42');
+    });
+  });
+  it('should run calls in order', function() {
+    var ctx;
+    return php.openContext({
+      source: setup,
+      stream: new StringStream(),
+    }).then(function(c) {
+      ctx = c;
+      var calls = [];
+      for (var i = 0; i < 10; i++) {
+        calls.push(ctx.call('bump', [1]));
+      }
+      return Promise.all(calls);
+    }).then(function(v) {
+      v.should.eql([1, 2, 3, 4, 5, 6, 7, 8, 9, 10]);
+      return ctx.close();
+    });
+  });
+  it('should report PHP exceptions', function() {
+    var ctx;
+    return php.openContext({ stream: new StringStream() }).then(function(c) {
+      ctx = c;
+      return ctx.eval(
+        'call_user_func(function() { throw new Exception("boo"); })'
+      );
+    }).then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.should.be.an.instanceOf(Error);
+      // The context is still usable.
+      return ctx.eval('6 * 7');
+    }).then(function(v) {
+      v.should.equal(42);
+      return ctx.close();
+    });
+  });
+  it('should recycle the request after enough calls', function() {
+    var ctx;
+    return php.openContext({
+      source: setup,
+      stream: new StringStream(),
+      recycleCalls: 2,
+    }).then(function(c) {
+      ctx = c;
+      return Promise.all([
+        ctx.call('bump', [1]), ctx.call('bump', [1]),
+        ctx.call('bump', [1]), ctx.call('bump', [1]),
+      ]);
+    }).then(function(v) {
+      // The second pair ran in a fresh request.
+      v.should.eql([1, 2, 1, 2]);
+      ctx.recycled.should.be.above(0);
+      return ctx.close();
+    });
+  });
+  it('should reject calls after close', function() {
+    return php.openContext({ stream: new StringStream() }).then(function(c) {
+      return c.close().then(function() {
+        return c.eval('1');
+      });
+    }).then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.should.have.property('code', 'EPHPCLOSED');
+    });
+  });
+});
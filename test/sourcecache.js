@@ -0,0 +1,68 @@
+var Promise = require('prfun');
+require('should');
+
+var StringStream = require('../test-stream.js');
+
+describe('Compiled source cache', function() {
+  var php = require('../');
+  before(function() { php.configure({ sourceCacheSize: 1024 }); });
+  after(function() { php.configure({ sourceCacheSize: 0 }); });
+  var source = '"cached " . (20 + 22)';
+  var run = function(opts) {
+    var out = new StringStream();
+    opts.stream = out;
+    return php.request(opts).then(function(v) {
+      return [v, out.toString()];
+    });
+  };
+  it('should give the same result on a hit', function() {
+    var before = php.stats().sourceCache;
+    return run({ source: source }).then(function(r) {
+      r.should.eql(['cached 42', '']);
+      return run({ source: source });
+    }).then(function(r) {
+      r.should.eql(['cached 42', '']);
+      var after = php.stats().sourceCache;
+      (after.hits - before.hits).should.be.above(0);
+      (after.misses - before.misses).should.be.below(2);
+    });
+  });
+  it('should be bypassed when disabled for a request', function() {
+    var before = php.stats().sourceCache;
+    return run({ source: source, sourceCache: false }).then(function(r) {
+      r.should.eql(['cached 42', '']);
+      var after = php.stats().sourceCache;
+      after.hits.should.equal(before.hits);
+      after.misses.should.equal(before.misses);
+    });
+  });
+  it('should reuse evicted files without running stale code', function() {
+    var ns = [1, 2, 3, 1, 2, 3];
+    php.configure({ sourceCacheSize: 2 });
+    return ns.reduce(function(p, n) {
+      return p.then(function(results) {
+        return run({ source: '"evict " . ' + n }).then(function(r) {
+          return results.concat(r[0]);
+        });
+      });
+    }, Promise.resolve([])).then(function(results) {
+      results.should.eql(ns.map(function(n) { return 'evict ' + n; }));
+      php.stats().sourceCache.entries.should.be.below(3);
+    }).finally(function() {
+      php.configure({ sourceCacheSize: 1024 });
+    });
+  });
+  it('should handle exceptions in cached source', function() {
+    var src = 'call_user_func(function() { throw new Exception("boo"); })';
+    return run({ source: src }).then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.message.should.match(/boo/);
+      return run({ source: src });
+    }).then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.message.should.match(/boo/);
+    });
+  });
+});
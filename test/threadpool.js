@@ -0,0 +1,70 @@
+require('should');
+
+var StringStream = require('../test-stream.js');
+
+describe('PHP thread pool', function() {
+  var php = require('../');
+  var os = require('os');
+  var blocker = [
+    'call_user_func(function() {',
+    '  $ctx = $_SERVER["CONTEXT"];',
+    '  return $ctx->arrive(new Js\\Wait);',
+    '})',
+  ].join('\n');
+  afterEach(function() {
+    php.configure({
+      threads: os.cpus().length,
+      queueLimit: Infinity,
+      maxInFlight: null,
+    });
+  });
+  it('should run requests concurrently', function() {
+    php.configure({ threads: 2 });
+    // Neither request can finish until both are running.
+    var waiting = [];
+    var arrive = function(cb) {
+      waiting.push(cb);
+      if (waiting.length === 2) {
+        waiting.forEach(function(f) { f(null, 'ok'); });
+      }
+    };
+    var go = function() {
+      return php.request({
+        source: blocker,
+        context: { arrive: arrive },
+        stream: new StringStream(),
+      });
+    };
+    return Promise.all([go(), go()]).then(function(v) {
+      v.should.eql(['ok', 'ok']);
+    });
+  });
+  it('should reject requests when the queue is full', function() {
+    // Bypass the scheduler, so the native queue limit is what we hit.
+    php.configure({ threads: 1, queueLimit: 0, maxInFlight: 2 });
+    var release;
+    var first = php.request({
+      source: blocker,
+      context: { arrive: function(cb) { release = cb; } },
+      stream: new StringStream(),
+    });
+    var second = php.request({
+      source: '"unreachable"',
+      stream: new StringStream(),
+    });
+    return second.then(function() {
+      throw new Error('should not be reached');
+    }, function(e) {
+      e.should.have.property('code', 'EPHPQUEUEFULL');
+      // Let the first request finish.
+      var done = function() {
+        if (release) { return release(null, 'first'); }
+        setTimeout(done, 10);
+      };
+      done();
+      return first;
+    }).then(function(v) {
+      v.should.equal('first');
+    });
+  });
+});